@@ -9,8 +9,203 @@
 #include "share_memory.h"
 
 // 全局变量
+Geometry geometry;
+Journal journal;
+SnapshotTable snapshot_table;
+OrphanList orphan_list;
+QuotaTable quota_table;
+NameIndex name_index;      // 文件名索引, 第一次按名字查找时建立
+VersionTable version_table;
+CompressStats compress_stats; // 压缩和解压的累计用量, info显示
 InodeBitmap inode_bitmap;
 BlockBitmap block_bitmap;
+FileTable file_tables[10]; // 每个用户的打开文件表
+LockManager lock_manager;  // 文件锁, 持有者是用户编号
+
+/**
+ * @brief 判断命令是否会修改文件系统
+ * @param cmd 命令
+ * @param options 命令选项
+ * @return 是否会修改文件系统
+ */
+bool is_modify_command(const std::string &cmd, std::map<std::string, std::string> &options) {
+    static const std::set<std::string> modify = {"init", "INIT", "md", "MD", "rd", "RD", "newfile", "NEWFILE",
+                                                 "copy", "COPY", "del", "DEL", "adduser", "ADDUSER", "resize", "RESIZE",
+                                                 "write", "WRITE", "chmod", "CHMOD", "move", "MOVE",
+                                                 "compress", "COMPRESS"};
+    if (options.find("-h") != options.end()) {
+        return false;
+    }
+    return modify.count(cmd) || ((cmd == "cat" || cmd == "CAT") && !options["-i"].empty()) ||
+           ((cmd == "open" || cmd == "OPEN") && (!options["-w"].empty() || !options["-a"].empty())) ||
+           ((cmd == "quota" || cmd == "QUOTA") && (options.count("-b") || options.count("-i")));
+}
+
+/**
+ * @brief 判断命令是否只读取文件内容、目录或移动读写位置
+ * 这些命令不等待写者, 读到的是已写入磁盘的版本
+ * @param cmd 命令
+ * @param options 命令选项
+ * @return 是否只读
+ */
+bool is_read_command(const std::string &cmd, std::map<std::string, std::string> &options) {
+    static const std::set<std::string> read = {"dir", "DIR", "ls", "LS", "read", "READ", "lseek", "LSEEK", "du", "DU", "find", "FIND", "grep", "GREP"};
+    return read.count(cmd) || ((cmd == "cat" || cmd == "CAT") && options["-i"].empty()) ||
+           ((cmd == "open" || cmd == "OPEN") && options["-w"].empty() && options["-a"].empty());
+}
+
+/**
+ * @brief 判断文件是否被某个用户打开
+ * @param inode_id 文件的inode编号
+ * @return 是否被打开
+ */
+bool is_file_open(uint32_t inode_id) {
+    for (const FileTable &table : file_tables) {
+        if (table.holds(inode_id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief 关闭文件描述符, 先写入追加缓冲, 再释放打开时获得的文件锁和固定的版本
+ * @param user 用户编号
+ * @param fd 文件描述符
+ * @return 追加缓冲是否全部写入
+ */
+bool close_open_file(int user, int fd) {
+    OpenFile &file = file_tables[user].files[fd];
+    bool flushed = file.flush();
+    if (file.inode_id != UINT32_MAX) {
+        lock_manager.release(user, {{file.inode_id, file.is_write ? LOCK_WRITE : LOCK_SHARED}});
+        version_table.unpin(file.version);
+    }
+    file_tables[user].close(fd);
+    return flushed;
+}
+
+/**
+ * @brief 写入打开文件的追加缓冲
+ * 修改文件系统的命令执行前写入所有用户的缓冲, 只读的命令只写入自己的缓冲, 读到的是其他用户已写入的版本
+ * @param expired_only 只写入停留超过APPEND_FLUSH_SECONDS的缓冲
+ * @param user 只写入这个用户的缓冲, -1表示所有用户
+ */
+void flush_open_files(bool expired_only, int user = -1) {
+    uint32_t now = static_cast<uint32_t>(time(0));
+    for (int u = 0; u < 10; u++) {
+        if (user != -1 && u != user) {
+            continue;
+        }
+        for (OpenFile &file : file_tables[u].files) {
+            if (!file.pending.empty() && (!expired_only || now - file.pending_since >= APPEND_FLUSH_SECONDS)) {
+                file.flush();
+            }
+        }
+    }
+}
+
+/**
+ * @brief 关闭用户打开的所有文件, 用于重新登录、切换快照和格式化
+ * @param user 用户编号
+ */
+void close_all_files(int user) {
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        close_open_file(user, fd);
+    }
+}
+
+/**
+ * @brief 按参数取出打开的文件
+ * 文件在打开后被删除时关闭这个描述符
+ * @param user 用户编号
+ * @param arg 文件描述符参数
+ * @param _shell_output 输出信息
+ * @return 打开的文件, 描述符无效时为空
+ */
+OpenFile *get_open_file(int user, const std::string &arg, std::string &_shell_output) {
+    if (arg.empty() || arg.size() > 2 || !std::all_of(arg.begin(), arg.end(), ::isdigit) || std::stoi(arg) >= MAX_OPEN_FILES ||
+        file_tables[user].files[std::stoi(arg)].inode_id == UINT32_MAX) {
+        std::cout << __ERROR << "无效的文件描述符" << arg << __NORMAL << std::endl;
+        _shell_output += __ERROR + "无效的文件描述符" + arg + __NORMAL + "\n";
+        return nullptr;
+    }
+    int fd = std::stoi(arg);
+    OpenFile &file = file_tables[user].files[fd];
+    if (!inode_bitmap.is_used(file.inode_id) || Inode::read_inode(file.inode_id).i_ctime != file.ctime) {
+        std::cout << __ERROR << "文件" << file.path << "已被删除" << __NORMAL << std::endl;
+        _shell_output += __ERROR + "文件" + file.path + "已被删除" + __NORMAL + "\n";
+        close_open_file(user, fd);
+        return nullptr;
+    }
+    return &file;
+}
+
+/**
+ * @brief 按路径找到文件的inode编号
+ * @param arg 文件路径, 可以是相对于当前目录的路径
+ * @param cur_inode 当前目录的inode
+ * @return inode编号, 文件不存在时为UINT32_MAX
+ */
+uint32_t find_file(const std::string &arg, const Inode &cur_inode) {
+    if (arg.empty() || arg.back() == '/') {
+        return UINT32_MAX;
+    }
+    size_t pos = arg.find_last_of('/');
+    std::string file_path = pos == std::string::npos ? "" : arg.substr(0, pos + 1);
+    std::string file_name = arg.substr(pos + 1);
+    if (arg.front() != '/') {
+        file_path = get_absolute_path(cur_inode.i_id) + file_path;
+    }
+    uint32_t start_id = 0;
+    if (!is_dir_exit(file_path, start_id)) {
+        return UINT32_MAX;
+    }
+    Inode dir_inode = Inode::read_inode(start_id);
+    return get_file_inode_id(file_name, dir_inode);
+}
+
+/**
+ * @brief 命令执行期间需要的文件锁
+ * cat读文件时不加锁, 读到的是已写入的版本; 打开文件读加共享锁, 写入加写锁, 覆盖和删除文件加排他锁;
+ * open获得的锁在关闭文件时才释放
+ * @param cmd 命令
+ * @param options 命令选项
+ * @param arg 命令参数
+ * @param cur_inode 当前目录的inode
+ * @return 需要的锁
+ */
+std::vector<LockRequest> command_locks(const std::string &cmd, const std::map<std::string, std::string> &options, const std::string &arg,
+                                       const Inode &cur_inode) {
+    std::vector<LockRequest> locks;
+    auto has = [&](const char *option) {
+        auto it = options.find(option);
+        return it != options.end() && !it->second.empty();
+    };
+    auto add = [&](const std::string &path, LockMode mode) {
+        uint32_t inode_id = find_file(path, cur_inode);
+        if (inode_id != UINT32_MAX) {
+            locks.push_back({inode_id, mode});
+        }
+    };
+    if (has("-h")) {
+        return locks;
+    }
+    if (cmd == "cat" || cmd == "CAT") {
+        if (has("-i")) {
+            add(arg, LOCK_WRITE);
+        }
+    } else if (cmd == "open" || cmd == "OPEN") {
+        add(arg, has("-w") || has("-a") ? LOCK_WRITE : LOCK_SHARED);
+    } else if (cmd == "del" || cmd == "DEL") {
+        add(arg, LOCK_EXCLUSIVE);
+    } else if (cmd == "copy" || cmd == "COPY") {
+        add(arg, LOCK_EXCLUSIVE);
+    } else if (cmd == "compress" || cmd == "COMPRESS") {
+        add(arg, LOCK_EXCLUSIVE);
+    }
+    return locks;
+}
 
 // 服务端程序的逻辑
 int main() {
@@ -22,6 +217,15 @@ int main() {
         std::cout<<"文件系统初始化成功"<<std::endl;
     }
     file.close();
+    // 挂载: 按超级块确定布局，重放日志后读取位图
+    geometry.load(SuperBlock::read_super_block());
+    journal.mount();
+    inode_bitmap.load_bitmap(SuperBlock::read_super_block().inode_tree);
+    block_bitmap.load_bitmap();
+    snapshot_table.load();
+    orphan_list.load();
+    quota_table.load();
+    upgrade_disk();
     // 创建内存映射文件
     HANDLE hMapFile = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(SharedMemory), "SimdiskSharedMemory");
     if (hMapFile == NULL) {
@@ -50,8 +254,6 @@ int main() {
 
         shm->user_list[i].cur_dir_inode_id = 0;
         shm->user_list[i].cur_user = -1;
-        shm->open_file_table.opened_file[i].inode_id = -1;
-        shm->open_file_table.opened_file[i].is_write = false;
     }
 
     std::string shell_output = "";
@@ -59,8 +261,11 @@ int main() {
     root_inode = Inode::read_inode(0);
     SuperBlock sb = SuperBlock::read_super_block();      // 读超级块
     uint32_t load_time = static_cast<uint32_t>(time(0)); // 保留登录时间
+    int snapshot_view[10];                               // 每个用户挂载的快照, -1表示实时文件系统
+    std::fill(snapshot_view, snapshot_view + 10, -1);
 
     while (1) {
+        std::vector<int> finished; // 本轮已执行完命令、等待组提交的用户
 
         // 确定是否有shell需要登录
         std::string user_label;
@@ -82,6 +287,8 @@ int main() {
                 strncpy(shm->user_list[i].result, shell_output.c_str(), sizeof(shm->user_list[i].result) - 1);
                 if (shm->user_list[i].is_login_success) {
                     shm->user_list[std::stoi(user_label)].user = user;
+                    snapshot_view[std::stoi(user_label)] = -1;
+                    close_all_files(std::stoi(user_label));
                     shell_output = __USER + user.username + "@FileSystem" + __NORMAL + ":" + __PATH + '/' + __NORMAL + "$ ";
                     strncpy(shm->user_list[i].result, shell_output.c_str(), sizeof(shm->user_list[i].result) - 1);
                     continue;
@@ -93,6 +300,12 @@ int main() {
             if (shm->user_list[i].ready) {
                 // 确定指令的发起用户及其所在目录
                 User user = shm->user_list[i].user;
+                if (snapshot_view[i] != -1 && snapshot_table.slots[snapshot_view[i]].entry.state != SNAPSHOT_ACTIVE) {
+                    // 快照因空间不足失效，回到实时文件系统
+                    snapshot_view[i] = -1;
+                    shm->user_list[i].cur_dir_inode_id = 0;
+                }
+                snapshot_table.view = snapshot_view[i];
                 Inode cur_inode = Inode::read_inode(shm->user_list[i].cur_dir_inode_id);
                 std::string path = get_absolute_path(cur_inode.i_id);
                 // 读取shell输入
@@ -125,29 +338,129 @@ int main() {
                     arg = args.back();
                 }
 
+                // 命令涉及的文件先加锁, 与其他用户打开的文件冲突时留在等待队列中, 下一轮再试
+                std::vector<LockRequest> locks;
+                if (snapshot_view[i] == -1) {
+                    locks = command_locks(cmd, options, arg, cur_inode);
+                }
+                bool lock_timeout = false;
+                if (!lock_manager.acquire(i, locks)) {
+                    if (lock_manager.waited(i) < LOCK_TIMEOUT_SECONDS) {
+                        snapshot_table.view = -1;
+                        continue;
+                    }
+                    lock_manager.cancel(i);
+                    locks.clear();
+                    lock_timeout = true;
+                }
+
                 /*******处理命令********/
                 shell_output = "";
-                if (cmd == "shutdown" || cmd == "shutdown") {
+                journal.begin(); // 每条命令的元数据修改作为一个事务
+                if (is_read_command(cmd, options)) {
+                    flush_open_files(false, i);
+                } else if (cmd != "write" && cmd != "WRITE") {
+                    flush_open_files(false);
+                }
+                // 挂载快照后只有浏览目录和读文件的命令从快照中读取
+                if (cmd != "cd" && cmd != "CD" && cmd != "dir" && cmd != "DIR" && cmd != "ls" && cmd != "LS" &&
+                    cmd != "cat" && cmd != "CAT") {
+                    snapshot_table.view = -1;
+                }
+                if (lock_timeout) {
+                    std::cout << __ERROR << "等待文件锁超时，文件正被其他用户使用" << __NORMAL << std::endl;
+                    shell_output += __ERROR + "等待文件锁超时，文件正被其他用户使用" + __NORMAL + "\n";
+                } else if (snapshot_view[i] != -1 && is_modify_command(cmd, options)) {
+                    std::cout << __ERROR << "快照是只读的，请先使用snapshot -u卸载快照" << __NORMAL << std::endl;
+                    shell_output += __ERROR + "快照是只读的，请先使用snapshot -u卸载快照" + __NORMAL + "\n";
+                } else if (cmd == "shutdown" || cmd == "shutdown") {
                     if (options.find("-h") != options.end()) {
                         shell_output += "shutdown: 退出程序\n";
                         shell_output += "用法: shutdown\n";
                     } else {
                         shm->user_list[i].user = User();
-                        shm->user_list[i].done = true;
-                        shm->user_list[i].ready = false;
+                        finished.push_back(i);
                         goto LABEL;
                         break;
                     }
                 } else if (cmd == "init" || cmd == "INIT") {
                     if (options.find("-h") != options.end()) {
                         shell_output += "init: 初始化文件系统\n";
-                        shell_output += "用法: init\n";
+                        shell_output += "用法: init [-s <size>] [-b <block size>] [-i <inode count>]\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -s <size>: 镜像大小(MB)，默认为100\n";
+                        shell_output += "  -b <block size>: 块大小(字节)，默认为1024\n";
+                        shell_output += "  -i <inode count>: inode数，默认为12032\n";
                     } else {
-                        if (user.uid != 0) {
-                            shell_output += __ERROR + "你没有权限初始化文件系统" + __NORMAL + "\n";
-                        } else {
-                            init_disk();
+                        while (1) {
+                            if (user.uid != 0) {
+                                shell_output += __ERROR + "你没有权限初始化文件系统" + __NORMAL + "\n";
+                                break;
+                            }
+                            uint64_t fs_size = DEFAULT_FS_SIZE;
+                            uint32_t block_size = DEFAULT_BLOCK_SIZE;
+                            uint32_t inode_count = DEFAULT_INODE_COUNT;
+                            bool valid = true;
+                            for (const char *opt : {"-s", "-b", "-i"}) {
+                                if (options.find(opt) != options.end()) {
+                                    const std::string &value = options[opt];
+                                    valid = valid && !value.empty() && value.size() <= 9 && std::all_of(value.begin(), value.end(), ::isdigit);
+                                }
+                            }
+                            if (!valid) {
+                                shell_output += __ERROR + "请输入正确的参数" + __NORMAL + "\n";
+                                break;
+                            }
+                            if (options.find("-s") != options.end()) {
+                                fs_size = std::stoull(options["-s"]) * 1024 * 1024;
+                            }
+                            if (options.find("-b") != options.end()) {
+                                block_size = std::stoul(options["-b"]);
+                            }
+                            if (options.find("-i") != options.end()) {
+                                inode_count = std::stoul(options["-i"]);
+                            }
+                            std::string error = Geometry::check(fs_size, block_size, inode_count);
+                            if (!error.empty()) {
+                                shell_output += __ERROR + error + __NORMAL + "\n";
+                                break;
+                            }
+                            init_disk(fs_size, block_size, inode_count);
                             sb = SuperBlock::read_super_block();
+                            root_inode = Inode::read_inode(0);
+                            cur_inode = root_inode;
+                            path = "/";
+                            std::fill(snapshot_view, snapshot_view + 10, -1);
+                            for (int k = 0; k < 10; ++k) {
+                                close_all_files(k);
+                            }
+                            shell_output += __SUCCESS + "文件系统初始化成功" + __NORMAL + "\n";
+                            break;
+                        }
+                    }
+                } else if (cmd == "resize" || cmd == "RESIZE") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "resize: 在线扩容文件系统\n";
+                        shell_output += "用法: resize -s <size>\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -s <size>: 新的镜像大小(MB)，必须大于当前大小\n";
+                    } else {
+                        while (1) {
+                            if (user.uid != 0) {
+                                shell_output += __ERROR + "你没有权限扩容文件系统" + __NORMAL + "\n";
+                                break;
+                            }
+                            const std::string &value = options["-s"];
+                            if (value.empty() || value.size() > 9 || !std::all_of(value.begin(), value.end(), ::isdigit)) {
+                                shell_output += __ERROR + "请输入正确的参数" + __NORMAL + "\n";
+                                break;
+                            }
+                            if (resize_disk(std::stoull(value) * 1024 * 1024, shell_output)) {
+                                sb = SuperBlock::read_super_block();
+                                std::cout << __SUCCESS << "文件系统扩容成功" << __NORMAL << std::endl;
+                                shell_output += __SUCCESS + "文件系统扩容成功, 当前共" + std::to_string(sb.block_count) + "块" + __NORMAL + "\n";
+                            }
+                            break;
                         }
                     }
                 } else if (cmd == "info" || cmd == "INFO") {
@@ -157,13 +470,16 @@ int main() {
                     } else {
                         sb.save_super_block();
                         shell_output = sb.print_super_block();
+                        shell_output += extent_summary();
+                        shell_output += compression_summary();
                         int user_count = 0;
                         for (int i = 0; i < 10; ++i) {
                             if (shm->user_list[i].is_login_success) {
                                 ++user_count;
                             }
                         }
-                        shell_output += "当前登录用户数: " + std::to_string(user_count) + "\n\n";
+                        shell_output += "当前登录用户数: " + std::to_string(user_count) + "\n";
+                        shell_output += "占用空间最多的目录(blocks bytes path):\n" + largest_dirs(TOP_DIRS) + "\n";
                     }
                 } else if (cmd == "cd" || cmd == "CD") {
                     while (1) {
@@ -296,6 +612,16 @@ int main() {
                                     shell_output += __ERROR + "你没有权限删除" + dir_path + __NORMAL + "\n";
                                     break;
                                 }
+                                // root之外的用户递归删除时需要能修改其中的每个目录
+                                if (!options["-rf"].empty() && user.uid != 0) {
+                                    std::vector<uint32_t> denied = unwritable_dirs(purpose_id, user);
+                                    if (!denied.empty()) {
+                                        std::string denied_path = get_absolute_path(denied.front());
+                                        std::cout << __ERROR << "你没有权限删除" << denied_path << __NORMAL << std::endl;
+                                        shell_output += __ERROR + "你没有权限删除" + denied_path + __NORMAL + "\n";
+                                        break;
+                                    }
+                                }
                                 if (is_dir_empty(purpose_id) || !options["-rf"].empty()) {
                                     if (del_dir(purpose_id, shell_output)) {
                                         std::cout << __SUCCESS << "目录" << dir_path << "删除成功" << __NORMAL << std::endl;
@@ -367,11 +693,6 @@ int main() {
                                     shell_output += __ERROR + "文件" + file_name + "创建失败" + __NORMAL + "\n";
                                     break;
                                 }   
-                                Inode __dir_inode = Inode::read_inode(start_id);
-                                uint32_t file_id = get_file_inode_id(file_name, __dir_inode);
-                                shm->open_file_table.add_file(file_id, true);
-                                Sleep(5000);
-                                shm->open_file_table.close_file(file_id);
                             } else { // 目录不存在
                                 if (!is_able_to_write(start_id, user)) {
                                     std::cout << __ERROR << "你没有权限创建" << arg << __NORMAL << std::endl;
@@ -386,11 +707,6 @@ int main() {
                                         shell_output += __ERROR + "文件" + file_name + "创建失败" + __NORMAL + "\n";
                                         break;
                                     }
-                                    Inode __dir_inode = Inode::read_inode(start_id);
-                                    uint32_t file_id = get_file_inode_id(file_name, __dir_inode);
-                                    shm->open_file_table.add_file(file_id, true);
-                                    Sleep(5000);
-                                    shm->open_file_table.close_file(file_id);
                                 }
                             }
                             shell_output += __SUCCESS + "文件" + file_name + "创建成功" + __NORMAL + "\n";
@@ -400,9 +716,12 @@ int main() {
                 } else if (cmd == "cat" || cmd == "CAT") {
                     if (options.find("-h") != options.end()) {
                         shell_output += "cat: 显示文件内容\n";
-                        shell_output += "用法: cat [-i <content>] <filename>\n";
+                        shell_output += "用法: cat [-i <content> | -o <offset> -n <length> | -t [lines]] <filename>\n";
                         shell_output += "选项:\n";
                         shell_output += "  -i <content>: 向文件追加内容\n";
+                        shell_output += "  -o <offset>: 从第offset个字节开始显示，默认为0\n";
+                        shell_output += "  -n <length>: 最多显示length个字节，默认到文件末尾\n";
+                        shell_output += "  -t [lines]: 显示文件的最后lines行，默认为10\n";
                     } else {
                         while (1) {
                             // 没有参数
@@ -434,40 +753,253 @@ int main() {
                                 Inode file_inode = Inode::read_inode(start_id);
                                 // 读文件
                                 if (options["-i"].empty()) {
-                                    if (!is_able_to_read(get_file_inode_id(file_name, cur_inode), user)) {
+                                    if (!is_able_to_read(get_file_inode_id(file_name, file_inode), user)) {
                                         std::cout << __ERROR << "你没有权限读取" << file_name << __NORMAL << std::endl;
                                         shell_output += __ERROR + "你没有权限读取" + file_name + __NORMAL + "\n";
                                         break;
                                     }
-                                    std::string output = read_file(file_path, file_name);
+                                    auto is_count = [](const std::string &value) {
+                                        return !value.empty() && value.size() <= 18 && std::all_of(value.begin(), value.end(), ::isdigit);
+                                    };
+                                    Inode target_inode = Inode::read_inode(get_file_inode_id(file_name, file_inode));
+                                    std::string output;
+                                    if (options.find("-t") != options.end()) {
+                                        // 不带行数时解析器会把文件名当作-t的参数
+                                        uint64_t lines = 10;
+                                        if (options["-t"] != "true" && options["-t"] != arg) {
+                                            if (!is_count(options["-t"])) {
+                                                std::cout << __ERROR << "请输入正确的行数" << __NORMAL << std::endl;
+                                                shell_output += __ERROR + "请输入正确的行数" + __NORMAL + "\n";
+                                                break;
+                                            }
+                                            lines = std::stoull(options["-t"]);
+                                        }
+                                        output = read_file_tail(target_inode, lines);
+                                    } else if (options.find("-o") != options.end() || options.find("-n") != options.end()) {
+                                        uint64_t offset = 0, length = UINT64_MAX;
+                                        if ((options.find("-o") != options.end() && !is_count(options["-o"])) ||
+                                            (options.find("-n") != options.end() && !is_count(options["-n"]))) {
+                                            std::cout << __ERROR << "请输入正确的偏移和长度" << __NORMAL << std::endl;
+                                            shell_output += __ERROR + "请输入正确的偏移和长度" + __NORMAL + "\n";
+                                            break;
+                                        }
+                                        if (options.find("-o") != options.end()) {
+                                            offset = std::stoull(options["-o"]);
+                                        }
+                                        if (options.find("-n") != options.end()) {
+                                            length = std::stoull(options["-n"]);
+                                        }
+                                        if (offset > target_inode.i_size) {
+                                            std::cout << __ERROR << "偏移超出文件大小(" << target_inode.i_size << "字节)" << __NORMAL << std::endl;
+                                            shell_output += __ERROR + "偏移超出文件大小(" + std::to_string(target_inode.i_size) + "字节)" + __NORMAL + "\n";
+                                            break;
+                                        }
+                                        output = read_file_range(target_inode, offset, length);
+                                    } else {
+                                        output = read_file(file_path, file_name);
+                                    }
                                     if (!output.empty()) {
                                         std::cout << output << std::endl;
                                         shell_output += output + "\n";
                                     }
                                 } else { // -i
-                                    int file_id = get_file_inode_id(file_name, cur_inode);
+                                    int file_id = get_file_inode_id(file_name, file_inode);
                                     if (!is_able_to_write(file_id, user)) {
                                         std::cout << __ERROR << "你没有权限写入" << file_name << __NORMAL << std::endl;
                                         shell_output += __ERROR + "你没有权限写入" + file_name + __NORMAL + "\n";
                                         break;
                                     }
-                                    if (shm->open_file_table.is_writing(file_id)) {
-                                        std::cout << __ERROR << "文件" << file_name << "正在被写入" << __NORMAL << std::endl;
-                                        shell_output += __ERROR + "文件" + file_name + "正在被写入" + __NORMAL + "\n";
+                                    if (!write_file(file_path, file_name, options["-i"])) {
+                                        shell_output += __ERROR + "磁盘空间不足或超出配额，部分内容没有写入" + __NORMAL + "\n";
                                         break;
-                                    } else {
-                                        shm->open_file_table.add_file(file_id, true);
-                                        Sleep(5000);
-                                        std::cout<<"writing"<<file_name<<std::endl;
                                     }
-                                    write_file(file_path, file_name, options["-i"]);
                                     shell_output += __SUCCESS + "文件" + file_name + "写入成功" + __NORMAL + "\n";
-                                    shm->open_file_table.close_file(file_id);
                                 }
                             }
                             break;
                         }
                     }
+                } else if (cmd == "open" || cmd == "OPEN") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "open: 打开文件，之后用文件描述符读写\n";
+                        shell_output += "用法: open [-w | -a] [filename]\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -w: 以读写方式打开\n";
+                        shell_output += "  -a: 以读写方式打开，读写位置在文件末尾\n";
+                        shell_output += "不带文件名时列出已打开的文件\n";
+                    } else {
+                        while (1) {
+                            if (arg.empty()) {
+                                shell_output += file_tables[i].list();
+                                break;
+                            }
+                            if (arg.front() == '-') {
+                                std::cout << __ERROR << "请输入文件名" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "请输入文件名" + __NORMAL + "\n";
+                                break;
+                            }
+                            // 将args分为文件名和路径
+                            size_t pos = arg.find_last_of('/');
+                            std::string file_path, file_name;
+                            if (pos != std::string::npos) {
+                                file_path = arg.substr(0, pos + 1);
+                                file_name = arg.substr(pos + 1);
+                            } else {
+                                file_path = "";
+                                file_name = arg;
+                            }
+                            if (arg.front() != '/') {
+                                file_path = get_absolute_path(cur_inode.i_id) + file_path;
+                            }
+                            uint32_t start_id = 0;
+                            if (!is_dir_exit(file_path, start_id) || !is_file_exit(file_name, Inode::read_inode(start_id))) {
+                                std::cout << __ERROR << "文件" << file_name << "不存在" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "文件" + file_name + "不存在" + __NORMAL + "\n";
+                                break;
+                            }
+                            Inode dir_inode = Inode::read_inode(start_id);
+                            uint32_t file_id = get_file_inode_id(file_name, dir_inode);
+                            bool is_write = !options["-w"].empty() || !options["-a"].empty();
+                            if (is_write ? !is_able_to_write(file_id, user) : !is_able_to_read(file_id, user)) {
+                                std::cout << __ERROR << "你没有权限打开" << file_name << __NORMAL << std::endl;
+                                shell_output += __ERROR + "你没有权限打开" + file_name + __NORMAL + "\n";
+                                break;
+                            }
+                            int fd = file_tables[i].open(file_id, start_id, is_write, file_path + file_name);
+                            if (fd == -1) {
+                                std::cout << __ERROR << "打开的文件数已达上限" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "打开的文件数已达上限" + __NORMAL + "\n";
+                                break;
+                            }
+                            // 打开期间一直持有文件锁, 写者之间互斥; 读者固定打开时的版本, 不受之后的写入影响
+                            lock_manager.acquire(i, {{file_id, is_write ? LOCK_WRITE : LOCK_SHARED}});
+                            if (!is_write) {
+                                file_tables[i].files[fd].version = version_table.pin(file_id);
+                            }
+                            if (!options["-a"].empty()) {
+                                file_tables[i].files[fd].offset = Inode::read_inode(file_id).i_size;
+                            }
+                            shell_output += __SUCCESS + "文件" + file_name + "已打开，文件描述符为" + std::to_string(fd) + __NORMAL + "\n";
+                            break;
+                        }
+                    }
+                } else if (cmd == "read" || cmd == "READ") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "read: 从打开的文件的当前位置读取\n";
+                        shell_output += "用法: read [-n <length>] <fd>\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -n <length>: 最多读取length个字节，默认读到文件末尾\n";
+                    } else {
+                        while (1) {
+                            OpenFile *file = get_open_file(i, arg, shell_output);
+                            if (file == nullptr) {
+                                break;
+                            }
+                            uint64_t length = UINT64_MAX;
+                            if (options.find("-n") != options.end()) {
+                                const std::string &value = options["-n"];
+                                if (value.empty() || value.size() > 18 || !std::all_of(value.begin(), value.end(), ::isdigit)) {
+                                    std::cout << __ERROR << "请输入正确的长度" << __NORMAL << std::endl;
+                                    shell_output += __ERROR + "请输入正确的长度" + __NORMAL + "\n";
+                                    break;
+                                }
+                                length = std::stoull(value);
+                            }
+                            std::string output = file->is_write ? read_file_range(Inode::read_inode(file->inode_id), file->offset, length, &file->cursor)
+                                                                : version_table.read(file->version, file->offset, length, &file->cursor);
+                            file->offset += output.size();
+                            if (!output.empty()) {
+                                std::cout << output << std::endl;
+                                shell_output += output + "\n";
+                            }
+                            break;
+                        }
+                    }
+                } else if (cmd == "write" || cmd == "WRITE") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "write: 从打开的文件的当前位置写入\n";
+                        shell_output += "用法: write -i <content> <fd>\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -i <content>: 写入的内容\n";
+                    } else {
+                        while (1) {
+                            OpenFile *file = get_open_file(i, arg, shell_output);
+                            if (file == nullptr) {
+                                break;
+                            }
+                            if (!file->is_write) {
+                                std::cout << __ERROR << "文件" << file->path << "不是以写方式打开的" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "文件" + file->path + "不是以写方式打开的" + __NORMAL + "\n";
+                                break;
+                            }
+                            if (options["-i"].empty()) {
+                                std::cout << __ERROR << "请输入写入的内容" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "请输入写入的内容" + __NORMAL + "\n";
+                                break;
+                            }
+                            if (!file->append(options["-i"])) {
+                                std::cout << __ERROR << "磁盘空间不足或超出配额，部分内容没有写入" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "磁盘空间不足或超出配额，部分内容没有写入" + __NORMAL + "\n";
+                                break;
+                            }
+                            shell_output += __SUCCESS + "写入" + std::to_string(options["-i"].size()) + "字节" + __NORMAL + "\n";
+                            break;
+                        }
+                    }
+                } else if (cmd == "lseek" || cmd == "LSEEK") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "lseek: 移动打开的文件的读写位置\n";
+                        shell_output += "用法: lseek <-o <offset> | -e> <fd>\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -o <offset>: 移动到第offset个字节\n";
+                        shell_output += "  -e: 移动到文件末尾\n";
+                    } else {
+                        while (1) {
+                            OpenFile *file = get_open_file(i, arg, shell_output);
+                            if (file == nullptr) {
+                                break;
+                            }
+                            uint64_t file_size = file->is_write ? Inode::read_inode(file->inode_id).i_size : version_table.size(file->version);
+                            uint64_t offset = file_size;
+                            if (options.find("-e") == options.end()) {
+                                const std::string &value = options["-o"];
+                                if (value.empty() || value.size() > 18 || !std::all_of(value.begin(), value.end(), ::isdigit)) {
+                                    std::cout << __ERROR << "请输入正确的偏移" << __NORMAL << std::endl;
+                                    shell_output += __ERROR + "请输入正确的偏移" + __NORMAL + "\n";
+                                    break;
+                                }
+                                offset = std::stoull(value);
+                            }
+                            if (offset > file_size) {
+                                std::cout << __ERROR << "偏移超出文件大小(" << file_size << "字节)" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "偏移超出文件大小(" + std::to_string(file_size) + "字节)" + __NORMAL + "\n";
+                                break;
+                            }
+                            file->offset = offset;
+                            shell_output += "当前位置: " + std::to_string(offset) + "\n";
+                            break;
+                        }
+                    }
+                } else if (cmd == "close" || cmd == "CLOSE") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "close: 关闭打开的文件\n";
+                        shell_output += "用法: close <fd>\n";
+                    } else {
+                        if (get_open_file(i, arg, shell_output) != nullptr) {
+                            close_open_file(i, std::stoi(arg));
+                            shell_output += __SUCCESS + "文件描述符" + arg + "已关闭" + __NORMAL + "\n";
+                        }
+                    }
+                } else if (cmd == "fsync" || cmd == "FSYNC") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "fsync: 把打开的文件的追加缓冲写入磁盘\n";
+                        shell_output += "用法: fsync <fd>\n";
+                    } else {
+                        // 执行命令前追加缓冲已经写入, 命令返回前本轮的事务会落盘
+                        if (get_open_file(i, arg, shell_output) != nullptr) {
+                            shell_output += __SUCCESS + "文件描述符" + arg + "已写入磁盘" + __NORMAL + "\n";
+                        }
+                    }
                 } else if (cmd == "copy" || cmd == "COPY") {
                     uint32_t mode = 755;
                     if (options.find("-h") != options.end()) {
@@ -569,6 +1101,7 @@ int main() {
                                     file_content = "";
                                 }
                             }
+                            bool copied = false;
                             if (overwrite) { // 文件存在，覆盖
                                 if (!is_able_to_write(start_id, user)) {
                                     std::cout << __ERROR << "你没有权限写入" << target_name << __NORMAL << std::endl;
@@ -577,17 +1110,13 @@ int main() {
                                 }
                                 Inode file_inode = Inode::read_inode(start_id);
                                 uint32_t file_id = get_file_inode_id(target_name, file_inode);
-                                if (shm->open_file_table.is_writing(file_id)) {
-                                    std::cout << __ERROR << "文件" << target_name << "正在被写入" << __NORMAL << std::endl;
-                                    shell_output += __ERROR + "文件" + target_name + "正在被写入" + __NORMAL + "\n";
+                                if (is_file_open(file_id)) {
+                                    std::cout << __ERROR << "文件" << target_name << "已被打开，请先关闭" << __NORMAL << std::endl;
+                                    shell_output += __ERROR + "文件" + target_name + "已被打开，请先关闭" + __NORMAL + "\n";
                                     break;
-                                } else {
-                                    shm->open_file_table.add_file(file_id, true);
-                                    Sleep(5000);
                                 }
                                 clear_file(target_path, target_name);
-                                write_file(target_path, target_name, file_content);
-                                shm->open_file_table.close_file(file_id);
+                                copied = write_file(target_path, target_name, file_content);
                             } else { // 文件不存在
                                 if (!is_able_to_write(start_id, user)) {
                                     std::cout << __ERROR << "你没有权限写入" << target_name << __NORMAL << std::endl;
@@ -601,7 +1130,12 @@ int main() {
                                 } else if (!is_file_exit(target_name, dir_inode)) {
                                     make_file(target_name, start_id,  user, shell_output,mode);
                                 }
-                                write_file(target_path, target_name, file_content);
+                                copied = write_file(target_path, target_name, file_content);
+                            }
+                            if (!copied) {
+                                std::cout << __ERROR << "文件" << target_name << "没有完整复制" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "文件" + target_name + "没有完整复制" + __NORMAL + "\n";
+                                break;
                             }
                             // Sleep(10000);
                             std::cout << __SUCCESS << "文件" << target_name << "复制成功" << __NORMAL << std::endl;
@@ -622,51 +1156,100 @@ int main() {
                             std::cout << __ERROR << "文件名输入错误，请重新输入" << __NORMAL << std::endl;
                             shell_output += __ERROR + "文件名输入错误，请重新输入" + __NORMAL + "\n";
                         } else {
-                            uint32_t start_id = 0;
-                            // 将args分为文件名和路径
-                            size_t pos = arg.find_last_of('/');
-                            std::string file_path, file_name;
-                            if (pos != std::string::npos) {
-                                file_path = arg.substr(0, pos + 1);
-                                file_name = arg.substr(pos + 1);
-                            } else {
-                                file_path = "";
-                                file_name = arg;
-                            }
-                            if (arg.front() != '/') {
-                                file_path = get_absolute_path(cur_inode.i_id) + file_path;
-                            }
-                            if (is_dir_exit(file_path, start_id)) { // 目录存在
-                                Inode dir_inode = Inode::read_inode(start_id);
-                                uint32_t file_id = get_file_inode_id(file_name, dir_inode);
-                                if (shm->open_file_table.is_writing(file_id)) {
-                                    std::cout << __ERROR << "文件" << file_name << "正在被写入" << __NORMAL << std::endl;
-                                    shell_output += __ERROR + "文件" + file_name + "正在被写入" + __NORMAL + "\n";
-                                    break;
+                            while (1) {
+                                uint32_t start_id = 0;
+                                // 将args分为文件名和路径
+                                size_t pos = arg.find_last_of('/');
+                                std::string file_path, file_name;
+                                if (pos != std::string::npos) {
+                                    file_path = arg.substr(0, pos + 1);
+                                    file_name = arg.substr(pos + 1);
                                 } else {
-                                    shm->open_file_table.add_file(file_id, true);
-                                    Sleep(5000);
-                                }
-                                if (is_file_exit(file_name, dir_inode)) {
-                                    if (!is_able_to_write(get_file_inode_id(file_name, dir_inode), user)) {
-                                        std::cout << __ERROR << "你没有权限删除" << file_name << __NORMAL << std::endl;
-                                        shell_output += __ERROR + "你没有权限删除" + file_name + __NORMAL + "\n";
-                                        shm->open_file_table.close_file(file_id);
-                                    } else if (del_file(file_name, dir_inode, shell_output)) {
-                                        std::cout << __SUCCESS << "文件" << file_name << "删除成功" << __NORMAL << std::endl;
-                                        shell_output += __SUCCESS + "文件" + file_name + "删除成功" + __NORMAL + "\n";
-                                        shm->open_file_table.close_file(file_id);
+                                    file_path = "";
+                                    file_name = arg;
+                                }
+                                if (arg.front() != '/') {
+                                    file_path = get_absolute_path(cur_inode.i_id) + file_path;
+                                }
+                                if (is_dir_exit(file_path, start_id)) { // 目录存在
+                                    Inode dir_inode = Inode::read_inode(start_id);
+                                    uint32_t file_id = get_file_inode_id(file_name, dir_inode);
+                                    if (is_file_open(file_id)) {
+                                        std::cout << __ERROR << "文件" << file_name << "已被打开，请先关闭" << __NORMAL << std::endl;
+                                        shell_output += __ERROR + "文件" + file_name + "已被打开，请先关闭" + __NORMAL + "\n";
+                                        break;
+                                    }
+                                    if (is_file_exit(file_name, dir_inode)) {
+                                        if (!is_able_to_write(get_file_inode_id(file_name, dir_inode), user)) {
+                                            std::cout << __ERROR << "你没有权限删除" << file_name << __NORMAL << std::endl;
+                                            shell_output += __ERROR + "你没有权限删除" + file_name + __NORMAL + "\n";
+                                        } else if (del_file(file_name, dir_inode, shell_output)) {
+                                            std::cout << __SUCCESS << "文件" << file_name << "删除成功" << __NORMAL << std::endl;
+                                            shell_output += __SUCCESS + "文件" + file_name + "删除成功" + __NORMAL + "\n";
+                                        } else {
+                                            std::cout << __ERROR << "文件" << file_name << "删除失败" << __NORMAL << std::endl;
+                                            shell_output += __ERROR + "文件" + file_name + "删除失败" + __NORMAL + "\n";
+                                        }
                                     } else {
-                                        std::cout << __ERROR << "文件" << file_name << "删除失败" << __NORMAL << std::endl;
-                                        shell_output += __ERROR + "文件" + file_name + "删除失败" + __NORMAL + "\n";
-                                        shm->open_file_table.close_file(file_id);
+                                        std::cout << __ERROR << "文件" << file_name << "不存在" << __NORMAL << std::endl;
+                                        shell_output += __ERROR + "文件" + file_name + "不存在" + __NORMAL + "\n";
                                     }
-                                } else {
-                                    std::cout << __ERROR << "文件" << file_name << "不存在" << __NORMAL << std::endl;
-                                    shell_output += __ERROR + "文件" + file_name + "不存在" + __NORMAL + "\n";
-                                    shm->open_file_table.close_file(file_id);
                                 }
+                                break;
+                            }
+                        }
+                    }
+                } else if (cmd == "move" || cmd == "MOVE") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "move: 移动或重命名文件和目录\n";
+                        shell_output += "用法: move <source> <target>\n";
+                        shell_output += "target是已存在的目录时移动到这个目录中, 名字不变; 否则移动到target的上一级目录并改名\n";
+                    } else {
+                        while (1) {
+                            if (args.size() != 2 || args[0].find("//") != std::string::npos || args[1].find("//") != std::string::npos) {
+                                std::cout << __ERROR << "请输入源路径和目标路径" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "请输入源路径和目标路径" + __NORMAL + "\n";
+                                break;
+                            }
+                            // 将路径分为所在目录和名字, 目录的路径可以以'/'结尾
+                            auto split = [&cur_inode](std::string full, std::string &dir_path, std::string &name) {
+                                if (full.size() > 1 && full.back() == '/') {
+                                    full.pop_back();
+                                }
+                                if (full.front() != '/') {
+                                    full = get_absolute_path(cur_inode.i_id) + full;
+                                }
+                                size_t pos = full.find_last_of('/');
+                                dir_path = full.substr(0, pos + 1);
+                                name = full.substr(pos + 1);
+                            };
+                            std::string src_path, src_name, dst_path, dst_name;
+                            split(args[0], src_path, src_name);
+                            uint32_t src_dir_id = 0, dst_dir_id = 0;
+                            if (!is_dir_exit(src_path, src_dir_id)) {
+                                std::cout << __ERROR << "目录" << src_path << "不存在" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "目录" + src_path + "不存在" + __NORMAL + "\n";
+                                break;
+                            }
+                            std::string target = args[1].front() == '/' ? args[1] : get_absolute_path(cur_inode.i_id) + args[1];
+                            if (target.back() != '/') {
+                                target += "/";
+                            }
+                            if (is_dir_exit(target, dst_dir_id)) {
+                                dst_name = src_name;
+                            } else {
+                                split(args[1], dst_path, dst_name);
+                                if (!is_dir_exit(dst_path, dst_dir_id)) {
+                                    std::cout << __ERROR << "目录" << dst_path << "不存在" << __NORMAL << std::endl;
+                                    shell_output += __ERROR + "目录" + dst_path + "不存在" + __NORMAL + "\n";
+                                    break;
+                                }
+                            }
+                            if (move_entry(src_dir_id, src_name, dst_dir_id, dst_name, user, shell_output)) {
+                                std::cout << __SUCCESS << src_name << "已移动到" << get_absolute_path(dst_dir_id) + dst_name << __NORMAL << std::endl;
+                                shell_output += __SUCCESS + src_name + "已移动到" + get_absolute_path(dst_dir_id) + dst_name + __NORMAL + "\n";
                             }
+                            break;
                         }
                     }
                 } else if (cmd == "check" || cmd == "CHECK") {
@@ -676,8 +1259,8 @@ int main() {
                     } else {
                         sb.save_super_block();
                         uint32_t used_block = block_bitmap.bitmap.count();
-                        uint32_t used_inode = inode_bitmap.bitmap.count();
-                        if (used_block == sb.block_count - sb.free_blocks && used_inode == sb.inode_count - sb.free_inodes) {
+                        uint32_t used_inode = inode_bitmap.used();
+                        if (used_block == sb.block_count - sb.free_blocks && used_inode == inode_bitmap.capacity() - sb.free_inodes) {
                             std::cout << __SUCCESS << "文件系统完好" << __NORMAL << std::endl;
                             shell_output += __SUCCESS + "文件系统完好" + __NORMAL + "\n";
                         } else {
@@ -701,6 +1284,240 @@ int main() {
                             shell_output = show_directory(cur_inode.i_id, user, true);
                         }
                     }
+                } else if (cmd == "du" || cmd == "DU") {
+                    while (1) {
+                        if (options.find("-h") != options.end()) {
+                            shell_output += "du: 显示目录及其子目录占用的空间\n";
+                            shell_output += "用法: du [path]\n";
+                            break;
+                        }
+                        uint32_t purpose_id = cur_inode.i_id;
+                        if (!arg.empty()) {
+                            if (arg.back() != '/') {
+                                arg += "/";
+                            }
+                            if (!is_path_dir(arg, purpose_id, shell_output)) {
+                                break;
+                            }
+                        }
+                        if (!is_able_to_read(purpose_id, user)) {
+                            std::cout << __ERROR << "你没有权限读取" << get_absolute_path(purpose_id) << __NORMAL << std::endl;
+                            shell_output += __ERROR + "你没有权限读取" + get_absolute_path(purpose_id) + __NORMAL + "\n";
+                            break;
+                        }
+                        shell_output = disk_usage(purpose_id);
+                        break;
+                    }
+                } else if (cmd == "find" || cmd == "FIND") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "find: 在目录树中查找文件和目录\n";
+                        shell_output += "用法: find [-n <pattern>] [-t f|d] [-s <min>,<max>] [-m <min>,<max>] [-w] [path]\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -n <pattern>: 名字的通配符, *匹配任意个字符, ?匹配一个字符\n";
+                        shell_output += "  -t f|d: 只查找文件或目录\n";
+                        shell_output += "  -s <min>,<max>: 文件大小的范围(字节), 省略的一端不限制\n";
+                        shell_output += "  -m <min>,<max>: 修改时间在多少天以前, 如 -m ,7 表示最近7天内修改过\n";
+                        shell_output += "  -w: 从根目录按名字查找时也不使用文件名索引, 直接遍历目录树\n";
+                        shell_output += "不给出path时从当前目录开始查找\n";
+                    } else {
+                        while (1) {
+                            // 解析 <min>,<max>, 省略的一端不限制
+                            auto parse = [](const std::string &value, uint64_t &low, uint64_t &high) {
+                                size_t comma = value.find(',');
+                                std::string parts[2] = {value.substr(0, comma), comma == std::string::npos ? "" : value.substr(comma + 1)};
+                                for (const std::string &part : parts) {
+                                    if (part.size() > 15 || !std::all_of(part.begin(), part.end(), ::isdigit)) {
+                                        return false;
+                                    }
+                                }
+                                low = parts[0].empty() ? low : std::stoull(parts[0]);
+                                high = parts[1].empty() ? high : std::stoull(parts[1]);
+                                return comma != std::string::npos && low <= high;
+                            };
+                            bool has_type = options.count("-t"), has_size = options.count("-s"), has_mtime = options.count("-m");
+                            bool use_index = !options.count("-w");
+                            FindQuery query;
+                            query.pattern = options.count("-n") ? options["-n"] : "";
+                            std::string type = has_type ? options["-t"] : "";
+                            uint64_t days[2] = {0, UINT32_MAX};
+                            if ((options.count("-n") && query.pattern == "true") || (has_type && type != "f" && type != "d") ||
+                                (has_size && !parse(options["-s"], query.min_size, query.max_size)) ||
+                                (has_mtime && !parse(options["-m"], days[0], days[1]))) {
+                                shell_output += __ERROR + "请输入正确的参数" + __NORMAL + "\n";
+                                break;
+                            }
+                            if (has_type) {
+                                query.type = type == "f" ? FILE_TYPE : DIR_TYPE;
+                            }
+                            if (has_mtime) {
+                                int64_t now = static_cast<int64_t>(time(0));
+                                query.min_mtime = static_cast<uint32_t>(std::max<int64_t>(0, now - static_cast<int64_t>(std::min<uint64_t>(days[1], UINT32_MAX)) * 86400));
+                                query.max_mtime = static_cast<uint32_t>(std::max<int64_t>(0, now - static_cast<int64_t>(std::min<uint64_t>(days[0], UINT32_MAX)) * 86400));
+                            }
+                            // 没有位置参数时arg是最后一个选项的值, 重新找出真正的路径
+                            std::string target;
+                            for (size_t k = 0; k < args.size(); ++k) {
+                                if (args[k].front() != '-') {
+                                    target = args[k];
+                                } else if (k + 1 < args.size() && args[k + 1].front() != '-') {
+                                    ++k;
+                                }
+                            }
+                            uint32_t purpose_id = cur_inode.i_id;
+                            if (!target.empty()) {
+                                if (target.back() != '/') {
+                                    target += "/";
+                                }
+                                if (!is_path_dir(target, purpose_id, shell_output)) {
+                                    break;
+                                }
+                            }
+                            // 子目录不大时直接遍历更快, 只在整个卷中查找时使用索引
+                            std::vector<std::string> found = find_files(purpose_id, query, user, use_index && purpose_id == 0);
+                            shell_output = "共找到" + std::to_string(found.size()) + "项\n";
+                            for (const std::string &item : found) {
+                                shell_output += item + "\n";
+                            }
+                            break;
+                        }
+                    }
+                } else if (cmd == "grep" || cmd == "GREP") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "grep: 在文件中查找字符串\n";
+                        shell_output += "用法: grep -e <pattern> [-l] [path]\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -e <pattern>: 要查找的字符串, 区分大小写\n";
+                        shell_output += "  -l: 只列出匹配的文件和匹配的行数\n";
+                        shell_output += "path是文件时只在这个文件中查找, 是目录时在目录树的所有文件中查找, 默认为当前目录\n";
+                    } else {
+                        while (1) {
+                            std::string pattern = options.count("-e") ? options["-e"] : "";
+                            if (pattern.empty() || pattern == "true") {
+                                std::cout << __ERROR << "请输入要查找的字符串" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "请输入要查找的字符串" + __NORMAL + "\n";
+                                break;
+                            }
+                            bool names_only = options.count("-l");
+                            // 没有位置参数时arg是最后一个选项的值, 重新找出真正的路径
+                            std::string target;
+                            for (size_t k = 0; k < args.size(); ++k) {
+                                if (args[k].front() != '-') {
+                                    target = args[k];
+                                } else if (args[k] != "-l" && k + 1 < args.size() && args[k + 1].front() != '-') {
+                                    ++k;
+                                }
+                            }
+                            uint32_t purpose_id = find_file(target, cur_inode);
+                            std::string path = !target.empty() && target.front() == '/' ? target : get_absolute_path(cur_inode.i_id) + target;
+                            if (purpose_id == UINT32_MAX) {
+                                purpose_id = cur_inode.i_id;
+                                if (!target.empty()) {
+                                    if (target.back() != '/') {
+                                        target += "/";
+                                    }
+                                    if (!is_path_dir(target, purpose_id, shell_output)) {
+                                        break;
+                                    }
+                                }
+                                path = get_absolute_path(purpose_id);
+                            }
+                            if (!is_able_to_read(purpose_id, user)) {
+                                std::cout << __ERROR << "你没有权限读取" << path << __NORMAL << std::endl;
+                                shell_output += __ERROR + "你没有权限读取" + path + __NORMAL + "\n";
+                                break;
+                            }
+                            shell_output = grep_files(purpose_id, path, pattern, user, names_only);
+                            break;
+                        }
+                    }
+                } else if (cmd == "chmod" || cmd == "CHMOD") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "chmod: 修改文件或目录的权限\n";
+                        shell_output += "用法: chmod -m <mode> [-R] <path>\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -m <mode>: 新的权限，如755\n";
+                        shell_output += "  -R: 递归修改目录中的文件和子目录\n";
+                    } else {
+                        while (1) {
+                            const std::string &value = options["-m"];
+                            if (value.size() != 3 || !std::all_of(value.begin(), value.end(), [](char c) { return c >= '0' && c <= '7'; })) {
+                                std::cout << __ERROR << "请输入正确的权限" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "请输入正确的权限" + __NORMAL + "\n";
+                                break;
+                            }
+                            if (arg.empty() || arg.find("//") != std::string::npos) {
+                                std::cout << __ERROR << "请输入正确的路径" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "请输入正确的路径" + __NORMAL + "\n";
+                                break;
+                            }
+                            // 先按目录查找, 再按文件查找
+                            std::string target_path = arg.front() == '/' ? arg : get_absolute_path(cur_inode.i_id) + arg;
+                            uint32_t target_id = 0;
+                            if (!is_dir_exit(target_path.back() == '/' ? target_path : target_path + "/", target_id)) {
+                                target_id = find_file(arg, cur_inode);
+                            }
+                            if (target_id == UINT32_MAX) {
+                                std::cout << __ERROR << arg << "不存在" << __NORMAL << std::endl;
+                                shell_output += __ERROR + arg + "不存在" + __NORMAL + "\n";
+                                break;
+                            }
+                            uint32_t skipped = 0;
+                            uint32_t changed = change_mode(target_id, std::stoul(value), !options["-R"].empty(), user, skipped);
+                            if (changed == 0) {
+                                std::cout << __ERROR << "你没有权限修改" << arg << __NORMAL << std::endl;
+                                shell_output += __ERROR + "你没有权限修改" + arg + __NORMAL + "\n";
+                                break;
+                            }
+                            shell_output += __SUCCESS + "已修改" + std::to_string(changed) + "个文件或目录的权限" + __NORMAL + "\n";
+                            if (skipped > 0) {
+                                shell_output += __ERROR + std::to_string(skipped) + "个文件或目录不属于你，未修改" + __NORMAL + "\n";
+                            }
+                            break;
+                        }
+                    }
+                } else if (cmd == "compress" || cmd == "COMPRESS") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "compress: 设置文件的压缩属性\n";
+                        shell_output += "用法: compress [-d] <filename>\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -d: 取消压缩\n";
+                        shell_output += "压缩的文件每" + std::to_string(COMPRESS_CLUSTER_BLOCKS) + "块为一簇单独压缩, 读写时只解压用到的簇\n";
+                    } else {
+                        while (1) {
+                            if (arg.empty()) {
+                                std::cout << __ERROR << "请输入文件名" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "请输入文件名" + __NORMAL + "\n";
+                                break;
+                            }
+                            // 将arg分为文件名和路径
+                            size_t pos = arg.find_last_of('/');
+                            std::string file_path = pos == std::string::npos ? "" : arg.substr(0, pos + 1);
+                            std::string file_name = pos == std::string::npos ? arg : arg.substr(pos + 1);
+                            if (arg.front() != '/') {
+                                file_path = get_absolute_path(cur_inode.i_id) + file_path;
+                            }
+                            uint32_t start_id = 0;
+                            if (!is_dir_exit(file_path, start_id) || !is_file_exit(file_name, Inode::read_inode(start_id))) {
+                                std::cout << __ERROR << "文件" << arg << "不存在" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "文件" + arg + "不存在" + __NORMAL + "\n";
+                                break;
+                            }
+                            Inode dir_inode = Inode::read_inode(start_id);
+                            uint32_t file_id = get_file_inode_id(file_name, dir_inode);
+                            if (!is_able_to_write(file_id, user)) {
+                                std::cout << __ERROR << "你没有权限修改" << file_name << __NORMAL << std::endl;
+                                shell_output += __ERROR + "你没有权限修改" + file_name + __NORMAL + "\n";
+                                break;
+                            }
+                            if (is_file_open(file_id)) {
+                                std::cout << __ERROR << "文件" << file_name << "已被打开，请先关闭" << __NORMAL << std::endl;
+                                shell_output += __ERROR + "文件" + file_name + "已被打开，请先关闭" + __NORMAL + "\n";
+                                break;
+                            }
+                            compress_file(file_path, file_name, options.find("-d") == options.end(), shell_output);
+                            break;
+                        }
+                    }
                 } else if (cmd == "clear" || cmd == "CLEAR" || cmd == "cls" || cmd == "CLS") {
                     if (options.find("-h") != options.end()) {
                         shell_output += "clear: 清屏\n";
@@ -730,25 +1547,166 @@ int main() {
                             break;
                         }
                     }
+                } else if (cmd == "quota" || cmd == "QUOTA") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "quota: 显示或设置磁盘配额\n";
+                        shell_output += "用法: quota [-u <uid> | -g <gid>] [-b <soft>,<hard>] [-i <soft>,<hard>]\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -u <uid>: 设置用户的限额\n";
+                        shell_output += "  -g <gid>: 设置组的限额\n";
+                        shell_output += "  -b <soft>,<hard>: 块数的软限额和硬限额, 0表示不限制, 不给出时保持不变\n";
+                        shell_output += "  -i <soft>,<hard>: inode数的软限额和硬限额, 0表示不限制\n";
+                        shell_output += "不带选项时显示用量, 超过软限额的用量后面标*\n";
+                    } else {
+                        while (1) {
+                            if (!options.count("-b") && !options.count("-i")) {
+                                shell_output = quota_table.list(user);
+                                break;
+                            }
+                            if (user.uid != 0) {
+                                shell_output += __ERROR + "你没有权限设置配额" + __NORMAL + "\n";
+                                break;
+                            }
+                            // 解析 <soft>,<hard>, 没有给出的限额为0
+                            auto parse = [](const std::string &value, uint32_t limits[2]) {
+                                size_t comma = value.find(',');
+                                std::string parts[2] = {value.substr(0, comma), comma == std::string::npos ? "" : value.substr(comma + 1)};
+                                for (int k = 0; k < 2; ++k) {
+                                    if (parts[k].size() > 9 || !std::all_of(parts[k].begin(), parts[k].end(), ::isdigit)) {
+                                        return false;
+                                    }
+                                    limits[k] = parts[k].empty() ? 0 : std::stoul(parts[k]);
+                                }
+                                return comma != std::string::npos;
+                            };
+                            uint32_t blocks[2] = {0, 0}, inodes[2] = {0, 0};
+                            const std::string &id = options.count("-u") ? options["-u"] : options["-g"];
+                            if (options.count("-u") == options.count("-g") || id.empty() || id.size() > 9 || !std::all_of(id.begin(), id.end(), ::isdigit) ||
+                                (options.count("-b") && !parse(options["-b"], blocks)) || (options.count("-i") && !parse(options["-i"], inodes))) {
+                                shell_output += __ERROR + "请输入正确的参数" + __NORMAL + "\n";
+                                break;
+                            }
+                            if (quota_table.set_limit(options.count("-u") ? QUOTA_USER : QUOTA_GROUP, std::stoul(id), options.count("-b") ? blocks : nullptr,
+                                                      options.count("-i") ? inodes : nullptr, shell_output)) {
+                                shell_output += __SUCCESS + "配额设置成功" + __NORMAL + "\n";
+                            }
+                            break;
+                        }
+                    }
+                } else if (cmd == "snapshot" || cmd == "SNAPSHOT") {
+                    if (options.find("-h") != options.end()) {
+                        shell_output += "snapshot: 管理文件系统快照\n";
+                        shell_output += "用法: snapshot [-c <name>] [-l] [-m <name>] [-u] [-d <name>]\n";
+                        shell_output += "选项:\n";
+                        shell_output += "  -c <name>: 创建快照\n";
+                        shell_output += "  -l: 列出所有快照\n";
+                        shell_output += "  -m <name>: 挂载快照，挂载后只能浏览目录和读取文件\n";
+                        shell_output += "  -u: 卸载快照，回到当前的文件系统\n";
+                        shell_output += "  -d <name>: 删除快照\n";
+                    } else {
+                        while (1) {
+                            if (options.find("-c") != options.end() || options.find("-d") != options.end()) {
+                                if (user.uid != 0) {
+                                    shell_output += __ERROR + "你没有权限管理快照" + __NORMAL + "\n";
+                                    break;
+                                }
+                                if (snapshot_view[i] != -1) {
+                                    shell_output += __ERROR + "请先使用snapshot -u卸载快照" + __NORMAL + "\n";
+                                    break;
+                                }
+                            }
+                            if (options.find("-c") != options.end()) {
+                                if (snapshot_table.create(options["-c"], shell_output)) {
+                                    sb = SuperBlock::read_super_block();
+                                }
+                            } else if (options.find("-d") != options.end()) {
+                                int slot = snapshot_table.find(options["-d"]);
+                                if (slot != -1 && std::find(snapshot_view, snapshot_view + 10, slot) != snapshot_view + 10) {
+                                    shell_output += __ERROR + "快照" + options["-d"] + "正在被使用" + __NORMAL + "\n";
+                                    break;
+                                }
+                                snapshot_table.remove(options["-d"], shell_output);
+                            } else if (options.find("-m") != options.end()) {
+                                int slot = snapshot_table.find(options["-m"]);
+                                if (slot == -1) {
+                                    shell_output += __ERROR + "快照" + options["-m"] + "不存在" + __NORMAL + "\n";
+                                    break;
+                                }
+                                close_all_files(i);
+                                snapshot_view[i] = slot;
+                                snapshot_table.view = slot;
+                                cur_inode = Inode::read_inode(0);
+                                path = "/";
+                                shell_output += __SUCCESS + "已挂载快照" + options["-m"] + __NORMAL + "\n";
+                            } else if (options.find("-u") != options.end()) {
+                                if (snapshot_view[i] == -1) {
+                                    shell_output += __ERROR + "没有挂载快照" + __NORMAL + "\n";
+                                    break;
+                                }
+                                close_all_files(i);
+                                snapshot_view[i] = -1;
+                                snapshot_table.view = -1;
+                                cur_inode = root_inode;
+                                path = "/";
+                                shell_output += __SUCCESS + "已卸载快照" + __NORMAL + "\n";
+                            } else {
+                                shell_output = snapshot_table.list();
+                            }
+                            break;
+                        }
+                    }
                 } else {
                     std::cout << __ERROR << "未定义的命令，请重新输入" << __NORMAL << std::endl;
                     shell_output += __ERROR + "未定义的命令，请重新输入" + __NORMAL + "\n";
                 }
 
                 /*******  命令执行完后的操作  *******/
-                shell_output += __USER + user.username + "@FileSystem" + __NORMAL + ":" + __PATH + path + __NORMAL + "$ ";
+                if (!lock_timeout && is_modify_command(cmd, options) && quota_table.over_soft(user.uid, user.gid)) {
+                    shell_output += __ERROR + "警告: 磁盘用量已超过软限额, 使用quota查看" + __NORMAL + "\n";
+                }
+                lock_manager.release(i, locks);
+                snapshot_table.view = -1;
+                journal.commit();
+                std::string host = "@FileSystem";
+                if (snapshot_view[i] != -1) {
+                    host += std::string("(") + snapshot_table.slots[snapshot_view[i]].entry.name + ")";
+                }
+                shell_output += __USER + user.username + host + __NORMAL + ":" + __PATH + path + __NORMAL + "$ ";
                 strncpy(shm->user_list[i].result, shell_output.c_str(), sizeof(shm->user_list[i].result) - 1);
                 shm->user_list[i].cur_dir_inode_id = cur_inode.i_id;
-                shm->user_list[i].done = true;
-                shm->user_list[i].ready = false;
+                finished.push_back(i);
             }
             Sleep(10); // 减少cpu占用
         }
-    }
+
+        // 停留太久的追加缓冲在命令的间隙写入
+        journal.begin();
+        flush_open_files(true);
+        journal.commit();
+        // 组提交: 本轮所有命令的事务一次写日志、一次fsync，落盘后才通知客户端
+        journal.flush();
+        for (int i : finished) {
+            shm->user_list[i].done = true;
+            shm->user_list[i].ready = false;
+        }
+        // 已删除快照的空间在命令的间隙分批回收
+        snapshot_table.reclaim(SNAPSHOT_RECLAIM_BATCH);
+        // 已删除的文件和目录同样在命令的间隙分批回收
+        orphan_list.reclaim(ORPHAN_RECLAIM_BATCH);
+        continue;
 
     LABEL:
-    // 退出程序前保存超级块
-    sb.last_load_time = load_time;
-    sb.save_super_block();
+        // 退出程序前写入追加缓冲并保存超级块
+        flush_open_files(false);
+        sb.last_load_time = load_time;
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+        for (int i : finished) {
+            shm->user_list[i].done = true;
+            shm->user_list[i].ready = false;
+        }
+        break;
+    }
     return 0;
 }
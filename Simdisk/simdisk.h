@@ -7,7 +7,9 @@
 
 #pragma once
 #include "encrypt.h"
+#include <algorithm>
 #include <bitset>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <ctime>
@@ -15,66 +17,197 @@
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <filesystem>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 //------------------------------------------------------------------------------------------------
 // 文件系统的一些参数
 //------------------------------------------------------------------------------------------------
 
-#define FS_SIZE 104857600
-#define BLOCK_SIZE 1024
-#define INODE_COUNT 12032
-#define BLOCK_COUNT 102400
-#define FREE_INODES 12032
-#define FREE_BLOCKS 101800
-#define INODE_BITMAP_START 14
-#define BLOCK_BITMAP_START 1
-#define INODE_LIST_START 16
-#define DATA_BLOCK_START 600
+// 格式化时的默认参数, 挂载后的布局以超级块中记录的为准
+#define DEFAULT_FS_SIZE 104857600
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_INODE_COUNT 12032
+#define MIN_BLOCK_SIZE 1024       // 超级块、日志头等记录占用块的前1KB
+#define MAX_BLOCK_SIZE 65536
+#define MAX_INODE_COUNT 65535     // 格式化时划出的inode表的上限, 用完后从数据块中按需分配inode块
+#define MAX_BLOCK_COUNT (UINT32_MAX - MAX_BLOCK_SIZE * 8u) // 块号为32位, 留出一组位图的余量, UINT32_MAX表示无效块
+// 磁盘格式版本
+#define FS_VERSION_INODE32 1      // 目录项中的inode编号为32位, 支持动态分配的inode块
+#define FS_VERSION_BLOCK_MAP 2    // 文件的块映射由索引块链表改为多级索引
+#define FS_VERSION_EXTENT 3       // 文件按区段映射
+#define FS_VERSION_SIZE64 4       // inode中的文件大小为64位
+#define FS_VERSION_DIR_STATS 5    // 目录的"."目录项中保存子树的统计
+#define FS_VERSION_QUOTA 6        // 超级块指向配额表, 记录每个用户和组的用量
+#define FS_VERSION_INLINE 7       // 超级块记录inode的大小, 小文件的内容内联保存在inode之后
+#define FS_VERSION_COMPRESS 8     // 普通文件可以按簇压缩保存, 区段树中每簇留出固定的逻辑块范围
+#define FS_VERSION 8
+#define UPGRADE_BATCH 64          // 升级旧磁盘时每个事务处理的inode数
+// 日志相关
+#define JOURNAL_BLOCKS 253        // 日志区块数: 1个日志头 + 252个记录块
+#define JOURNAL_MAGIC 0x4A524E4C  // "JRNL"
+#define JOURNAL_HEADER_SLOTS 252  // 日志头只占块的前1KB, 一条记录最多252个块
+#define JOURNAL_CHAIN_MAGIC 0x4A43484E // "JCHN", 超过日志区容量的事务写成链式记录
+// 快照相关
+#define MAX_SNAPSHOTS 16          // 快照表一个块, 最多16个快照
+#define SNAPSHOT_FREE 0
+#define SNAPSHOT_ACTIVE 1
+#define SNAPSHOT_DELETING 2
+#define SNAPSHOT_RECLAIM_BATCH 256 // 删除快照时每轮最多回收的块数
+// 孤儿inode相关
+#define ORPHAN_RECLAIM_BATCH 256  // 每轮最多释放的块数和目录项数
+// 配额相关
+#define MAX_QUOTAS 32             // 配额表一个块, 最多32个用户和组
+#define QUOTA_FREE 0
+#define QUOTA_USER 1
+#define QUOTA_GROUP 2
 // inode 相关
 #define INODE_SIZE 48
+#define INODE_SLOT_SIZE 128       // 新格式化的磁盘每个inode占用的字节数, INODE_SIZE之后是内联数据区
+#define INLINE_DATA UINT32_MAX    // 普通文件的i_indirect取这个值表示内容内联保存, 没有区段树
+#define COMPRESSED_MODE 0x80000000 // i_mode的最高位, 表示文件内容按簇压缩保存, 不属于权限
+#define DIR_ENTRY_SIZE 32
+#define MAX_NAME_LEN 26           // 文件名最大长度, 目录项中保留结尾的'\0'
 // 0-目录文件 1-普通文件 2-符号链接文件 3-未定义
 #define DIR_TYPE 0
 #define FILE_TYPE 1
 #define LINK_TYPE 2
 #define UNDEFINE_TYPE 3
+// 打开文件相关
+#define MAX_OPEN_FILES 16         // 每个用户最多同时打开的文件数
+#define APPEND_BUFFER_SIZE 65536  // 追加缓冲达到这个大小时写入其中的整块
+#define APPEND_FLUSH_SECONDS 2    // 追加缓冲最多停留的秒数
+#define LOCK_TIMEOUT_SECONDS 10   // 等待文件锁的最长秒数
+// 并行遍历目录树相关
+#define WALK_MAX_THREADS 8        // 遍历目录树的最多线程数, 不超过CPU核数
+#define WALK_MAX_QUEUED 1024      // 排队等待遍历的子目录数上限, 超过时在当前线程直接遍历
+#define TOP_DIRS 5                // info显示的占用空间最多的目录数
+// grep相关
+#define GREP_CHUNK_BLOCKS 64      // 每次读取的块数
+#define GREP_CONTEXT 40           // 显示匹配之前的最多字符数
+#define GREP_LINE_WIDTH 80        // 每个匹配最多显示的字符数
+#define GREP_MAX_LINES 32         // 每个文件最多显示的匹配行数
+// 压缩相关
+#define COMPRESS_CLUSTER_BLOCKS 16 // 压缩文件每簇的块数, 每簇单独压缩
+#define LZ_HASH_BITS 12           // LZ压缩查找重复串的哈希表为2^12项
+#define LZ_MIN_MATCH 4            // 最短的重复串
+#define LZ_MAX_OFFSET 65535       // 重复串最远的距离, 偏移占2字节
 
 //------------------------------------------------------------------------------------------------
 // 类声明
 //------------------------------------------------------------------------------------------------
+struct Geometry;
+struct Bitmap;
+struct Journal;
 struct InodeBitmap;
 struct BlockBitmap;
 struct SuperBlock;
 struct Inode;
 struct DirEntry;
+struct DirStats;
 struct DirBlock;
 struct IndexBlock;
+struct Extent;
+struct ExtentNode;
+struct BlockMap;
+struct SnapshotTable;
+struct OrphanList;
+struct QuotaEntry;
+struct QuotaTable;
+struct OpenFile;
+struct FileTable;
+struct LockRequest;
+struct LockManager;
+struct FileVersion;
+struct VersionTable;
+struct WorkPool;
+template <typename Result> struct TreeWalk;
+struct FindQuery;
+struct NameIndex;
+struct GrepResult;
+struct CompressStats;
 struct User;
 
 //------------------------------------------------------------------------------------------------
 // 函数声明
 //------------------------------------------------------------------------------------------------
 
+bool sync_file(std::FILE *fp); //将文件缓冲区落盘
+bool seek_file(std::FILE *fp, uint64_t offset); //移动文件指针, 支持大于2GB的偏移
+bool create_sparse_file(const std::string &path, uint64_t size); //创建指定大小的稀疏文件
 std::string format_time(uint32_t time); //格式化时间
 std::string get_absolute_path(uint32_t inode_id); //获取绝对路径
+bool get_entry_name(const Inode &dir_inode, uint32_t inode_id, std::string &name); //在目录中查找指向inode的目录项名
 bool is_path_dir(const std::string &path, uint32_t &purpose_id, std::string &shell_output);//判断路径是否是目录
 bool is_dir_exit(const std::string &path, uint32_t &purpose_id);//判断目录是否存在
 bool is_file_exit(const std::string &name, Inode cur_inode);//判断文件是否存在
 bool is_valid_dir_name(const std::string &dir_name);//判断目录名是否合法
 uint32_t get_file_inode_id(const std::string &file_name, Inode &dir_inode);//获取文件的inode id
 uint32_t make_dir_help(const std::string &dir_name, Inode &cur_inode, User cur_user, uint32_t mode = 755);//创建目录辅助函数
+bool add_dir_entry(Inode &dir_inode, uint32_t inode_id, uint8_t type, const std::string &name);//向目录中添加目录项
 std::string read_file(std::string file_path, std::string file_name);//读取文件
+std::string read_file_range(const Inode &file_inode, uint64_t offset, uint64_t length, Extent *cursor = nullptr);//读取文件的一段
+uint64_t write_file_range(Inode &file_inode, uint64_t offset, const std::string &content, Extent *cursor = nullptr);//从文件的某个位置写入
+bool expand_inline(Inode &file_inode);//内联的文件改为按区段映射
+std::string lz_compress(const char *data, size_t size);//LZ压缩
+bool lz_decompress(const char *data, size_t size, char *out, size_t raw_size);//LZ解压
+std::string read_cluster(const Inode &file_inode, uint32_t cluster);//读取压缩文件的一簇
+bool store_cluster(Inode &file_inode, BlockMap &block_map, uint32_t cluster, const std::string &raw);//压缩并保存一簇
+uint64_t write_clusters(Inode &file_inode, uint64_t offset, const std::string &content);//从压缩文件的某个位置写入
+bool compress_file(std::string file_path, std::string file_name, bool compressed, std::string &_shell_output);//设置或取消文件的压缩属性
+std::string read_file_tail(const Inode &file_inode, uint64_t lines);//读取文件的最后几行
 bool write_file(std::string file_path, std::string file_name, std::string content);//写文件
 bool is_dir_empty(const uint32_t dir_inode_id);//判断目录是否为空
-void init_disk();//格式化磁盘
+void init_disk(uint64_t fs_size = DEFAULT_FS_SIZE, uint32_t block_size = DEFAULT_BLOCK_SIZE, uint32_t inode_count = DEFAULT_INODE_COUNT);//格式化磁盘
+bool resize_disk(uint64_t fs_size, std::string &shell_output);//在线扩容磁盘
+void convert_block_map(Inode &inode, uint32_t version);//把旧格式的块映射改写为区段树
+void upgrade_disk();//把旧格式的磁盘升级到当前版本
+std::string extent_summary();//统计文件的区段数
+std::string compression_summary();//统计压缩文件的压缩比和压缩耗时
 std::string show_directory(uint32_t inode_id, User cur_user, bool show_recursion = false);//显示目录内容
 bool make_dir(const std::string dir_name, Inode cur_inode, User cur_user,std::string &_shell_output, uint32_t mode = 755);//创建目录
 bool make_file(const std::string file_name, uint32_t inode_id, User cur_user,std::string &_shell_output, uint32_t mode = 755);//创建文件
 bool del_file(const std::string file_name, Inode &cur_inode, std::string &shell_output);//删除文件
 bool del_dir(const uint32_t the_purpose_dir_inode_id, std::string &shell_output);//删除目录
+bool move_entry(uint32_t src_dir_id, const std::string &src_name, uint32_t dst_dir_id, const std::string &dst_name, User cur_user, std::string &_shell_output);//移动或重命名
+DirStats file_stats(const Inode &inode);//文件计入所在目录的统计
+DirStats read_dir_stats(uint32_t dir_id);//读取目录子树的统计
+void update_dir_stats(uint32_t dir_id, const DirStats &before, const DirStats &after);//沿祖先目录更新统计
+void rebuild_dir_stats();//重新计算所有目录的统计
+std::string largest_dirs(uint32_t count);//占用空间最多的目录
+std::string disk_usage(uint32_t dir_id);//目录及其子目录的空间占用
+std::vector<uint32_t> unwritable_dirs(uint32_t dir_inode_id, User cur_user);//找出目录树中不能修改的目录
+uint32_t change_mode(uint32_t inode_id, uint32_t mode, bool recursive, User cur_user, uint32_t &skipped);//修改权限
+bool match_glob(const std::string &pattern, const std::string &name);//通配符匹配
+std::vector<std::string> find_files(uint32_t dir_id, const FindQuery &query, User cur_user, bool use_index);//查找文件和目录
+const char *find_substring(const char *begin, const char *end, const std::string &needle);//在内存中查找子串
+GrepResult grep_file(const Inode &file_inode, const std::string &pattern);//在一个文件中查找子串
+std::string grep_files(uint32_t inode_id, const std::string &path, const std::string &pattern, User cur_user, bool names_only);//在文件中查找子串
 bool login(const std::string &user, const std::string &password, std::string &_shell_output, User &__user);//登录
 bool adduser(const std::string &user, const std::string &password, uint32_t uid, uint32_t gid);//添加用户
 std::string hash_pwd(const std::string &pwd);//密码哈希
@@ -88,8 +221,17 @@ std::string get_username(uint32_t uid);//获取用户名
 //------------------------------------------------------------------------------------------------
 
 const std::string disk_path = "../Disk/MyDisk.dat";
+extern Geometry geometry;
+extern Journal journal;
 extern InodeBitmap inode_bitmap;
 extern BlockBitmap block_bitmap;
+extern SnapshotTable snapshot_table;
+extern OrphanList orphan_list;
+extern QuotaTable quota_table;
+extern NameIndex name_index;
+extern VersionTable version_table;
+extern CompressStats compress_stats;
+extern LockManager lock_manager;
 // 输出相关
 const std::string __ERROR = "\033[31m";
 const std::string __SUCCESS = "\033[36m";
@@ -101,54 +243,252 @@ const std::string __USER = "\033[01;32m";
 // 结构体定义
 //------------------------------------------------------------------------------------------------
 
+/**
+ * 卷的几何参数
+ * 格式化时根据镜像大小、块大小和inode数计算布局并写入超级块，挂载时从超级块读出，
+ * 之后所有的布局计算都以它为准
+ */
+struct Geometry {
+    uint32_t block_size = DEFAULT_BLOCK_SIZE;                     // 块大小（字节）
+    uint32_t block_count = DEFAULT_FS_SIZE / DEFAULT_BLOCK_SIZE;  // 总块数
+    uint32_t inode_count = DEFAULT_INODE_COUNT;                   // inode 总数
+    uint32_t block_bitmap_start = 1;                              // 数据块位图的起始块
+    uint32_t inode_bitmap_start = 14;                             // inode 位图的起始块
+    uint32_t inode_list_start = 16;                               // inode 列表的起始块
+    uint32_t data_block_start = 600;                              // 数据块区域的起始块
+    uint32_t version = FS_VERSION;                                // 磁盘格式版本
+    uint32_t inode_size = INODE_SIZE;                             // 每个inode占用的字节数
+
+    static std::string check(uint64_t fs_size, uint32_t block_size, uint32_t inode_count);
+    static Geometry layout(uint64_t fs_size, uint32_t block_size, uint32_t inode_count);
+    void load(const SuperBlock &sb);
+
+    /**
+     * @brief 块在镜像中的字节偏移
+     */
+    uint64_t offset(uint32_t block_id) const { return static_cast<uint64_t>(block_id) * block_size; }
+
+    /**
+     * @brief 一个目录块能存放的目录项数
+     */
+    uint32_t dir_entries() const { return block_size / DIR_ENTRY_SIZE; }
+
+    /**
+     * @brief 一个索引块能存放的索引数, 除去块号和下一个索引块
+     */
+    uint32_t index_entries() const { return block_size / 4 - 2; }
+
+    /**
+     * @brief 一个inode块能存放的inode数
+     * inode块开头是这些inode的分配位图, 其后紧跟inode
+     */
+    uint32_t chunk_inodes() const { return block_size * 8 / (inode_size * 8 + 1); }
+
+    /**
+     * @brief inode块开头的分配位图字节数
+     */
+    uint32_t chunk_header() const { return (chunk_inodes() + 7) / 8; }
+
+    /**
+     * @brief 每个inode之后内联数据区的字节数, 旧磁盘为0
+     */
+    uint32_t inline_size() const { return inode_size - INODE_SIZE; }
+
+    /**
+     * @brief 格式化时划出的数据块位图块数
+     */
+    uint32_t bitmap_blocks() const { return inode_bitmap_start - block_bitmap_start; }
+
+    /**
+     * @brief 第n个数据块位图块所在的块号
+     * 格式化时划出的位图块之后，扩容出来的区域每block_size*8个块为一组，
+     * 每组的第一个块存放这一组的位图
+     */
+    uint32_t bitmap_block(uint32_t n) const {
+        if (n < bitmap_blocks()) {
+            return block_bitmap_start + n;
+        }
+        return n * block_size * 8;
+    }
+
+    /**
+     * @brief 块组的块数, 每个位图块管理一个块组
+     */
+    uint32_t group_blocks() const { return block_size * 8; }
+
+    /**
+     * @brief 块组数
+     */
+    uint32_t group_count() const { return (block_count + group_blocks() - 1) / group_blocks(); }
+
+    /**
+     * @brief 数据块所在的块组
+     */
+    uint32_t group_of(uint32_t block_id) const { return block_id / group_blocks(); }
+
+    /**
+     * @brief 块组的第一个可分配的数据块
+     */
+    uint32_t group_start(uint32_t group) const { return std::max(group * group_blocks(), data_block_start); }
+
+    /**
+     * @brief 格式化时的inode表平均分给各个块组, 每组的inode数
+     */
+    uint32_t group_inodes() const { return (inode_count + group_count() - 1) / group_count(); }
+};
+
+/**
+ * 位图, 第i位存放在第i/8个字节的第i%8位
+ */
+struct Bitmap {
+    std::vector<uint8_t> bytes;
+    uint32_t bits = 0;
+
+    void resize(uint32_t count) {
+        bits = count;
+        bytes.assign((count + 7) / 8, 0);
+    }
+    void extend(uint32_t count) {
+        bits = count;
+        bytes.resize((count + 7) / 8, 0);
+    }
+    bool test(uint32_t i) const { return bytes[i / 8] >> (i % 8) & 1; }
+    void set(uint32_t i) { bytes[i / 8] |= static_cast<uint8_t>(1u << (i % 8)); }
+    void reset(uint32_t i) { bytes[i / 8] &= static_cast<uint8_t>(~(1u << (i % 8))); }
+    void reset() { std::fill(bytes.begin(), bytes.end(), 0); }
+
+    /**
+     * @brief 统计被置位的位数
+     */
+    uint32_t count() const {
+        uint32_t result = 0;
+        for (uint8_t byte : bytes) {
+            result += std::bitset<8>(byte).count();
+        }
+        return result;
+    }
+};
+
+/**
+ * 元数据日志（预写日志）
+ * 命令执行期间对元数据块的修改先缓存在事务中，不直接写入磁盘；
+ * 事务提交后进入待提交组，组提交时把整组脏块连同日志头一次顺序写入日志区，只做一次fsync，
+ * 之后再写回原位置。挂载时若日志区中有校验通过的记录，则重放到原位置。
+ * 普通文件的数据块不记日志，直接写入磁盘。
+ */
+struct Journal {
+    /**
+     * 日志头, 位于日志区的第一个块, 其后紧跟count个记录块
+     * 链式记录的magic为JOURNAL_CHAIN_MAGIC, 记录放在文件系统末尾之后的临时区域, blocks[0]是这个区域的起始块号
+     */
+    struct Header {
+        uint32_t magic;                      // JOURNAL_MAGIC
+        uint32_t sequence;                   // 记录序号
+        uint32_t count;                      // 记录的块数, 0表示日志为空
+        uint32_t checksum;                   // 记录内容的校验和
+        uint32_t blocks[JOURNAL_HEADER_SLOTS]; // 每个记录块对应的原块号
+    };
+
+    uint32_t start = 0;               // 日志区起始块号, 0表示未启用日志
+    uint32_t capacity = 0;            // 一条记录最多容纳的块数
+    uint32_t sequence = 0;            // 最近一条记录的序号
+    int depth = 0;                    // 事务嵌套深度
+    bool checkpoint_unsynced = false; // 写回原位置后是否尚未fsync
+    std::map<uint32_t, std::vector<char>> running;   // 当前事务的脏块
+    std::map<uint32_t, std::vector<char>> committed; // 已提交、等待组提交的脏块
+    std::set<uint32_t> checkpointed;                 // 最近一次写回但尚未fsync的块
+
+    /**
+     * @brief 开始一个事务, 可以嵌套
+     */
+    void begin() { ++depth; }
+
+    void commit();
+    void flush();
+    void mount();
+    void format(uint32_t journal_start, uint32_t journal_blocks);
+    void read(uint64_t offset, void *buf, size_t len);
+    void write(uint64_t offset, const void *buf, size_t len);
+    void write_data(uint64_t offset, const void *buf, size_t len);
+
+    void read_disk(uint64_t offset, void *buf, size_t len);
+
+  private:
+    void read_live(uint64_t offset, void *buf, size_t len);
+    void replay();
+    void sync_checkpoint();
+    void write_record(std::FILE *fp, std::map<uint32_t, std::vector<char>>::iterator first, uint32_t count);
+    void write_chain(std::FILE *fp);
+    void replay_chain(const Header &header);
+    static uint32_t checksum(const Header &header, const std::vector<char> &record);
+    static uint32_t chain_checksum(const Header &header, const std::vector<char> &area);
+};
+
 /**
  * Inode位图
+ * 格式化时划出的inode表由inode位图管理；inode表用完后从数据块中分配inode块，
+ * inode块由一棵两层的分配树索引：根索引块的每一项指向一个叶子索引块，叶子索引块的每一项指向一个inode块。
+ * 第c个inode块的第k个inode编号为 inode_count + c * chunk_inodes + k
  */
 struct InodeBitmap {
-    std::bitset<INODE_COUNT> bitmap;
-    InodeBitmap() { load_bitmap(); }
+    Bitmap bitmap;                 // inode表的位图
+    uint32_t tree_root = 0;        // 分配树的根索引块, 0表示没有
+    std::vector<uint32_t> leaves;  // 分配树的叶子索引块
+    std::vector<uint32_t> chunks;  // 按顺序排列的inode块
+    std::vector<Bitmap> chunk_maps; // 每个inode块的分配位图
+    uint32_t chunk_hint = 0;       // 第一个可能有空闲inode的inode块
 
     /**
      * @brief 初始化inode位图
      */
     void init_bitmap() {
-        bitmap.reset();
+        bitmap.resize(geometry.inode_count);
+        tree_root = 0;
+        leaves.clear();
+        chunks.clear();
+        chunk_maps.clear();
+        chunk_hint = 0;
         save_bitmap();
     }
 
-    /**
-     * @brief 从文件中读取inode位图
-     */
-    void load_bitmap() {
-        std::ifstream file(disk_path, std::ios::binary | std::ios::in);
-        file.seekg(INODE_BITMAP_START * BLOCK_SIZE);
-        file.read(reinterpret_cast<char *>(&bitmap), sizeof(bitmap));
-        file.close();
-    };
+    void load_bitmap(uint32_t root);
 
     /**
      * @brief 保存inode位图到文件
      */
     void save_bitmap() {
-        std::ofstream file(disk_path, std::ios::binary | std::ios::out | std::ios::in);
-        file.seekp(INODE_BITMAP_START * BLOCK_SIZE);
-        file.write(reinterpret_cast<const char *>(&bitmap), sizeof(bitmap));
-        file.close();
+        journal.write(geometry.offset(geometry.inode_bitmap_start), bitmap.bytes.data(), bitmap.bytes.size());
     };
 
     /**
-     * @brief 获取一个空闲inode
+     * @brief 只保存某个inode所在的位图块
+     * @param inode_id inode编号
+     */
+    void save_bitmap_block(uint32_t inode_id) {
+        if (inode_id >= geometry.inode_count) {
+            uint32_t c = (inode_id - geometry.inode_count) / geometry.chunk_inodes();
+            journal.write(geometry.offset(chunks[c]), chunk_maps[c].bytes.data(), chunk_maps[c].bytes.size());
+            return;
+        }
+        uint32_t offset = inode_id / 8 / geometry.block_size * geometry.block_size;
+        uint32_t len = std::min<uint32_t>(geometry.block_size, bitmap.bytes.size() - offset);
+        journal.write(geometry.offset(geometry.inode_bitmap_start) + offset, bitmap.bytes.data() + offset, len);
+    }
+
+    uint32_t get_free_inode(uint32_t group = 0);
+    uint32_t dir_group() const;
+
+    /**
+     * @brief inode所属的块组
+     * 格式化时的inode表按编号平均分给各个块组, 之后分配的inode块属于它所在的块组
+     * @param inode_id inode编号
      */
-    uint32_t get_free_inode() {
-        for (uint32_t i = 0; i < INODE_COUNT; i++) {
-            if (!bitmap.test(i)) {
-                bitmap.set(i);
-                save_bitmap();
-                // printf("get_free_inode %d", i);
-                return i;
-            }
+    uint32_t group_of(uint32_t inode_id) const {
+        if (inode_id < geometry.inode_count) {
+            return std::min(inode_id / geometry.group_inodes(), geometry.group_count() - 1);
         }
-        return static_cast<uint32_t>(-1);
+        uint32_t c = (inode_id - geometry.inode_count) / geometry.chunk_inodes();
+        return c < chunks.size() ? geometry.group_of(chunks[c]) : 0;
     }
 
     /**
@@ -156,27 +496,82 @@ struct InodeBitmap {
      * @param inode_id inode编号
      */
     void free_inode(uint32_t inode_id) {
-        bitmap.reset(inode_id);
-        save_bitmap();
+        if (inode_id >= geometry.inode_count) {
+            uint32_t c = (inode_id - geometry.inode_count) / geometry.chunk_inodes();
+            chunk_maps[c].reset((inode_id - geometry.inode_count) % geometry.chunk_inodes());
+            chunk_hint = std::min(chunk_hint, c);
+        } else {
+            bitmap.reset(inode_id);
+        }
+        save_bitmap_block(inode_id);
+    }
+
+    /**
+     * @brief inode在镜像中的字节偏移
+     * @param inode_id inode编号
+     */
+    uint64_t inode_offset(uint32_t inode_id) const {
+        uint32_t c = inode_id < geometry.inode_count ? 0 : (inode_id - geometry.inode_count) / geometry.chunk_inodes();
+        if (inode_id < geometry.inode_count || c >= chunks.size()) {
+            return geometry.offset(geometry.inode_list_start) + static_cast<uint64_t>(inode_id) * geometry.inode_size;
+        }
+        uint32_t k = (inode_id - geometry.inode_count) % geometry.chunk_inodes();
+        return geometry.offset(chunks[c]) + geometry.chunk_header() + static_cast<uint64_t>(k) * geometry.inode_size;
+    }
+
+    /**
+     * @brief inode是否已被使用
+     * @param inode_id inode编号
+     */
+    bool is_used(uint32_t inode_id) const {
+        if (inode_id < geometry.inode_count) {
+            return bitmap.test(inode_id);
+        }
+        uint32_t c = (inode_id - geometry.inode_count) / geometry.chunk_inodes();
+        return c < chunks.size() && chunk_maps[c].test((inode_id - geometry.inode_count) % geometry.chunk_inodes());
+    }
+
+    /**
+     * @brief 当前可用的inode总数, 包括已分配的inode块
+     */
+    uint32_t capacity() const { return geometry.inode_count + static_cast<uint32_t>(chunks.size()) * geometry.chunk_inodes(); }
+
+    /**
+     * @brief 已使用的inode数
+     */
+    uint32_t used() const {
+        uint32_t result = bitmap.count();
+        for (const Bitmap &map : chunk_maps) {
+            result += map.count();
+        }
+        return result;
     }
+
+  private:
+    uint32_t add_chunk(uint32_t group);
 };
 
 /**
  * 数据块位图
+ * 每个位图块管理的block_size*8个块是一个块组, 内存中记录每组的空闲块数,
+ * 分配时从希望的位置所在的块组开始找, 跳过已满的块组
  */
 struct BlockBitmap {
-    std::bitset<BLOCK_COUNT> bitmap;
-    BlockBitmap() { load_bitmap(); }
+    Bitmap bitmap;
+    std::vector<uint32_t> group_free; // 每个块组的空闲块数
+    uint32_t reserved = 0;            // 追加缓冲预留、尚未分配的数据块数
 
     /**
      * @brief 初始化数据块位图
      */
     void init_bitmap() {
-        bitmap.reset();
-        // 前600块已经被占用
-        for (int i = 0; i < 600; i++) {
+        bitmap.resize(geometry.block_count);
+        reserved = 0;
+        // 数据区之前的块已经被占用
+        for (uint32_t i = 0; i < geometry.data_block_start; i++) {
             bitmap.set(i);
         }
+        count_groups();
         save_bitmap();
     }
 
@@ -184,36 +579,160 @@ struct BlockBitmap {
      * @brief 从文件中读取数据块位图
      */
     void load_bitmap() {
-        std::ifstream file(disk_path, std::ios::binary | std::ios::in);
-        file.seekg(BLOCK_BITMAP_START * BLOCK_SIZE);
-        file.read(reinterpret_cast<char *>(&bitmap), sizeof(bitmap));
-        file.close();
+        bitmap.resize(geometry.block_count);
+        // 格式化时划出的位图块是连续的，一次读出；扩容出来的每组位图逐块读
+        size_t primary = std::min<size_t>(bitmap.bytes.size(), geometry.offset(geometry.bitmap_blocks()));
+        journal.read(geometry.offset(geometry.block_bitmap_start), bitmap.bytes.data(), primary);
+        for (size_t offset = primary; offset < bitmap.bytes.size(); offset += geometry.block_size) {
+            size_t len = std::min<size_t>(geometry.block_size, bitmap.bytes.size() - offset);
+            journal.read(geometry.offset(geometry.bitmap_block(offset / geometry.block_size)), bitmap.bytes.data() + offset, len);
+        }
+        count_groups();
     };
 
+    /**
+     * @brief 按位图重新统计每个块组的空闲块数
+     */
+    void count_groups() {
+        group_free.assign(geometry.group_count(), 0);
+        for (uint32_t byte = 0; byte < bitmap.bytes.size(); byte++) {
+            uint32_t valid = std::min<uint32_t>(8, geometry.block_count - byte * 8);
+            group_free[geometry.group_of(byte * 8)] += valid - static_cast<uint32_t>(std::bitset<8>(bitmap.bytes[byte]).count());
+        }
+    }
+
     /**
      * @brief 保存数据块位图到文件
      */
     void save_bitmap() {
-        std::ofstream file(disk_path, std::ios::binary | std::ios::out | std::ios::in);
-        file.seekp(BLOCK_BITMAP_START * BLOCK_SIZE);
-        file.write(reinterpret_cast<const char *>(&bitmap), sizeof(bitmap));
-        file.close();
+        size_t primary = std::min<size_t>(bitmap.bytes.size(), geometry.offset(geometry.bitmap_blocks()));
+        journal.write(geometry.offset(geometry.block_bitmap_start), bitmap.bytes.data(), primary);
+        for (size_t offset = primary; offset < bitmap.bytes.size(); offset += geometry.block_size) {
+            size_t len = std::min<size_t>(geometry.block_size, bitmap.bytes.size() - offset);
+            journal.write(geometry.offset(geometry.bitmap_block(offset / geometry.block_size)), bitmap.bytes.data() + offset, len);
+        }
+    }
+
+    /**
+     * @brief 只保存某个数据块所在的位图块
+     * @param block_id 数据块号
+     */
+    void save_bitmap_block(uint32_t block_id) {
+        uint32_t n = block_id / 8 / geometry.block_size;
+        uint32_t offset = n * geometry.block_size;
+        uint32_t len = std::min<uint32_t>(geometry.block_size, bitmap.bytes.size() - offset);
+        journal.write(geometry.offset(geometry.bitmap_block(n)), bitmap.bytes.data() + offset, len);
     }
 
+    /**
+     * @brief 空闲数据块数, 不扣除预留
+     */
+    uint32_t free_count() const {
+        uint32_t result = 0;
+        for (uint32_t free : group_free) {
+            result += free;
+        }
+        return result;
+    }
+
+    /**
+     * @brief 没有被预留的空闲数据块数, 文件数据最多只能分配这么多
+     */
+    uint32_t available() const {
+        uint32_t free = free_count();
+        return free > reserved ? free - reserved : 0;
+    }
+
+    /**
+     * @brief 为缓冲的数据预留数据块, 此时不分配具体的块
+     * @param count 需要的块数
+     * @return 是否预留成功, 剩余空间不足时不预留
+     */
+    bool reserve(uint32_t count) {
+        if (count > available()) {
+            return false;
+        }
+        reserved += count;
+        return true;
+    }
+
+    /**
+     * @brief 归还预留的数据块
+     * @param count 块数
+     */
+    void unreserve(uint32_t count) { reserved -= std::min(reserved, count); }
+
     /**
      * @brief 获取一个空闲数据块
+     * @param goal 希望的块号, 从它开始向后找, 让相关的块落在同一个块组
      * @return 数据块号
      */
-    uint32_t get_free_block() {
-        for (uint32_t i = 600; i < BLOCK_COUNT; i++) {
-            if (!bitmap.test(i)) {
-                bitmap.set(i);
-                save_bitmap();
-                // printf("get_free_inode %d", i);
-                return i;
+    uint32_t get_free_block(uint32_t goal = 0) {
+        uint32_t first = UINT32_MAX;
+        if (find_run(goal, 1, first) == UINT32_MAX) {
+            return static_cast<uint32_t>(-1);
+        }
+        take(first);
+        save_bitmap_block(first);
+        return first;
+    }
+
+    /**
+     * @brief 获取一段连续的空闲数据块
+     * @param count 需要的块数
+     * @return 第一个数据块号, 没有足够的连续空间时返回UINT32_MAX
+     */
+    uint32_t get_free_run(uint32_t count) {
+        uint32_t fallback = UINT32_MAX;
+        uint32_t first = find_run(geometry.data_block_start, count, fallback);
+        if (first == UINT32_MAX) {
+            return UINT32_MAX;
+        }
+        for (uint32_t i = first; i < first + count; i++) {
+            take(i);
+        }
+        save_bitmap_range(first, count);
+        return first;
+    }
+
+    /**
+     * @brief 把一个空闲块标记为已使用, 由调用者保存位图
+     * @param block_id 数据块号
+     */
+    void take(uint32_t block_id) {
+        bitmap.set(block_id);
+        group_free[geometry.group_of(block_id)]--;
+    }
+
+    /**
+     * @brief 分配最多count个连续的空闲数据块
+     * goal空闲时从goal向后延伸，让文件尽量连续；否则从goal向后取第一段足够长的空闲区，没有时取第一段空闲区
+     * @param goal 希望的起始块号
+     * @param count 需要的块数
+     * @param got 实际分配的块数
+     * @return 第一个数据块号, 没有空闲块时返回UINT32_MAX
+     */
+    uint32_t get_free_extent(uint32_t goal, uint32_t count, uint32_t &got) {
+        uint32_t first = UINT32_MAX;
+        got = 0;
+        if (goal >= geometry.data_block_start && goal < geometry.block_count && !bitmap.test(goal)) {
+            first = goal;
+        } else {
+            uint32_t fallback = UINT32_MAX;
+            first = find_run(goal, count, fallback);
+            if (first == UINT32_MAX) {
+                first = fallback;
             }
         }
-        return static_cast<uint32_t>(-1);
+        if (first == UINT32_MAX) {
+            return UINT32_MAX;
+        }
+        while (got < count && first + got < geometry.block_count && !bitmap.test(first + got)) {
+            take(first + got);
+            got++;
+        }
+        save_bitmap_range(first, got);
+        return first;
     }
 
     /**
@@ -222,15 +741,143 @@ struct BlockBitmap {
      */
     void free_block(uint32_t block_id) {
         bitmap.reset(block_id);
-        save_bitmap();
+        group_free[geometry.group_of(block_id)]++;
+        save_bitmap_block(block_id);
+    }
+
+    /**
+     * @brief 释放一段连续的数据块
+     * @param start 第一个数据块号
+     * @param count 块数
+     */
+    void free_extent(uint32_t start, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            bitmap.reset(start + i);
+            group_free[geometry.group_of(start + i)]++;
+        }
+        save_bitmap_range(start, count);
+    }
+
+  private:
+    /**
+     * @brief 从goal开始向后找一段空闲块, 到末尾后从数据区开头绕回, 跳过没有空闲块的块组
+     * @param goal 起始块号, 不在数据区时从数据区开头找
+     * @param count 需要的连续块数
+     * @param fallback 返回找到的第一个空闲块, 没有时为UINT32_MAX
+     * @return 第一段长度达到count的空闲区的起始块号, 没有时返回UINT32_MAX
+     */
+    uint32_t find_run(uint32_t goal, uint32_t count, uint32_t &fallback) const {
+        fallback = UINT32_MAX;
+        if (goal < geometry.data_block_start || goal >= geometry.block_count) {
+            goal = geometry.data_block_start;
+        }
+        uint32_t total = geometry.block_count - geometry.data_block_start;
+        uint32_t run = 0;
+        for (uint32_t n = 0; n < total; n++) {
+            uint32_t i = goal + n < geometry.block_count ? goal + n : goal + n - total;
+            if (i == geometry.data_block_start) {
+                run = 0; // 绕回开头, 空闲区不能跨过末尾
+            }
+            uint32_t group = geometry.group_of(i);
+            if (group_free[group] == 0) {
+                // 整组已满, 跳到下一组
+                n += std::min((group + 1) * geometry.group_blocks(), geometry.block_count) - i - 1;
+                run = 0;
+                continue;
+            }
+            if (bitmap.test(i)) {
+                run = 0;
+                continue;
+            }
+            if (fallback == UINT32_MAX) {
+                fallback = i;
+            }
+            if (++run == count) {
+                return i + 1 - count;
+            }
+        }
+        return UINT32_MAX;
+    }
+
+    /**
+     * @brief 保存一段数据块所在的位图块, 每个位图块只写一次
+     */
+    void save_bitmap_range(uint32_t start, uint32_t count) {
+        uint32_t per_block = geometry.block_size * 8;
+        for (uint32_t block_id = start; block_id < start + count; block_id = (block_id / per_block + 1) * per_block) {
+            save_bitmap_block(block_id);
+        }
     }
 };
 
+/**
+ * 孤儿inode链表
+ * 删除文件和目录时只删除目录项, inode链入这个链表后立即返回, 数据块在命令的间隙分批释放。
+ * 孤儿inode的链接数为0, i_atime存放链表中的下一个孤儿; 链表的头保存在超级块中, 重启后继续回收。
+ * 根目录不会成为孤儿, 0表示链表结束
+ */
+struct OrphanList {
+    uint32_t head = 0; // 链表的头
+
+    /**
+     * @brief 是否还有等待回收的inode
+     */
+    bool empty() const { return head == 0; }
+
+    void load();
+    void push(Inode &inode);
+    void reclaim(uint32_t budget);
+
+  private:
+    void save_head();
+    bool release(Inode &inode, uint32_t &budget, uint32_t &next);
+};
+
+/**
+ * 配额表项
+ * 限额为0表示不限制
+ */
+struct QuotaEntry {
+    uint32_t kind;       // 0-空闲 1-用户 2-组
+    uint32_t id;         // 用户ID或组ID
+    uint32_t blocks;     // 已使用的块数
+    uint32_t inodes;     // 已使用的inode数
+    uint32_t block_soft; // 块数的软限额, 超过时提示
+    uint32_t block_hard; // 块数的硬限额, 不能超过
+    uint32_t inode_soft; // inode数的软限额
+    uint32_t inode_hard; // inode数的硬限额
+};
+
+/**
+ * 配额表
+ * 每个用户和组的用量随块和inode的分配、删除增减, 与引起变化的命令在同一个事务中写入, 查询和检查限额不需要遍历inode。
+ * 文件和目录删除后进入孤儿链表时就不再计入用量; 表满后新出现的用户和组不记录用量, 也不受限制
+ */
+struct QuotaTable {
+    uint32_t table_block = 0; // 配额表所在的块, 0表示没有
+    QuotaEntry entries[MAX_QUOTAS] = {};
+
+    void load();
+    bool create();
+    void rebuild();
+    void charge(const Inode &inode, int64_t blocks, int32_t inodes);
+    uint32_t room(uint32_t uid, uint32_t gid) const;
+    bool can_create(uint32_t uid, uint32_t gid, uint32_t blocks) const;
+    bool over_soft(uint32_t uid, uint32_t gid) const;
+    bool set_limit(uint32_t kind, uint32_t id, const uint32_t *blocks, const uint32_t *inodes, std::string &_shell_output);
+    std::string list(const User &user) const;
+
+  private:
+    int find(uint32_t kind, uint32_t id) const;
+    int find_or_add(uint32_t kind, uint32_t id);
+    void save_entry(int slot);
+};
+
 /**
  * 超级块结构体
  */
 struct SuperBlock {
-    uint32_t fs_size;            // 文件系统大小 （字节）
+    uint32_t fs_size;            // 文件系统大小的低32位 （字节）
     uint32_t block_size;         // 块大小（字节）
     uint32_t inode_count;        // inode 总数
     uint32_t block_count;        // 数据块总数
@@ -242,6 +889,30 @@ struct SuperBlock {
     uint32_t data_block_start;   // 数据块区域的起始位置
     uint32_t ctime;              // 创建时间
     uint32_t last_load_time;     // 最近加载时间
+    uint32_t journal_start;      // 日志区的起始位置
+    uint32_t journal_blocks;     // 日志区的块数
+    uint32_t snapshot_table;     // 快照表所在的块, 0表示没有快照
+    uint32_t inode_tree;         // inode分配树的根索引块
+    uint32_t version;            // 磁盘格式版本, 旧磁盘为0
+    uint32_t upgrade_cursor;     // 升级旧磁盘时下一个要处理的inode
+    uint32_t fs_size_high;       // 文件系统大小的高32位, 版本4之前为0
+    uint32_t orphan_head;        // 等待回收的孤儿inode链表的头, 0表示没有
+    uint32_t quota_table;        // 配额表所在的块, 0表示没有
+    uint32_t inode_size;         // 每个inode占用的字节数, 版本7之前为0, 即INODE_SIZE
+
+    /**
+     * @brief 文件系统大小（字节）
+     */
+    uint64_t image_size() const { return static_cast<uint64_t>(fs_size_high) << 32 | fs_size; }
+
+    /**
+     * @brief 设置文件系统大小
+     * @param size 文件系统大小（字节）
+     */
+    void set_image_size(uint64_t size) {
+        fs_size = static_cast<uint32_t>(size);
+        fs_size_high = static_cast<uint32_t>(size >> 32);
+    }
 
     /**
      * @brief 保存超级块到文件
@@ -249,18 +920,18 @@ struct SuperBlock {
      * @param block_num 超级块所在的块号，默认为0
      */
     void save_super_block(const std::string &filename = disk_path, std::streampos block_num = 0) {
-        std::ofstream file(filename, std::ios::binary | std::ios::in | std::ios::out);
+        std::ifstream file(filename, std::ios::binary | std::ios::in);
         if (!file) {
             std::cerr << "Error opening file for writing: " << filename << std::endl;
             return;
         }
-        block_bitmap.load_bitmap();
-        inode_bitmap.load_bitmap();
-        free_blocks = BLOCK_COUNT - block_bitmap.bitmap.count();
-        free_inodes = INODE_COUNT - inode_bitmap.bitmap.count();
-        file.seekp(block_num * BLOCK_SIZE);
-        file.write(reinterpret_cast<const char *>(this), sizeof(SuperBlock));
         file.close();
+        block_bitmap.load_bitmap();
+        inode_bitmap.load_bitmap(inode_tree);
+        free_blocks = block_bitmap.free_count();
+        free_inodes = inode_bitmap.capacity() - inode_bitmap.used();
+        orphan_head = orphan_list.head;
+        journal.write(geometry.offset(block_num), this, sizeof(SuperBlock));
     }
 
     /**
@@ -276,9 +947,8 @@ struct SuperBlock {
             std::cerr << "Error opening file for reading: " << filename << std::endl;
             return sb;
         }
-        ifs.seekg(block_num * BLOCK_SIZE);
-        ifs.read(reinterpret_cast<char *>(&sb), sizeof(SuperBlock)); //??
         ifs.close();
+        journal.read(geometry.offset(block_num), &sb, sizeof(SuperBlock));
         return sb;
     }
 
@@ -291,8 +961,8 @@ struct SuperBlock {
         oss << std::setw(55)<<std::setfill('-') << "-" << std::endl;
         oss << std::setfill(' ');
         oss << std::fixed << std::setprecision(2);
-        oss << "使用情况: \t"<< (block_count - free_blocks)/float(block_count) << "\%of " << fs_size/(1024*1024) << "MB"  << "\t块大小: \t" << block_size/1024 << " KB" <<std::endl;
-        oss << "总块数: \t" << block_count << "\t\t总inode数: \t" << inode_count<< std::endl;
+        oss << "使用情况: \t"<< (block_count - free_blocks)/float(block_count) << "\%of " << image_size()/(1024*1024) << "MB"  << "\t块大小: \t" << block_size/1024 << " KB" <<std::endl;
+        oss << "总块数: \t" << block_count << "\t\t总inode数: \t" << inode_bitmap.capacity() << std::endl;
         oss << "可用块数: \t" << free_blocks << "\t\t可用inode数: \t" << free_inodes<< std::endl;
         oss << "创建时间: \t" << format_time(ctime)<<std::endl;
         oss << "最近加载时间: \t" << format_time(last_load_time) << std::endl;
@@ -305,15 +975,15 @@ struct SuperBlock {
 
 /**
  * inode 结构体
+ * 版本4起文件大小为64位, 链接数和文件类型缩为16位, 腾出的空间留给大小的高32位, inode仍为48字节
  */
 struct Inode {
-    // 考虑对齐与填充，类型都设置为uint32_t
     uint32_t i_id;          // inode 编号, 表示为位置
-    uint32_t i_size;        // 文件大小, 以字节为单位
-    uint32_t i_blocks;      // 文件所占数据块数量
-    uint32_t i_links_count; // 链接数
-    uint32_t i_indirect;    // 一级间接块指针 0-102399
-    uint32_t i_type;        // 文件类型 0-目录文件 1-普通文件 2-符号链接文件
+    uint16_t i_links_count; // 链接数
+    uint16_t i_type;        // 文件类型 0-目录文件 1-普通文件 2-符号链接文件
+    uint64_t i_size;        // 文件大小, 以字节为单位
+    uint32_t i_blocks;      // 文件所占数据块数量, 块号是32位的, 不会超过块总数
+    uint32_t i_indirect;    // 区段树的根节点, 见 BlockMap
 
     /*访问控制*/
     uint32_t i_mode; // 文件权限
@@ -324,14 +994,43 @@ struct Inode {
     uint32_t i_mtime; // 修改时间
     uint32_t i_atime; // 访问时间
 
+    /**
+     * 版本4之前的inode, 全部字段都是32位
+     */
+    struct Legacy {
+        uint32_t i_id, i_size, i_blocks, i_links_count, i_indirect, i_type;
+        uint32_t i_mode, i_uid, i_gid, i_ctime, i_mtime, i_atime;
+    };
+
+    static uint32_t format();
+
+    /**
+     * @brief 文件的内容是否内联保存在inode之后的内联数据区
+     */
+    bool is_inline() const { return i_type == FILE_TYPE && i_indirect == INLINE_DATA; }
+
+    /**
+     * @brief 文件的内容是否按簇压缩保存, 内联的内容不压缩
+     */
+    bool is_compressed() const { return i_type == FILE_TYPE && (i_mode & COMPRESSED_MODE) != 0; }
+
+    /**
+     * @brief 去掉压缩标志后的权限, 如755
+     */
+    uint32_t permission() const { return i_mode & ~COMPRESSED_MODE; }
+
     /**
      * @brief 保存inode到文件
+     * 磁盘还没升级到版本4时按旧格式保存, 供升级过程中改写块映射使用
      */
     void save_inode() {
-        std::ofstream file(disk_path, std::ios::binary | std::ios::out | std::ios::in);
-        file.seekp(INODE_LIST_START * BLOCK_SIZE + i_id * INODE_SIZE);
-        file.write(reinterpret_cast<const char *>(this), sizeof(Inode));
-        file.close();
+        if (format() < FS_VERSION_SIZE64) {
+            Legacy legacy = {i_id, static_cast<uint32_t>(i_size), i_blocks, i_links_count, i_indirect, i_type,
+                             i_mode, i_uid, i_gid, i_ctime, i_mtime, i_atime};
+            journal.write(inode_bitmap.inode_offset(i_id), &legacy, sizeof(Legacy));
+            return;
+        }
+        journal.write(inode_bitmap.inode_offset(i_id), this, sizeof(Inode));
     }
 
     /**
@@ -340,22 +1039,36 @@ struct Inode {
      * @return 读取到的inode
      */
     static Inode read_inode(uint32_t inode_id) {
+        if (format() < FS_VERSION_SIZE64) {
+            return read_legacy_inode(inode_id);
+        }
         Inode inode;
-        std::ifstream file(disk_path, std::ios::binary | std::ios::in);
-        file.seekg(INODE_LIST_START * BLOCK_SIZE + inode_id * INODE_SIZE);
-        file.read(reinterpret_cast<char *>(&inode), sizeof(Inode));
-        file.close();
+        journal.read(inode_bitmap.inode_offset(inode_id), &inode, sizeof(Inode));
         return inode;
     }
+
+    /**
+     * @brief 按版本4之前的格式读取inode
+     * @param inode_id inode编号
+     * @return 转换后的inode
+     */
+    static Inode read_legacy_inode(uint32_t inode_id) {
+        Legacy legacy;
+        journal.read(inode_bitmap.inode_offset(inode_id), &legacy, sizeof(Legacy));
+        return Inode{legacy.i_id, static_cast<uint16_t>(legacy.i_links_count), static_cast<uint16_t>(legacy.i_type),
+                     legacy.i_size, legacy.i_blocks, legacy.i_indirect, legacy.i_mode, legacy.i_uid, legacy.i_gid,
+                     legacy.i_ctime, legacy.i_mtime, legacy.i_atime};
+    }
 };
+static_assert(sizeof(Inode) == INODE_SIZE, "inode的大小必须与INODE_SIZE一致");
 
 /**
  * 目录项结构体
  */
 struct DirEntry {
-    uint16_t inode_id; // inode < 12032
-    uint16_t type;     // 文件类型 0-目录文件 1-普通文件 2-符号链接文件
-    char name[28];     // 文件名
+    uint32_t inode_id;                // inode编号
+    uint8_t type;                     // 文件类型 0-目录文件 1-普通文件 2-符号链接文件 3-空
+    char name[MAX_NAME_LEN + 1];      // 文件名
 
     /**
      * @brief 设置目录项
@@ -363,19 +1076,52 @@ struct DirEntry {
      * @param type 文件类型
      * @param name 文件名
      */
-    void set(uint16_t inode_id, uint16_t type, const char *name) {
+    void set(uint32_t inode_id, uint8_t type, const char *name) {
         this->inode_id = inode_id;
         this->type = type;
-        strcpy(this->name, name);
+        strncpy(this->name, name, MAX_NAME_LEN);
+        this->name[MAX_NAME_LEN] = '\0';
+    }
+};
+
+/**
+ * 目录子树的统计, 包括目录自身占用的块
+ * 保存在目录第一个目录块的"."目录项中, 名字结尾的'\0'之后; 文件和子目录变化时沿".."逐级更新到根目录
+ */
+struct DirStats {
+    uint64_t bytes = 0;  // 普通文件的总字节数
+    uint64_t blocks = 0; // 占用的块数, 包括目录块和映射块
+    uint32_t files = 0;  // 普通文件数
+    uint32_t dirs = 0;   // 子目录数, 不包括自身
+
+    /**
+     * @brief 把统计中的before部分换成after, 无符号数回绕后结果仍然正确
+     */
+    void replace(const DirStats &before, const DirStats &after) {
+        bytes += after.bytes - before.bytes;
+        blocks += after.blocks - before.blocks;
+        files += after.files - before.files;
+        dirs += after.dirs - before.dirs;
+    }
+
+    bool operator==(const DirStats &other) const {
+        return bytes == other.bytes && blocks == other.blocks && files == other.files && dirs == other.dirs;
     }
+
+    /**
+     * @brief 统计在目录块中的字节偏移
+     */
+    static uint64_t offset() { return offsetof(DirEntry, name) + 2; }
 };
+static_assert(sizeof(DirStats) <= MAX_NAME_LEN - 1, "目录统计必须放得进\".\"目录项的名字");
 
 /**
  * 目录数据块
- * 存储32个目录项 DirEntry
+ * 存储 块大小/32 个目录项 DirEntry, 1KB的块存储32个
  */
 struct DirBlock {
-    DirEntry entries[32];
+    std::vector<DirEntry> entries;
+    DirBlock() : entries(geometry.dir_entries()) {}
 
     /**
      * @brief 初始化目录块
@@ -383,10 +1129,10 @@ struct DirBlock {
      * @param self_inode_id 当前目录的inode_id
      */
     void init_DirBlock(uint32_t parent_inode_id, uint32_t self_inode_id) {
-        entries[0].set(self_inode_id, DIR_TYPE, ".");    // 当前目录
+        entries[0].set(self_inode_id, DIR_TYPE, ".");    // 当前目录, 名字之后的统计为0
         entries[1].set(parent_inode_id, DIR_TYPE, ".."); // 父目录,如何得到父目录的inode_id？设置一个当前目录吗?
-        for (int i = 2; i < 32; i++) {
-            entries[i].set(UINT16_MAX, UNDEFINE_TYPE, "");
+        for (uint32_t i = 2; i < entries.size(); i++) {
+            entries[i].set(UINT32_MAX, UNDEFINE_TYPE, "");
         }
     }
 
@@ -395,144 +1141,3119 @@ struct DirBlock {
      * @param block_id 目录块号
      */
     void save_dir_block(uint32_t block_id) {
-        std::ofstream file(disk_path, std::ios::binary | std::ios::out | std::ios::in);
-        file.seekp(block_id * BLOCK_SIZE);
-        file.write(reinterpret_cast<const char *>(this), sizeof(DirBlock));
+        journal.write(geometry.offset(block_id), entries.data(), entries.size() * sizeof(DirEntry));
+    }
+
+    /**
+     * @brief 设置第一个目录块中保存的子树统计
+     */
+    void set_stats(const DirStats &stats) { memcpy(reinterpret_cast<char *>(entries.data()) + DirStats::offset(), &stats, sizeof(DirStats)); }
+
+    /**
+     * @brief 从文件中读取目录块
+     * @param block_id 目录块号
+     * @return 读取到的目录块
+     */
+    static DirBlock read_dir_block(uint32_t block_id);
+    static DirBlock read_legacy_dir_block(uint32_t block_id);
+};
+
+/**
+ * 索引块
+ * 一个索引块存储 块大小/4-2 个索引（1KB的块存储254个），每个索引指向一个数据块
+ * 保留当前索引块的块号，以及下一个索引块的块号
+ */
+struct IndexBlock {
+    uint32_t block_id;
+    uint32_t next_index;
+    std::vector<uint32_t> index;
+    IndexBlock() : index(geometry.index_entries(), UINT32_MAX) {}
+
+    /**
+     * @brief 保存索引块到文件
+     */
+    void save_index_block() {
+        std::vector<uint32_t> raw = {block_id, next_index};
+        raw.insert(raw.end(), index.begin(), index.end());
+        journal.write(geometry.offset(block_id), raw.data(), raw.size() * sizeof(uint32_t));
+    }
+
+    /**
+     * @brief 从文件中读取索引块
+     * @param id 索引块的块号
+     * @return 读取到的索引块
+     */
+    static IndexBlock read_index_block(uint32_t id) {
+        IndexBlock ib;
+        std::vector<uint32_t> raw(ib.index.size() + 2);
+        journal.read(geometry.offset(id), raw.data(), raw.size() * sizeof(uint32_t));
+        ib.block_id = raw[0];
+        ib.next_index = raw[1];
+        std::copy(raw.begin() + 2, raw.end(), ib.index.begin());
+        return ib;
+    }
+};
+
+/**
+ * 区段: 从逻辑块logical开始的length个块，连续存放在从start开始的数据块中
+ * 在区段树的索引节点中，start是子节点的块号，length不用
+ */
+struct Extent {
+    uint32_t logical;
+    uint32_t start;
+    uint32_t length;
+};
+
+/**
+ * 区段树节点, 占一个块
+ * 开头是节点的块号、深度和项数，其后紧跟各项；深度为0的叶子节点存放文件的区段，
+ * 其余节点的每一项指向一个子节点，logical为子树中的第一个逻辑块
+ */
+struct ExtentNode {
+    struct Header {
+        uint32_t block_id;
+        uint16_t depth;
+        uint16_t count;
+    };
+
+    uint32_t block_id;
+    uint16_t depth;
+    std::vector<Extent> entries;
+
+    /**
+     * @brief 一个节点能存放的项数, 1KB的块存放84项
+     */
+    static uint32_t capacity() { return (geometry.block_size - sizeof(Header)) / sizeof(Extent); }
+
+    /**
+     * @brief 保存节点到文件
+     */
+    void save_extent_node() {
+        std::vector<char> raw(sizeof(Header) + entries.size() * sizeof(Extent));
+        Header header = {block_id, depth, static_cast<uint16_t>(entries.size())};
+        memcpy(raw.data(), &header, sizeof(Header));
+        memcpy(raw.data() + sizeof(Header), entries.data(), entries.size() * sizeof(Extent));
+        journal.write(geometry.offset(block_id), raw.data(), raw.size());
+    }
+
+    /**
+     * @brief 从文件中读取节点
+     * @param id 节点的块号
+     * @return 读取到的节点
+     */
+    static ExtentNode read_extent_node(uint32_t id) {
+        std::vector<char> raw(geometry.block_size);
+        journal.read(geometry.offset(id), raw.data(), raw.size());
+        Header header;
+        memcpy(&header, raw.data(), sizeof(Header));
+        ExtentNode node = {header.block_id, header.depth, {}};
+        node.entries.resize(std::min<uint32_t>(header.count, capacity()));
+        memcpy(node.entries.data(), raw.data() + sizeof(Header), node.entries.size() * sizeof(Extent));
+        return node;
+    }
+};
+
+/**
+ * 文件的块映射
+ * inode的i_indirect指向区段树的根节点，连续存放的块只占一项。文件只在末尾追加，
+ * 树只在最右侧增长；根节点放满后整体下移为子节点，根的深度加一。
+ * 旧磁盘和早于升级的快照中，根映射块是索引块链表（版本0、1）或多级索引（版本2），只读：
+ * 多级索引的前 index_entries-3 项直接指向数据块，最后三项依次指向一级、二级、三级间接块
+ */
+struct BlockMap {
+    uint32_t root;                         // 根映射块
+    uint32_t version;                      // 映射格式对应的磁盘版本
+    std::map<uint32_t, IndexBlock> cache;  // 旧格式已读取的映射块
+    std::map<uint32_t, ExtentNode> nodes;  // 已读取的区段树节点
+    std::set<uint32_t> dirty;              // 修改后尚未保存的区段树节点
+
+    explicit BlockMap(uint32_t root_id, uint32_t format = UINT32_MAX);
+    void init();
+    uint32_t lookup(uint32_t n);
+    uint32_t map(uint32_t n, Inode &inode, uint32_t block_id = UINT32_MAX);
+    uint32_t extend(uint32_t count, Inode &inode, uint32_t logical = UINT32_MAX);
+    uint32_t size();
+    std::vector<Extent> extents(uint32_t from = 0, uint32_t to = UINT32_MAX);
+    std::vector<uint32_t> blocks();
+    std::vector<uint32_t> legacy_blocks();
+    void truncate(uint32_t keep, Inode &inode);
+    void save();
+
+    /**
+     * @brief 多级索引中直接指针的个数
+     */
+    static uint32_t direct() { return geometry.index_entries() - 3; }
+
+  private:
+    IndexBlock &load(uint32_t block_id);
+    ExtentNode &node(uint32_t block_id);
+    int path(uint32_t n, uint32_t slots[4]) const;
+    void collect(uint32_t block_id, uint32_t from, uint32_t to, std::vector<Extent> &result);
+    std::vector<uint32_t> right_path();
+    uint32_t new_node(uint16_t depth, Inode &inode);
+    bool append(const Extent &extent, Inode &inode);
+    void free_children(uint32_t block_id, Inode &inode);
+};
+
+/**
+ * 快照表项, 16个表项恰好占满一个块
+ */
+struct SnapshotEntry {
+    uint32_t state;        // 0-空闲 1-有效 2-删除中
+    uint32_t ctime;        // 创建时间
+    uint32_t bitmap_index; // 冻结位图所在数据块的索引块
+    uint32_t map_head;     // 第一个映射块
+    uint32_t map_count;    // 已保存旧内容的块数
+    char name[44];         // 快照名
+};
+
+/**
+ * 快照映射块
+ * 记录快照创建后被改写的块: 原块号 -> 保存快照时刻内容的块号
+ */
+struct SnapMapBlock {
+    uint32_t block_id;
+    uint32_t next;
+    uint32_t count;
+    uint32_t pairs[126][2];
+    uint32_t reserved;
+
+    /**
+     * @brief 保存映射块到文件
+     */
+    void save_map_block() {
+        journal.write(geometry.offset(block_id), this, sizeof(SnapMapBlock));
+    }
+
+    /**
+     * @brief 从文件中读取映射块
+     * @param id 映射块的块号
+     * @return 读取到的映射块
+     */
+    static SnapMapBlock read_map_block(uint32_t id) {
+        SnapMapBlock mb;
+        journal.read(geometry.offset(id), &mb, sizeof(SnapMapBlock));
+        return mb;
+    }
+};
+
+/**
+ * 快照
+ * 创建快照时只冻结当前的块位图；之后快照时刻已使用的块第一次被改写前，
+ * 先把旧内容复制到新分配的块中并记录映射。读快照时按映射把块号转换到旧内容所在的块。
+ */
+struct Snapshot {
+    SnapshotEntry entry;
+    std::vector<uint8_t> frozen;                           // 快照时刻的块位图
+    std::map<uint32_t, uint32_t> remap;                    // 原块号 -> 旧内容所在块号
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;      // 按写入顺序排列的映射, 与映射块一致
+    std::vector<uint32_t> map_blocks;                      // 映射块链
+    size_t persisted = 0;                                  // 已写入映射块的映射数
+
+    /**
+     * @brief 判断某个块在快照时刻是否已被使用
+     */
+    bool is_frozen(uint32_t block_id) const {
+        return block_id / 8 < frozen.size() && (frozen[block_id / 8] >> (block_id % 8) & 1);
+    }
+};
+
+/**
+ * 快照表
+ */
+struct SnapshotTable {
+    uint32_t table_block = 0;        // 快照表所在的块
+    Snapshot slots[MAX_SNAPSHOTS];
+    int view = -1;                   // 当前命令读取的快照, -1表示实时文件系统
+    int preserve_depth = 0;          // preserve的递归深度
+    bool saving_maps = false;        // 是否正在写映射块
+
+    void load();
+    void clear();
+    int find(const std::string &name) const;
+    bool create(const std::string &name, std::string &_shell_output);
+    bool remove(const std::string &name, std::string &_shell_output);
+    std::string list() const;
+    bool preserve(uint32_t block_id);
+    uint32_t translate(uint32_t block_id) const;
+    void reclaim(uint32_t budget);
+
+  private:
+    void save_table();
+    void save_maps();
+    uint32_t get_free_block();
+    std::vector<uint32_t> frozen_blocks(const Snapshot &snap, bool with_index) const;
+    bool is_shared_copy(int slot, uint32_t block_id, uint32_t copy_id) const;
+};
+
+/**
+ * 打开的文件
+ * 打开时解析一次路径，之后的读写直接使用inode编号、当前偏移和最近访问的区段
+ */
+struct OpenFile {
+    uint32_t inode_id = UINT32_MAX; // 文件的inode编号, UINT32_MAX表示空闲
+    uint32_t ctime = 0;             // 打开时inode的创建时间, 用于发现文件已被删除
+    uint32_t parent_id = 0;         // 所在目录的inode编号, 写入后更新目录的统计
+    bool is_write = false;          // 是否可写
+    uint64_t offset = 0;            // 当前读写位置
+    Extent cursor = {0, 0, 0};      // 最近访问的区段, 顺序读写落在其中时不再查区段树
+    std::string path;               // 打开时的路径
+    std::string pending;            // 追加缓冲, 尚未写入磁盘的文件末尾内容
+    uint64_t pending_start = 0;     // 追加缓冲在文件中的起始偏移
+    uint32_t pending_since = 0;     // 追加缓冲中最早的内容写入的时间
+    uint64_t version = 0;           // 只读打开时固定的版本编号
+    uint32_t mapped = 0;            // 缓冲开始时文件已分配的块数
+    uint32_t reserved = 0;          // 为缓冲预留的块数, 写入磁盘时才分配
+
+    bool append(const std::string &content);
+    bool flush(bool whole_blocks = false);
+};
+
+/**
+ * 打开文件表, 每个用户一张, 文件描述符是表中的下标
+ */
+struct FileTable {
+    OpenFile files[MAX_OPEN_FILES];
+
+    /**
+     * @brief 打开文件
+     * @param inode_id 文件的inode编号
+     * @param parent_id 所在目录的inode编号
+     * @param is_write 是否可写
+     * @param path 文件路径
+     * @return 文件描述符, 表满时为-1
+     */
+    int open(uint32_t inode_id, uint32_t parent_id, bool is_write, const std::string &path) {
+        for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+            if (files[fd].inode_id == UINT32_MAX) {
+                files[fd] = OpenFile();
+                files[fd].inode_id = inode_id;
+                files[fd].parent_id = parent_id;
+                files[fd].ctime = Inode::read_inode(inode_id).i_ctime;
+                files[fd].is_write = is_write;
+                files[fd].path = path;
+                return fd;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * @brief 关闭文件
+     * @param fd 文件描述符
+     */
+    void close(int fd) {
+        block_bitmap.unreserve(files[fd].reserved);
+        files[fd] = OpenFile();
+    }
+
+    /**
+     * @brief 判断是否打开了某个文件
+     * @param inode_id 文件的inode编号
+     */
+    bool holds(uint32_t inode_id) const {
+        if (inode_id == UINT32_MAX) {
+            return false;
+        }
+        for (const OpenFile &file : files) {
+            if (file.inode_id == inode_id) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string list() const;
+};
+
+/**
+ * 文件锁的模式
+ */
+enum LockMode : uint8_t {
+    LOCK_SHARED,   // 共享锁, 打开文件的读者持有, 读者之间不互斥
+    LOCK_WRITE,    // 写锁, 写者之间互斥, 读者读固定的版本, 与写者不互斥
+    LOCK_EXCLUSIVE // 排他锁, 删除和覆盖文件时独占
+};
+
+/**
+ * 对一个inode加锁的请求
+ */
+struct LockRequest {
+    uint32_t inode_id;
+    LockMode mode;
+};
+
+/**
+ * 文件锁管理器
+ * 锁以inode为单位, 持有者是用户编号, 同一个用户的命令和打开的文件共用持有计数, 锁可以重入;
+ * 一条命令需要的锁按inode编号排序后一次全部获得, 拿不到时不持有任何锁, 在每个inode的等待队列中排队,
+ * 先来的先获得, 所以多个inode的操作之间不会死锁
+ */
+struct LockManager {
+    /**
+     * 一个持有者对某个inode的持有次数
+     */
+    struct Holder {
+        uint32_t count[3] = {0, 0, 0}; // 按LockMode计数
+    };
+
+    /**
+     * 一个inode上的锁
+     */
+    struct Lock {
+        std::map<int, Holder> holders;                // 持有者
+        std::vector<std::pair<int, LockMode>> queue;  // 等待队列, 按到达顺序
+    };
+
+    std::map<uint32_t, Lock> locks;     // 有人持有或等待的inode
+    std::map<int, uint32_t> since;      // 正在等待的用户开始等待的时间
+
+    bool acquire(int owner, std::vector<LockRequest> requests);
+    void release(int owner, const std::vector<LockRequest> &requests);
+    void cancel(int owner);
+
+    /**
+     * @brief inode上是否有人持有或等待锁
+     */
+    bool locked(uint32_t inode_id) const { return locks.find(inode_id) != locks.end(); }
+
+    /**
+     * @brief 用户已经等待的秒数, 没有在等待时为0
+     * @param owner 用户编号
+     */
+    uint32_t waited(int owner) const {
+        auto it = since.find(owner);
+        return it == since.end() ? 0 : static_cast<uint32_t>(time(0)) - it->second;
+    }
+
+    /**
+     * @brief 两种模式的锁能否由不同的用户同时持有
+     */
+    static bool compatible(LockMode a, LockMode b) {
+        return a != LOCK_EXCLUSIVE && b != LOCK_EXCLUSIVE && !(a == LOCK_WRITE && b == LOCK_WRITE);
+    }
+
+  private:
+    bool grantable(int owner, uint32_t inode_id, LockMode mode) const;
+    void dequeue(int owner, uint32_t inode_id);
+};
+
+/**
+ * 文件的一个版本
+ * 读者打开文件时固定当时的版本, 之后写者改写其中的内容前先把旧内容按块保存下来,
+ * 读者读到的始终是打开时的文件
+ */
+struct FileVersion {
+    uint32_t inode_id = 0;                 // 文件的inode编号
+    uint64_t epoch = 0;                    // 创建时的纪元
+    uint64_t size = 0;                     // 这个版本的文件大小
+    uint32_t readers = 0;                  // 固定这个版本的读者数
+    std::map<uint32_t, std::string> saved; // 之后被改写的块的旧内容, 键是逻辑块号
+};
+
+/**
+ * 文件版本表
+ * 写入有读者的文件时纪元加一, 之后打开的读者不再共用之前的版本; 读者全部关闭后版本立即回收
+ */
+struct VersionTable {
+    uint64_t epoch = 0;                       // 全局纪元
+    uint64_t next_id = 1;                     // 下一个版本编号, 0表示没有版本
+    std::map<uint64_t, FileVersion> versions; // 版本编号 -> 版本
+    std::map<uint32_t, uint64_t> changed;     // 有版本的文件最近一次被写入时的纪元
+
+    uint64_t pin(uint32_t inode_id);
+    void unpin(uint64_t id);
+    void preserve(const Inode &file_inode, uint64_t offset, uint64_t end);
+    std::string read(uint64_t id, uint64_t offset, uint64_t length, Extent *cursor = nullptr) const;
+
+    /**
+     * @brief 版本的文件大小
+     * @param id 版本编号
+     */
+    uint64_t size(uint64_t id) const {
+        auto it = versions.find(id);
+        return it == versions.end() ? 0 : it->second.size;
+    }
+};
+
+/**
+ * 遍历目录树的线程池
+ * 每个线程有自己的任务队列, 从队尾取自己放入的任务, 队列空了就从其他线程的队首窃取。
+ * 调用wait的线程也参与执行; 只在遍历期间存在, 遍历时服务端不执行其他命令, 磁盘只读
+ */
+struct WorkPool {
+    /**
+     * 一个线程的任务队列
+     */
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    explicit WorkPool(unsigned threads = 0);
+    ~WorkPool();
+    bool spawn(std::function<void()> task);
+    void wait();
+
+  private:
+    std::vector<std::unique_ptr<Queue>> queues; // 每个线程一个队列, 最后一个属于调用wait的线程
+    std::vector<std::thread> workers;
+    std::atomic<uint32_t> queued{0};            // 排队中的任务数
+    std::atomic<uint32_t> pending{0};           // 尚未完成的任务数
+    std::atomic<bool> stopping{false};
+
+    bool run_one(size_t self);
+    static size_t &current();
+};
+
+/**
+ * 并行遍历目录树
+ * 访问函数处理一个目录, 返回这个目录自身的结果, 并按顺序给出需要继续遍历的子目录;
+ * 每个子树的结果按先序合并到父目录的结果上, 与单线程递归的顺序一致
+ */
+template <typename Result> struct TreeWalk {
+    using Visit = std::function<Result(uint32_t dir_id, std::vector<uint32_t> &children)>;
+    using Merge = std::function<void(Result &into, Result &from)>;
+
+    /**
+     * 一个目录的结果和它的子目录
+     */
+    struct Node {
+        uint32_t inode_id = 0;
+        Result result{};
+        std::vector<std::unique_ptr<Node>> children;
+    };
+
+    Visit visit;
+    Merge merge;
+
+    TreeWalk(Visit _visit, Merge _merge) : visit(std::move(_visit)), merge(std::move(_merge)) {}
+
+    /**
+     * @brief 从一个目录开始遍历
+     * @param root 起始目录的inode编号
+     * @return 整棵树合并后的结果
+     */
+    Result run(uint32_t root) {
+        Node top;
+        top.inode_id = root;
+        {
+            WorkPool pool;
+            expand(pool, top);
+            pool.wait();
+        }
+        return collect(top);
+    }
+
+  private:
+    /**
+     * @brief 访问一个目录, 子目录交给线程池, 排队的任务太多时在当前线程继续深入
+     */
+    void expand(WorkPool &pool, Node &node) {
+        std::vector<uint32_t> children;
+        node.result = visit(node.inode_id, children);
+        for (uint32_t child_id : children) {
+            node.children.emplace_back(new Node());
+            node.children.back()->inode_id = child_id;
+        }
+        for (auto &child : node.children) {
+            Node *target = child.get();
+            if (!pool.spawn([this, &pool, target] { expand(pool, *target); })) {
+                expand(pool, *target);
+            }
+        }
+    }
+
+    /**
+     * @brief 按先序合并各个子树的结果
+     */
+    Result collect(Node &node) {
+        Result result = std::move(node.result);
+        for (auto &child : node.children) {
+            Result part = collect(*child);
+            merge(result, part);
+        }
+        node.children.clear();
+        return result;
+    }
+};
+
+/**
+ * find的查找条件
+ */
+struct FindQuery {
+    std::string pattern;            // 名字的通配符, *匹配任意个字符, ?匹配一个字符, 为空时不限制
+    int type = -1;                  // DIR_TYPE或FILE_TYPE, -1表示不限制
+    uint64_t min_size = 0;          // 文件大小的下限（字节）
+    uint64_t max_size = UINT64_MAX; // 文件大小的上限（字节）
+    uint32_t min_mtime = 0;         // 修改时间的下限
+    uint32_t max_mtime = UINT32_MAX; // 修改时间的上限
+
+    /**
+     * @brief 是否需要读取inode才能判断
+     */
+    bool needs_inode() const { return min_size != 0 || max_size != UINT64_MAX || min_mtime != 0 || max_mtime != UINT32_MAX; }
+
+    bool matches(const std::string &name, uint8_t entry_type, const Inode *inode) const;
+};
+
+/**
+ * 全卷的文件名索引
+ * 按名字排序, 记录每个名字对应的inode和所在目录, 有固定前缀的通配符只需查找一段。
+ * 第一次按名字查找时遍历目录树建立, 之后随创建和删除更新; 只保存在内存中, 重启后重新建立。
+ * 删除的目录中的项在后台回收到之前仍留在索引中, 查找时沿所在目录向上检查后过滤
+ */
+struct NameIndex {
+    /**
+     * 索引项
+     */
+    struct Entry {
+        uint32_t inode_id;  // 文件或目录的inode
+        uint32_t parent_id; // 所在目录
+        uint32_t ctime;     // inode的创建时间, 用于发现inode已被回收复用
+    };
+
+    std::map<std::string, std::vector<Entry>> names;
+    bool built = false; // 是否已经建立
+
+    void build();
+    void clear();
+    void add(const std::string &name, const Inode &inode, uint32_t parent_id);
+    void remove(const std::string &name, uint32_t inode_id);
+    std::vector<std::pair<std::string, Entry>> lookup(const std::string &pattern) const;
+};
+
+/**
+ * 一个文件中查找子串的结果
+ */
+struct GrepResult {
+    uint64_t count = 0;             // 匹配的行数
+    std::vector<std::string> lines; // 前GREP_MAX_LINES个匹配的行号和内容
+};
+
+/**
+ * 启动以来压缩和解压的字节数和耗时, 并行的grep也会解压, 所以都是原子的
+ */
+struct CompressStats {
+    std::atomic<uint64_t> packed_in{0};     // 压缩前的字节数
+    std::atomic<uint64_t> packed_out{0};    // 压缩后的字节数
+    std::atomic<uint64_t> pack_ns{0};       // 压缩耗时
+    std::atomic<uint64_t> unpacked{0};      // 解压得到的字节数
+    std::atomic<uint64_t> unpack_ns{0};     // 解压耗时
+};
+
+struct User {
+    std::string username;
+    uint32_t uid;
+    uint32_t gid;
+
+    User() {}
+    User(std::string _username, uint32_t _uid, uint32_t _gid) {
+        username = _username;
+        uid = _uid;
+        gid = _gid;
+    }
+    void set(std::string _username, uint32_t _uid, uint32_t _gid) {
+        username = _username;
+        uid = _uid;
+        gid = _gid;
+    }
+};
+
+//------------------------------------------------------------------------------------------------
+// 函数定义
+//------------------------------------------------------------------------------------------------
+
+/**
+ * @brief 将时间戳转为字符串
+ * @param time 时间戳
+ * @return 当前时区的时间字符串
+ */
+std::string format_time(uint32_t raw_time) {
+    time_t time = static_cast<time_t>(raw_time);
+    // 并行遍历目录树时多个线程同时格式化, 使用可重入的版本
+    struct tm local_tm;
+#ifdef _WIN32
+    localtime_s(&local_tm, &time);
+#else
+    localtime_r(&time, &local_tm);
+#endif
+    char local_buffer[80];
+    strftime(local_buffer, 80, "%Y-%m-%d %H:%M:%S", &local_tm);
+    return std::string(local_buffer);
+}
+
+/**
+ * @brief 将文件的用户态缓冲与系统缓存落盘
+ * @param fp 文件指针
+ * @return 是否成功
+ */
+bool sync_file(std::FILE *fp) {
+    if (std::fflush(fp) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+/**
+ * @brief 移动文件指针到指定偏移
+ * @param fp 文件指针
+ * @param offset 相对文件开头的偏移
+ * @return 是否成功
+ */
+bool seek_file(std::FILE *fp, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(fp, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+    return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+/**
+ * @brief 创建指定大小的稀疏文件
+ * 已存在的文件会被截断, 未写入的区域读出全为0且不占用宿主机磁盘空间,
+ * 宿主文件系统不支持稀疏文件时退化为普通的扩展文件
+ * @param path 文件路径
+ * @param size 文件大小（字节）
+ * @return 是否创建成功
+ */
+bool create_sparse_file(const std::string &path, uint64_t size) {
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    DWORD returned = 0;
+    DeviceIoControl(h, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+    LARGE_INTEGER end;
+    end.QuadPart = static_cast<LONGLONG>(size);
+    bool ok = SetFilePointerEx(h, end, NULL, FILE_BEGIN) && SetEndOfFile(h);
+    CloseHandle(h);
+    return ok;
+#else
+    std::FILE *fp = std::fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+        return false;
+    }
+    bool ok = ftruncate(fileno(fp), static_cast<off_t>(size)) == 0;
+    std::fclose(fp);
+    return ok;
+#endif
+}
+
+/**
+ * @brief 检查格式化参数是否合法
+ * @param fs_size 镜像大小（字节）
+ * @param block_size 块大小（字节）
+ * @param inode_count inode 总数
+ * @return 错误信息, 合法时为空
+ */
+std::string Geometry::check(uint64_t fs_size, uint32_t block_size, uint32_t inode_count) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        return "块大小必须是" + std::to_string(MIN_BLOCK_SIZE) + "到" + std::to_string(MAX_BLOCK_SIZE) + "之间的2的幂";
+    }
+    if (inode_count == 0 || inode_count > MAX_INODE_COUNT) {
+        return "inode数必须在1到" + std::to_string(MAX_INODE_COUNT) + "之间";
+    }
+    if (fs_size / block_size > MAX_BLOCK_COUNT) {
+        return "镜像最多" + std::to_string(MAX_BLOCK_COUNT) + "个块";
+    }
+    Geometry g = layout(fs_size, block_size, inode_count);
+    // 元数据区之后至少要放下日志区和根目录等初始文件
+    if (static_cast<uint64_t>(g.data_block_start) + JOURNAL_BLOCKS + 64 > g.block_count) {
+        return "镜像太小，放不下元数据区和日志区";
+    }
+    return "";
+}
+
+/**
+ * @brief 根据格式化参数计算布局
+ * 超级块之后依次是数据块位图、inode位图、inode列表，其后都是数据块; 每个inode占INODE_SLOT_SIZE字节, 留出内联数据区
+ * @param fs_size 镜像大小（字节）
+ * @param block_size 块大小（字节）
+ * @param inode_count inode 总数
+ * @return 计算得到的几何参数
+ */
+Geometry Geometry::layout(uint64_t fs_size, uint32_t block_size, uint32_t inode_count) {
+    auto blocks_for = [block_size](uint64_t bytes) {
+        return static_cast<uint32_t>((bytes + block_size - 1) / block_size);
+    };
+    Geometry g;
+    g.block_size = block_size;
+    g.block_count = static_cast<uint32_t>(fs_size / block_size);
+    g.inode_count = inode_count;
+    g.block_bitmap_start = 1;
+    g.inode_bitmap_start = g.block_bitmap_start + blocks_for((static_cast<uint64_t>(g.block_count) + 7) / 8);
+    g.inode_list_start = g.inode_bitmap_start + blocks_for((inode_count + 7) / 8);
+    g.inode_size = INODE_SLOT_SIZE;
+    g.data_block_start = g.inode_list_start + blocks_for(static_cast<uint64_t>(inode_count) * g.inode_size);
+    return g;
+}
+
+/**
+ * @brief 从超级块读出几何参数
+ * @param sb 超级块
+ */
+void Geometry::load(const SuperBlock &sb) {
+    block_size = sb.block_size;
+    block_count = sb.block_count;
+    inode_count = sb.inode_count;
+    block_bitmap_start = sb.block_bitmap_start;
+    inode_bitmap_start = sb.inode_bitmap_start;
+    inode_list_start = sb.inode_list_start;
+    data_block_start = sb.data_block_start;
+    version = sb.version;
+    inode_size = sb.inode_size == 0 ? INODE_SIZE : sb.inode_size;
+}
+
+/**
+ * @brief 从文件中读取inode位图和inode分配树
+ * @param root 分配树的根索引块, 0表示没有
+ */
+void InodeBitmap::load_bitmap(uint32_t root) {
+    bitmap.resize(geometry.inode_count);
+    journal.read(geometry.offset(geometry.inode_bitmap_start), bitmap.bytes.data(), bitmap.bytes.size());
+    tree_root = root;
+    leaves.clear();
+    chunks.clear();
+    chunk_maps.clear();
+    chunk_hint = 0;
+    if (tree_root == 0) {
+        return;
+    }
+    // inode块按顺序挂在分配树上, 遇到第一个空项就结束
+    IndexBlock root_ib = IndexBlock::read_index_block(tree_root);
+    for (uint32_t i = 0; i < geometry.index_entries() && root_ib.index[i] != UINT32_MAX; i++) {
+        leaves.push_back(root_ib.index[i]);
+        IndexBlock leaf_ib = IndexBlock::read_index_block(root_ib.index[i]);
+        for (uint32_t j = 0; j < geometry.index_entries() && leaf_ib.index[j] != UINT32_MAX; j++) {
+            chunks.push_back(leaf_ib.index[j]);
+            chunk_maps.emplace_back();
+            chunk_maps.back().resize(geometry.chunk_inodes());
+            journal.read(geometry.offset(leaf_ib.index[j]), chunk_maps.back().bytes.data(), geometry.chunk_header());
+        }
+    }
+}
+
+/**
+ * @brief 获取一个空闲inode
+ * 先从inode表中找，inode表用完后从inode块中找，都没有空闲时再分配一个新的inode块
+ * @return inode编号, 失败时返回UINT32_MAX
+ */
+uint32_t InodeBitmap::get_free_inode(uint32_t group) {
+    // 从块组在inode表中的那一段开始找, 到末尾后绕回开头
+    uint32_t first = static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(group) * geometry.group_inodes(), geometry.inode_count - 1));
+    for (uint32_t n = 0; n < geometry.inode_count; n++) {
+        uint32_t i = (first + n) % geometry.inode_count;
+        if (!bitmap.test(i)) {
+            bitmap.set(i);
+            save_bitmap_block(i);
+            return i;
+        }
+    }
+    uint32_t per_chunk = geometry.chunk_inodes();
+    for (uint32_t c = chunk_hint; c <= chunks.size(); c++) {
+        if (c == chunks.size() && add_chunk(group) == UINT32_MAX) {
+            break;
+        }
+        for (uint32_t k = 0; k < per_chunk; k++) {
+            if (!chunk_maps[c].test(k)) {
+                chunk_maps[c].set(k);
+                chunk_hint = c;
+                uint32_t inode_id = geometry.inode_count + c * per_chunk + k;
+                save_bitmap_block(inode_id);
+                return inode_id;
+            }
+        }
+    }
+    return static_cast<uint32_t>(-1);
+}
+
+/**
+ * @brief 为新目录选择块组
+ * 新目录分散到各个块组: 在空闲inode不少于平均数的块组中选空闲块最多的
+ * @return 块组号
+ */
+uint32_t InodeBitmap::dir_group() const {
+    uint32_t groups = geometry.group_count();
+    std::vector<uint32_t> free_inodes(groups, 0);
+    for (uint32_t i = 0; i < geometry.inode_count; i++) {
+        if (!bitmap.test(i)) {
+            free_inodes[group_of(i)]++;
+        }
+    }
+    uint64_t total = 0;
+    for (uint32_t free : free_inodes) {
+        total += free;
+    }
+    uint32_t best = 0;
+    for (uint32_t g = 1; g < groups; g++) {
+        if (static_cast<uint64_t>(free_inodes[g]) * groups >= total &&
+            (static_cast<uint64_t>(free_inodes[best]) * groups < total || block_bitmap.group_free[g] > block_bitmap.group_free[best])) {
+            best = g;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief 从数据块中分配一个新的inode块并挂到分配树上
+ * @param group 希望inode块所在的块组
+ * @return 新inode块的序号, 失败时返回UINT32_MAX
+ */
+uint32_t InodeBitmap::add_chunk(uint32_t group) {
+    uint32_t entries = geometry.index_entries();
+    uint32_t c = static_cast<uint32_t>(chunks.size());
+    uint64_t last_id = geometry.inode_count + static_cast<uint64_t>(c + 1) * geometry.chunk_inodes();
+    if (tree_root == 0 || c >= static_cast<uint64_t>(entries) * entries || last_id >= UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    if (c % entries == 0) {
+        uint32_t leaf = block_bitmap.get_free_block(geometry.group_start(group));
+        if (leaf == UINT32_MAX) {
+            return UINT32_MAX;
+        }
+        IndexBlock leaf_ib;
+        leaf_ib.block_id = leaf;
+        leaf_ib.next_index = UINT32_MAX;
+        leaf_ib.save_index_block();
+        IndexBlock root_ib = IndexBlock::read_index_block(tree_root);
+        root_ib.index[c / entries] = leaf;
+        root_ib.save_index_block();
+        leaves.push_back(leaf);
+    }
+    uint32_t chunk = block_bitmap.get_free_block(geometry.group_start(group));
+    if (chunk == UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    // inode块是元数据, 整块清零后走日志
+    std::vector<char> zero(geometry.block_size, 0);
+    journal.write(geometry.offset(chunk), zero.data(), zero.size());
+    IndexBlock leaf_ib = IndexBlock::read_index_block(leaves[c / entries]);
+    leaf_ib.index[c % entries] = chunk;
+    leaf_ib.save_index_block();
+    chunks.push_back(chunk);
+    chunk_maps.emplace_back();
+    chunk_maps.back().resize(geometry.chunk_inodes());
+    return c;
+}
+
+/**
+ * @brief 提交当前事务
+ * 最外层事务提交后，其脏块并入待提交组，等待flush统一写日志
+ */
+void Journal::commit() {
+    if (depth == 0 || --depth > 0 || running.empty()) {
+        return;
+    }
+    // 待提交组放不下当前事务时，先把组提交掉
+    if (committed.size() + running.size() > capacity) {
+        flush();
+    }
+    for (auto &block : running) {
+        committed[block.first] = std::move(block.second);
+    }
+    running.clear();
+    // 超过日志区容量的事务单独成组, 立即写成链式记录
+    if (committed.size() > capacity) {
+        flush();
+    }
+}
+
+/**
+ * @brief 组提交
+ * 将待提交组的所有脏块一次顺序写入日志区并fsync，然后写回原位置并清空日志头
+ */
+void Journal::flush() {
+    if (committed.empty()) {
+        return;
+    }
+    std::FILE *fp = std::fopen(disk_path.c_str(), "rb+");
+    if (fp == nullptr) {
+        std::cerr << "Error opening file for writing: " << disk_path << std::endl;
+        return;
+    }
+    // 上一组的写回落盘之后才能覆盖日志区
+    if (checkpoint_unsynced) {
+        sync_file(fp);
+        checkpointed.clear();
+        checkpoint_unsynced = false;
+    }
+    // 一组不超过一条记录的容量, 只有过大的单个事务才写成链式记录
+    if (committed.size() > capacity) {
+        write_chain(fp);
+        std::fclose(fp);
+        // 链式记录写回后已经落盘, 临时区域随之截掉
+        std::error_code error;
+        std::filesystem::resize_file(disk_path, geometry.offset(geometry.block_count), error);
+        committed.clear();
+        return;
+    }
+    write_record(fp, committed.begin(), static_cast<uint32_t>(committed.size()));
+    std::fflush(fp);
+    std::fclose(fp);
+    for (auto &block : committed) {
+        checkpointed.insert(block.first);
+    }
+    checkpoint_unsynced = true;
+    committed.clear();
+}
+
+/**
+ * @brief 写一条日志记录并写回原位置
+ * @param fp 已打开的磁盘文件
+ * @param first 第一个要记录的块
+ * @param count 记录的块数
+ */
+void Journal::write_record(std::FILE *fp, std::map<uint32_t, std::vector<char>>::iterator first, uint32_t count) {
+    // 日志头和记录块拼成一段连续的缓冲区，一次写入
+    std::vector<char> record(static_cast<size_t>(count + 1) * geometry.block_size, 0);
+    Header header = {};
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = ++sequence;
+    header.count = count;
+    auto it = first;
+    for (uint32_t i = 0; i < count; ++i, ++it) {
+        header.blocks[i] = it->first;
+        memcpy(record.data() + static_cast<size_t>(i + 1) * geometry.block_size, it->second.data(), geometry.block_size);
+    }
+    header.checksum = checksum(header, record);
+    memcpy(record.data(), &header, sizeof(Header));
+    seek_file(fp, geometry.offset(start));
+    std::fwrite(record.data(), 1, record.size(), fp);
+    sync_file(fp);
+    // 记录已经持久化，写回原位置
+    it = first;
+    for (uint32_t i = 0; i < count; ++i, ++it) {
+        seek_file(fp, geometry.offset(it->first));
+        std::fwrite(it->second.data(), 1, geometry.block_size, fp);
+    }
+    // 清空日志头，表示记录已写回
+    header.count = 0;
+    seek_file(fp, geometry.offset(start));
+    std::fwrite(&header, 1, sizeof(Header), fp);
+}
+
+/**
+ * @brief 把超过日志区容量的事务写成一条链式记录并写回原位置
+ * 所有块号和块内容先写入文件系统末尾之后的临时区域并落盘, 再写指向它的日志头, 日志头落盘即提交;
+ * 写回原位置并落盘后才清空日志头, 之前崩溃时重放整条记录
+ * @param fp 已打开的磁盘文件
+ */
+void Journal::write_chain(std::FILE *fp) {
+    uint32_t count = static_cast<uint32_t>(committed.size());
+    uint32_t index_blocks = static_cast<uint32_t>((static_cast<uint64_t>(count) * sizeof(uint32_t) + geometry.block_size - 1) / geometry.block_size);
+    // 临时区域: 先是count个块号, 补齐到整块, 其后是count个块的内容
+    std::vector<char> area(geometry.offset(index_blocks + count), 0);
+    uint32_t i = 0;
+    for (auto &block : committed) {
+        memcpy(area.data() + static_cast<size_t>(i) * sizeof(uint32_t), &block.first, sizeof(uint32_t));
+        memcpy(area.data() + geometry.offset(index_blocks + i), block.second.data(), geometry.block_size);
+        i++;
+    }
+    Header header = {};
+    header.magic = JOURNAL_CHAIN_MAGIC;
+    header.sequence = ++sequence;
+    header.count = count;
+    header.blocks[0] = geometry.block_count;
+    header.checksum = chain_checksum(header, area);
+    seek_file(fp, geometry.offset(header.blocks[0]));
+    std::fwrite(area.data(), 1, area.size(), fp);
+    sync_file(fp);
+    seek_file(fp, geometry.offset(start));
+    std::fwrite(&header, 1, sizeof(Header), fp);
+    sync_file(fp);
+    for (auto &block : committed) {
+        seek_file(fp, geometry.offset(block.first));
+        std::fwrite(block.second.data(), 1, geometry.block_size, fp);
+    }
+    sync_file(fp);
+    header.count = 0;
+    seek_file(fp, geometry.offset(start));
+    std::fwrite(&header, 1, sizeof(Header), fp);
+    sync_file(fp);
+}
+
+/**
+ * @brief 计算日志记录的校验和（FNV-1a）
+ * @param header 日志头，checksum字段不参与计算
+ * @param record 日志头之后的记录块
+ * @return 校验和
+ */
+uint32_t Journal::checksum(const Header &header, const std::vector<char> &record) {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const char *data, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            hash ^= static_cast<uint8_t>(data[i]);
+            hash *= 16777619u;
+        }
+    };
+    mix(reinterpret_cast<const char *>(&header.sequence), sizeof(header.sequence));
+    mix(reinterpret_cast<const char *>(&header.count), sizeof(header.count));
+    mix(reinterpret_cast<const char *>(header.blocks), header.count * sizeof(uint32_t));
+    mix(record.data() + geometry.block_size, static_cast<size_t>(header.count) * geometry.block_size);
+    return hash;
+}
+
+/**
+ * @brief 计算链式记录的校验和（FNV-1a）
+ * @param header 日志头，checksum字段不参与计算
+ * @param area 临时区域的全部内容
+ * @return 校验和
+ */
+uint32_t Journal::chain_checksum(const Header &header, const std::vector<char> &area) {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const char *data, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            hash ^= static_cast<uint8_t>(data[i]);
+            hash *= 16777619u;
+        }
+    };
+    mix(reinterpret_cast<const char *>(&header.sequence), sizeof(header.sequence));
+    mix(reinterpret_cast<const char *>(&header.count), sizeof(header.count));
+    mix(reinterpret_cast<const char *>(&header.blocks[0]), sizeof(header.blocks[0]));
+    mix(area.data(), area.size());
+    return hash;
+}
+
+/**
+ * @brief 挂载时定位日志区并重放未写回的记录
+ * 旧磁盘没有日志区时，从空闲块中划出一段连续区域作为日志区
+ */
+void Journal::mount() {
+    SuperBlock sb = SuperBlock::read_super_block();
+    if (sb.journal_blocks == 0) {
+        block_bitmap.load_bitmap();
+        uint32_t first = block_bitmap.get_free_run(JOURNAL_BLOCKS);
+        if (first == UINT32_MAX) {
+            std::cerr << __ERROR << "没有足够的连续空间创建日志区，日志未启用" << __NORMAL << std::endl;
+            return;
+        }
+        Header header = {};
+        write_data(geometry.offset(first), &header, sizeof(Header));
+        sb.journal_start = first;
+        sb.journal_blocks = JOURNAL_BLOCKS;
+        sb.save_super_block();
+    }
+    format(sb.journal_start, sb.journal_blocks);
+    replay();
+}
+
+/**
+ * @brief 设置日志区位置并丢弃所有缓存的脏块
+ * @param journal_start 日志区起始块号, 0表示关闭日志
+ * @param journal_blocks 日志区块数
+ */
+void Journal::format(uint32_t journal_start, uint32_t journal_blocks) {
+    running.clear();
+    committed.clear();
+    checkpointed.clear();
+    checkpoint_unsynced = false;
+    start = journal_start;
+    capacity = journal_start == 0 ? 0 : std::min<uint32_t>(journal_blocks - 1, JOURNAL_HEADER_SLOTS);
+}
+
+/**
+ * @brief 重放日志区中校验通过的记录
+ */
+void Journal::replay() {
+    Header header;
+    std::vector<char> record;
+    std::ifstream file(disk_path, std::ios::binary | std::ios::in);
+    file.seekg(geometry.offset(start));
+    file.read(reinterpret_cast<char *>(&header), sizeof(Header));
+    if (header.magic == JOURNAL_CHAIN_MAGIC) {
+        file.close();
+        replay_chain(header);
+        return;
+    }
+    if (header.magic != JOURNAL_MAGIC) {
+        return;
+    }
+    sequence = header.sequence;
+    if (header.count == 0 || header.count > capacity) {
+        return;
+    }
+    record.resize(static_cast<size_t>(header.count + 1) * geometry.block_size);
+    file.seekg(geometry.offset(start));
+    file.read(record.data(), record.size());
+    file.close();
+
+    std::FILE *fp = std::fopen(disk_path.c_str(), "rb+");
+    if (fp == nullptr) {
+        return;
+    }
+    // 校验失败说明崩溃发生在写日志的过程中，记录对应的事务视为未提交
+    if (checksum(header, record) == header.checksum) {
+        for (uint32_t i = 0; i < header.count; ++i) {
+            seek_file(fp, geometry.offset(header.blocks[i]));
+            std::fwrite(record.data() + static_cast<size_t>(i + 1) * geometry.block_size, 1, geometry.block_size, fp);
+        }
+        sync_file(fp);
+        std::cout << "日志重放完成, 恢复了" << header.count << "个元数据块" << std::endl;
+    }
+    header.count = 0;
+    seek_file(fp, geometry.offset(start));
+    std::fwrite(&header, 1, sizeof(Header), fp);
+    sync_file(fp);
+    std::fclose(fp);
+}
+
+/**
+ * @brief 重放链式记录
+ * 临时区域不完整或校验失败时整条记录都不重放, 事务视为未提交
+ * @param header 日志头
+ */
+void Journal::replay_chain(const Header &header) {
+    sequence = header.sequence;
+    if (header.count > 0) {
+        uint32_t index_blocks = static_cast<uint32_t>((static_cast<uint64_t>(header.count) * sizeof(uint32_t) + geometry.block_size - 1) / geometry.block_size);
+        std::vector<char> area(geometry.offset(index_blocks + header.count), 0);
+        std::ifstream file(disk_path, std::ios::binary | std::ios::in);
+        file.seekg(geometry.offset(header.blocks[0]));
+        file.read(area.data(), area.size());
+        bool complete = file.gcount() == static_cast<std::streamsize>(area.size());
         file.close();
+        if (complete && chain_checksum(header, area) == header.checksum) {
+            std::FILE *fp = std::fopen(disk_path.c_str(), "rb+");
+            if (fp == nullptr) {
+                return;
+            }
+            for (uint32_t i = 0; i < header.count; ++i) {
+                uint32_t block_id;
+                memcpy(&block_id, area.data() + static_cast<size_t>(i) * sizeof(uint32_t), sizeof(uint32_t));
+                seek_file(fp, geometry.offset(block_id));
+                std::fwrite(area.data() + geometry.offset(index_blocks + i), 1, geometry.block_size, fp);
+            }
+            sync_file(fp);
+            std::fclose(fp);
+            std::cout << "日志重放完成, 恢复了" << header.count << "个元数据块" << std::endl;
+        }
+    }
+    Header cleared = header;
+    cleared.count = 0;
+    std::FILE *fp = std::fopen(disk_path.c_str(), "rb+");
+    if (fp == nullptr) {
+        return;
+    }
+    seek_file(fp, geometry.offset(start));
+    std::fwrite(&cleared, 1, sizeof(Header), fp);
+    sync_file(fp);
+    std::fclose(fp);
+    std::error_code error;
+    std::filesystem::resize_file(disk_path, geometry.offset(header.blocks[0]), error);
+}
+
+/**
+ * @brief 读取磁盘内容
+ * 挂载了快照时，按快照的映射读取快照时刻的内容
+ * @param offset 相对磁盘开头的字节偏移
+ * @param buf 输出缓冲区
+ * @param len 读取的字节数
+ */
+void Journal::read(uint64_t offset, void *buf, size_t len) {
+    if (snapshot_table.view < 0 || len == 0) {
+        read_live(offset, buf, len);
+        return;
+    }
+    char *out = static_cast<char *>(buf);
+    uint64_t end = offset + len;
+    while (offset < end) {
+        uint32_t block_id = static_cast<uint32_t>(offset / geometry.block_size);
+        uint64_t in_block = offset % geometry.block_size;
+        size_t part = static_cast<size_t>(std::min<uint64_t>(geometry.block_size - in_block, end - offset));
+        read_live(geometry.offset(snapshot_table.translate(block_id)) + in_block, out, part);
+        out += part;
+        offset += part;
+    }
+}
+
+/**
+ * @brief 直接读取磁盘上的内容，不考虑缓存的脏块
+ * @param offset 相对磁盘开头的字节偏移
+ * @param buf 输出缓冲区
+ * @param len 读取的字节数
+ */
+void Journal::read_disk(uint64_t offset, void *buf, size_t len) {
+    std::ifstream file(disk_path, std::ios::binary | std::ios::in);
+    file.seekg(offset);
+    file.read(static_cast<char *>(buf), len);
+    file.close();
+}
+
+/**
+ * @brief 读取实时文件系统的内容，未写回的脏块以缓存中的内容为准
+ * @param offset 相对磁盘开头的字节偏移
+ * @param buf 输出缓冲区
+ * @param len 读取的字节数
+ */
+void Journal::read_live(uint64_t offset, void *buf, size_t len) {
+    char *out = static_cast<char *>(buf);
+    read_disk(offset, out, len);
+    if (len == 0 || (running.empty() && committed.empty())) {
+        return;
+    }
+    uint32_t first = static_cast<uint32_t>(offset / geometry.block_size);
+    uint32_t last = static_cast<uint32_t>((offset + len - 1) / geometry.block_size);
+    // 先叠加已提交的块，再叠加当前事务的块
+    for (auto *pending : {&committed, &running}) {
+        for (auto it = pending->lower_bound(first); it != pending->end() && it->first <= last; ++it) {
+            uint64_t block_begin = geometry.offset(it->first);
+            uint64_t begin = std::max(block_begin, offset);
+            uint64_t end = std::min<uint64_t>(block_begin + geometry.block_size, offset + len);
+            memcpy(out + (begin - offset), it->second.data() + (begin - block_begin), end - begin);
+        }
+    }
+}
+
+/**
+ * @brief 写元数据
+ * 在事务中时只修改缓存的块，提交后由组提交写入磁盘；不在事务中时直接写入磁盘
+ * @param offset 相对磁盘开头的字节偏移
+ * @param buf 要写入的内容
+ * @param len 写入的字节数
+ */
+void Journal::write(uint64_t offset, const void *buf, size_t len) {
+    if (depth == 0 || start == 0) {
+        write_data(offset, buf, len);
+        return;
+    }
+    const char *in = static_cast<const char *>(buf);
+    uint32_t first = static_cast<uint32_t>(offset / geometry.block_size);
+    uint32_t last = static_cast<uint32_t>((offset + len - 1) / geometry.block_size);
+    for (uint32_t block_id = first; block_id <= last; ++block_id) {
+        uint64_t block_begin = geometry.offset(block_id);
+        auto it = running.find(block_id);
+        if (it == running.end()) {
+            // 第一次改动这个块，快照需要时先保存旧内容
+            snapshot_table.preserve(block_id);
+            std::vector<char> image(geometry.block_size);
+            read_live(block_begin, image.data(), geometry.block_size);
+            it = running.emplace(block_id, std::move(image)).first;
+        }
+        uint64_t begin = std::max(block_begin, offset);
+        uint64_t end = std::min<uint64_t>(block_begin + geometry.block_size, offset + len);
+        memcpy(it->second.data() + (begin - block_begin), in + (begin - offset), end - begin);
+    }
+    // 加上当前事务放不下时先把之前的组提交掉; 当前事务本身超过日志容量时仍留在内存中, 提交时整体写成链式记录
+    if (running.size() + committed.size() > capacity) {
+        flush();
+    }
+}
+
+/**
+ * @brief 直接写入磁盘，不记日志，用于普通文件的数据块
+ * @param offset 相对磁盘开头的字节偏移
+ * @param buf 要写入的内容
+ * @param len 写入的字节数
+ */
+void Journal::write_data(uint64_t offset, const void *buf, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    uint32_t first = static_cast<uint32_t>(offset / geometry.block_size);
+    uint32_t last = static_cast<uint32_t>((offset + len - 1) / geometry.block_size);
+    // 需要为快照保存旧内容的块，以及已经在缓存中的块，和元数据一样走日志,
+    // 保证原位置的改写不会早于快照映射落盘
+    if (depth > 0 && start != 0) {
+        bool logged = false;
+        for (uint32_t block_id = first; block_id <= last; ++block_id) {
+            bool preserved = snapshot_table.preserve(block_id);
+            logged = logged || preserved || running.count(block_id) || committed.count(block_id);
+        }
+        if (logged) {
+            write(offset, buf, len);
+            return;
+        }
+    } else {
+        for (uint32_t block_id = first; block_id <= last; ++block_id) {
+            snapshot_table.preserve(block_id);
+        }
+    }
+    // 刚写回的元数据块被复用为数据块时，先让写回落盘，避免崩溃后重放旧记录覆盖新数据
+    if (checkpoint_unsynced) {
+        auto it = checkpointed.lower_bound(first);
+        if (it != checkpointed.end() && *it <= last) {
+            sync_checkpoint();
+        }
+    }
+    std::ofstream file(disk_path, std::ios::binary | std::ios::out | std::ios::in);
+    file.seekp(offset);
+    file.write(static_cast<const char *>(buf), len);
+    file.close();
+    // 缓存中同一块的内容也要更新，否则写回时会覆盖这次写入
+    for (auto *pending : {&committed, &running}) {
+        for (auto it = pending->lower_bound(first); it != pending->end() && it->first <= last; ++it) {
+            uint64_t block_begin = geometry.offset(it->first);
+            uint64_t begin = std::max(block_begin, offset);
+            uint64_t end = std::min<uint64_t>(block_begin + geometry.block_size, offset + len);
+            memcpy(it->second.data() + (begin - block_begin), static_cast<const char *>(buf) + (begin - offset), end - begin);
+        }
+    }
+}
+
+/**
+ * @brief 让上一次写回的内容落盘
+ */
+void Journal::sync_checkpoint() {
+    std::FILE *fp = std::fopen(disk_path.c_str(), "rb+");
+    if (fp != nullptr) {
+        sync_file(fp);
+        std::fclose(fp);
+    }
+    checkpointed.clear();
+    checkpoint_unsynced = false;
+}
+
+/**
+ * @brief 磁盘上inode的格式版本
+ * 读快照时按快照时刻的版本, 否则按挂载的文件系统的版本
+ */
+uint32_t Inode::format() {
+    return snapshot_table.view >= 0 ? SuperBlock::read_super_block().version : geometry.version;
+}
+
+/**
+ * @brief 从文件中读取目录块
+ * 挂载的快照早于磁盘升级时，快照中的目录块还是旧格式，按旧格式读取
+ * @param block_id 目录块号
+ * @return 读取到的目录块
+ */
+DirBlock DirBlock::read_dir_block(uint32_t block_id) {
+    if (snapshot_table.view >= 0 && SuperBlock::read_super_block().version < FS_VERSION_INODE32) {
+        return read_legacy_dir_block(block_id);
+    }
+    DirBlock db;
+    journal.read(geometry.offset(block_id), db.entries.data(), db.entries.size() * sizeof(DirEntry));
+    return db;
+}
+
+/**
+ * @brief 读取版本0的目录块并转换为当前格式
+ * 版本0的目录项为16位inode编号、16位类型和28字节的文件名，超过MAX_NAME_LEN的文件名被截断
+ * @param block_id 目录块号
+ * @return 转换后的目录块
+ */
+DirBlock DirBlock::read_legacy_dir_block(uint32_t block_id) {
+    struct LegacyDirEntry {
+        uint16_t inode_id;
+        uint16_t type;
+        char name[28];
+    };
+    std::vector<LegacyDirEntry> legacy(geometry.dir_entries());
+    journal.read(geometry.offset(block_id), legacy.data(), legacy.size() * sizeof(LegacyDirEntry));
+    DirBlock db;
+    for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
+        std::string name(legacy[j].name, strnlen(legacy[j].name, sizeof(legacy[j].name)));
+        uint32_t inode_id = legacy[j].type == UNDEFINE_TYPE ? UINT32_MAX : legacy[j].inode_id;
+        db.entries[j].set(inode_id, static_cast<uint8_t>(legacy[j].type), name.c_str());
+    }
+    return db;
+}
+
+/**
+ * @brief 构造块映射
+ * 默认按挂载的文件系统的版本解释根映射块，读快照时按快照时刻的版本
+ * @param root_id 根映射块
+ * @param format 映射格式对应的磁盘版本, 用于升级旧磁盘
+ */
+BlockMap::BlockMap(uint32_t root_id, uint32_t format) : root(root_id), version(format) {
+    if (version == UINT32_MAX) {
+        version = snapshot_table.view >= 0 ? SuperBlock::read_super_block().version : FS_VERSION;
+    }
+}
+
+/**
+ * @brief 把根映射块初始化为空的区段树, 用于新建的文件和目录
+ */
+void BlockMap::init() {
+    nodes[root] = ExtentNode{root, 0, {}};
+    dirty.insert(root);
+}
+
+/**
+ * @brief 读取旧格式的映射块, 同一个块只从磁盘读一次
+ * @param block_id 映射块号
+ * @return 缓存中的映射块
+ */
+IndexBlock &BlockMap::load(uint32_t block_id) {
+    auto it = cache.find(block_id);
+    if (it == cache.end()) {
+        it = cache.emplace(block_id, IndexBlock::read_index_block(block_id)).first;
+    }
+    return it->second;
+}
+
+/**
+ * @brief 读取区段树节点, 同一个块只从磁盘读一次
+ * @param block_id 节点的块号
+ * @return 缓存中的节点
+ */
+ExtentNode &BlockMap::node(uint32_t block_id) {
+    auto it = nodes.find(block_id);
+    if (it == nodes.end()) {
+        it = nodes.emplace(block_id, ExtentNode::read_extent_node(block_id)).first;
+    }
+    return it->second;
+}
+
+/**
+ * @brief 计算第n个逻辑块在多级索引各级映射块中的位置
+ * @param n 逻辑块号
+ * @param slots slots[0]是根映射块中的项, slots[1..depth]依次是各级间接块中的项
+ * @return 间接的级数depth, 超出映射范围时返回-1
+ */
+int BlockMap::path(uint32_t n, uint32_t slots[4]) const {
+    uint64_t entries = geometry.index_entries();
+    uint64_t rest = n;
+    if (rest < direct()) {
+        slots[0] = static_cast<uint32_t>(rest);
+        return 0;
+    }
+    rest -= direct();
+    uint64_t span = 1;
+    for (int depth = 1; depth <= 3; depth++) {
+        span *= entries; // 这一级间接块能映射的块数
+        if (rest < span) {
+            slots[0] = direct() + depth - 1;
+            for (int level = depth; level >= 1; level--) {
+                slots[level] = static_cast<uint32_t>(rest % entries);
+                rest /= entries;
+            }
+            return depth;
+        }
+        rest -= span;
+    }
+    return -1;
+}
+
+/**
+ * @brief 查找第n个逻辑块对应的数据块
+ * @param n 逻辑块号
+ * @return 数据块号, 没有映射时返回UINT32_MAX
+ */
+uint32_t BlockMap::lookup(uint32_t n) {
+    if (version < FS_VERSION_BLOCK_MAP) {
+        uint32_t block_id = root;
+        for (uint32_t skip = n / geometry.index_entries(); skip > 0 && block_id != UINT32_MAX; skip--) {
+            block_id = load(block_id).next_index;
+        }
+        return block_id == UINT32_MAX ? UINT32_MAX : load(block_id).index[n % geometry.index_entries()];
+    }
+    if (version < FS_VERSION_EXTENT) {
+        uint32_t slots[4];
+        int depth = path(n, slots);
+        if (depth < 0) {
+            return UINT32_MAX;
+        }
+        uint32_t block_id = root;
+        for (int level = 0; level <= depth && block_id != UINT32_MAX; level++) {
+            block_id = load(block_id).index[slots[level]];
+        }
+        return block_id;
+    }
+    for (uint32_t block_id = root;;) {
+        ExtentNode &cur = node(block_id);
+        // 最后一个起点不超过n的项
+        auto it = std::upper_bound(cur.entries.begin(), cur.entries.end(), n, [](uint32_t value, const Extent &extent) { return value < extent.logical; });
+        if (it == cur.entries.begin()) {
+            return UINT32_MAX;
+        }
+        --it;
+        if (cur.depth == 0) {
+            return n - it->logical < it->length ? it->start + (n - it->logical) : UINT32_MAX;
+        }
+        block_id = it->start;
+    }
+}
+
+/**
+ * @brief 已映射的块数
+ */
+uint32_t BlockMap::size() {
+    if (version < FS_VERSION_EXTENT) {
+        return static_cast<uint32_t>(blocks().size());
+    }
+    const ExtentNode &leaf = node(right_path().back());
+    return leaf.entries.empty() ? 0 : leaf.entries.back().logical + leaf.entries.back().length;
+}
+
+/**
+ * @brief 按逻辑顺序列出区段
+ * 旧格式的映射把连续的块合并为区段
+ * @param from 只列出包含或位于这个逻辑块之后的区段
+ * @param to 只列出起点位于这个逻辑块之前的区段
+ */
+std::vector<Extent> BlockMap::extents(uint32_t from, uint32_t to) {
+    std::vector<Extent> result;
+    if (version >= FS_VERSION_EXTENT) {
+        collect(root, from, to, result);
+        return result;
+    }
+    std::vector<uint32_t> all = blocks();
+    for (uint32_t n = from; n < all.size() && n < to; n++) {
+        if (!result.empty() && result.back().start + result.back().length == all[n]) {
+            result.back().length++;
+        } else {
+            result.push_back(Extent{n, all[n], 1});
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief 收集子树中的区段, 跳过完全位于[from, to)之外的子树
+ */
+void BlockMap::collect(uint32_t block_id, uint32_t from, uint32_t to, std::vector<Extent> &result) {
+    std::vector<Extent> entries = node(block_id).entries;
+    bool leaf = node(block_id).depth == 0;
+    for (size_t i = 0; i < entries.size() && entries[i].logical < to; i++) {
+        if (leaf) {
+            if (entries[i].logical + entries[i].length > from) {
+                result.push_back(entries[i]);
+            }
+        } else if (i + 1 == entries.size() || entries[i + 1].logical > from) {
+            collect(entries[i].start, from, to, result);
+        }
+    }
+}
+
+/**
+ * @brief 按逻辑顺序列出所有数据块
+ * 文件和目录的数据块都是从头连续分配的，旧格式遇到第一个空项即结束
+ */
+std::vector<uint32_t> BlockMap::blocks() {
+    std::vector<uint32_t> result;
+    if (version >= FS_VERSION_EXTENT) {
+        for (const Extent &extent : extents()) {
+            for (uint32_t i = 0; i < extent.length; i++) {
+                result.push_back(extent.start + i);
+            }
+        }
+        return result;
+    }
+    for (uint32_t n = 0;; n++) {
+        uint32_t block_id = lookup(n);
+        if (block_id == UINT32_MAX) {
+            break;
+        }
+        result.push_back(block_id);
+    }
+    return result;
+}
+
+/**
+ * @brief 旧格式中除根映射块之外的映射块, 升级时释放
+ */
+std::vector<uint32_t> BlockMap::legacy_blocks() {
+    std::vector<uint32_t> result;
+    if (version < FS_VERSION_BLOCK_MAP) {
+        for (uint32_t block_id = load(root).next_index; block_id != UINT32_MAX; block_id = load(block_id).next_index) {
+            result.push_back(block_id);
+        }
+        return result;
+    }
+    std::vector<std::pair<uint32_t, int>> pending;
+    for (int height = 1; height <= 3; height++) {
+        uint32_t block_id = load(root).index[direct() + height - 1];
+        if (block_id != UINT32_MAX) {
+            pending.push_back({block_id, height});
+        }
+    }
+    while (!pending.empty()) {
+        auto [block_id, height] = pending.back();
+        pending.pop_back();
+        result.push_back(block_id);
+        if (height > 1) {
+            for (uint32_t child : load(block_id).index) {
+                if (child != UINT32_MAX) {
+                    pending.push_back({child, height - 1});
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief 从根到最右侧叶子的路径
+ */
+std::vector<uint32_t> BlockMap::right_path() {
+    std::vector<uint32_t> result = {root};
+    while (node(result.back()).depth > 0 && !node(result.back()).entries.empty()) {
+        result.push_back(node(result.back()).entries.back().start);
+    }
+    return result;
+}
+
+/**
+ * @brief 分配一个空的区段树节点
+ * @return 节点的块号, 空间不足时返回UINT32_MAX
+ */
+uint32_t BlockMap::new_node(uint16_t depth, Inode &inode) {
+    uint32_t block_id = block_bitmap.get_free_block(inode.i_indirect);
+    if (block_id != UINT32_MAX) {
+        inode.i_blocks++;
+        nodes[block_id] = ExtentNode{block_id, depth, {}};
+        dirty.insert(block_id);
+    }
+    return block_id;
+}
+
+/**
+ * @brief 在区段树最右侧追加一个区段
+ * 叶子已满时新开叶子，并逐层向上挂接；整条路径都满时先让根节点下移一层
+ * @return 是否追加成功
+ */
+bool BlockMap::append(const Extent &extent, Inode &inode) {
+    std::vector<uint32_t> path = right_path();
+    bool full = true;
+    for (uint32_t block_id : path) {
+        full = full && node(block_id).entries.size() >= ExtentNode::capacity();
+    }
+    if (full) {
+        ExtentNode &root_node = node(root);
+        uint32_t block_id = new_node(root_node.depth, inode);
+        if (block_id == UINT32_MAX) {
+            return false;
+        }
+        node(block_id).entries = root_node.entries;
+        root_node.entries = {Extent{0, block_id, 0}};
+        root_node.depth++;
+        dirty.insert(root);
+        path = right_path();
+    }
+    Extent entry = extent; // 要放进当前这一层的项
+    for (size_t level = path.size(); level-- > 0;) {
+        ExtentNode &cur = node(path[level]);
+        if (cur.entries.size() < ExtentNode::capacity()) {
+            cur.entries.push_back(entry);
+            dirty.insert(cur.block_id);
+            return true;
+        }
+        // 节点已满，新开一个同深度的节点放这一项，由上一层指向它
+        uint32_t block_id = new_node(cur.depth, inode);
+        if (block_id == UINT32_MAX) {
+            return false;
+        }
+        node(block_id).entries.push_back(entry);
+        entry = Extent{extent.logical, block_id, 0};
+    }
+    return false;
+}
+
+/**
+ * @brief 在文件末尾追加count个块
+ * 向分配器要尽量长的连续块，与最后一个区段相接时直接延长它；新分配的块都计入inode的块数，
+ * 修改过的节点由save保存
+ * @param count 需要的块数
+ * @param inode 文件的inode
+ * @param logical 第一个块的逻辑块号, 默认接在最后一个区段之后; 压缩的文件用它在簇之间留出空洞
+ * @return 实际追加的块数, 空间不足时少于count
+ */
+uint32_t BlockMap::extend(uint32_t count, Inode &inode, uint32_t logical) {
+    uint32_t allocated = 0;
+    while (allocated < count) {
+        ExtentNode &leaf = node(right_path().back());
+        bool has_last = !leaf.entries.empty();
+        Extent last = has_last ? leaf.entries.back() : Extent{0, 0, 0};
+        uint32_t next = last.logical + last.length;
+        uint32_t at = logical == UINT32_MAX ? next : std::max(next, logical);
+        // 空文件的第一个区段紧跟在区段树的根节点之后
+        uint32_t goal = has_last ? last.start + last.length : inode.i_indirect + 1;
+        uint32_t got = 0;
+        uint32_t start = block_bitmap.get_free_extent(goal, count - allocated, got);
+        if (start == UINT32_MAX) {
+            break;
+        }
+        inode.i_blocks += got;
+        if (has_last && start == goal && at == next) {
+            leaf.entries.back().length += got;
+            dirty.insert(leaf.block_id);
+        } else if (!append(Extent{at, start, got}, inode)) {
+            block_bitmap.free_extent(start, got);
+            inode.i_blocks -= got;
+            break;
+        }
+        allocated += got;
+    }
+    return allocated;
+}
+
+/**
+ * @brief 取得第n个逻辑块对应的数据块, 没有时在末尾追加
+ * @param n 逻辑块号, 未映射时只能是文件末尾的下一块
+ * @param inode 文件的inode
+ * @param block_id 映射到指定的数据块, 默认新分配一个
+ * @return 数据块号, 空间不足或不是末尾时返回UINT32_MAX
+ */
+uint32_t BlockMap::map(uint32_t n, Inode &inode, uint32_t block_id) {
+    uint32_t found = lookup(n);
+    if (found != UINT32_MAX || n != size()) {
+        return found;
+    }
+    if (block_id == UINT32_MAX) {
+        return extend(1, inode) == 1 ? lookup(n) : UINT32_MAX;
+    }
+    ExtentNode &leaf = node(right_path().back());
+    if (!leaf.entries.empty() && leaf.entries.back().start + leaf.entries.back().length == block_id) {
+        leaf.entries.back().length++;
+        dirty.insert(leaf.block_id);
+        return block_id;
+    }
+    return append(Extent{n, block_id, 1}, inode) ? block_id : UINT32_MAX;
+}
+
+/**
+ * @brief 释放第keep个逻辑块及之后的数据块
+ * 释放根以外的所有节点后，把保留的区段重新放回树中；根映射块本身不释放
+ * @param keep 保留的块数
+ * @param inode 文件的inode, 释放的块从块数中扣除
+ */
+void BlockMap::truncate(uint32_t keep, Inode &inode) {
+    std::vector<Extent> kept;
+    for (const Extent &extent : extents()) {
+        uint32_t remain = extent.logical >= keep ? 0 : std::min(extent.length, keep - extent.logical);
+        if (remain < extent.length) {
+            block_bitmap.free_extent(extent.start + remain, extent.length - remain);
+            inode.i_blocks -= extent.length - remain;
+        }
+        if (remain > 0) {
+            kept.push_back(Extent{extent.logical, extent.start, remain});
+        }
+    }
+    free_children(root, inode);
+    ExtentNode &root_node = node(root);
+    root_node.depth = 0;
+    root_node.entries.clear();
+    dirty.insert(root);
+    for (const Extent &extent : kept) {
+        append(extent, inode);
+    }
+}
+
+/**
+ * @brief 释放节点下的所有子节点
+ */
+void BlockMap::free_children(uint32_t block_id, Inode &inode) {
+    if (node(block_id).depth == 0) {
+        return;
+    }
+    std::vector<Extent> entries = node(block_id).entries;
+    for (const Extent &entry : entries) {
+        free_children(entry.start, inode);
+        block_bitmap.free_block(entry.start);
+        inode.i_blocks--;
+        nodes.erase(entry.start);
+        dirty.erase(entry.start);
+    }
+}
+
+/**
+ * @brief 保存修改过的区段树节点
+ */
+void BlockMap::save() {
+    for (uint32_t block_id : dirty) {
+        nodes[block_id].save_extent_node();
+    }
+    dirty.clear();
+}
+
+/**
+ * @brief 挂载时从快照表读取所有快照
+ */
+void SnapshotTable::load() {
+    clear();
+    table_block = SuperBlock::read_super_block().snapshot_table;
+    if (table_block == 0) {
+        return;
+    }
+    SnapshotEntry entries[MAX_SNAPSHOTS];
+    journal.read(geometry.offset(table_block), entries, sizeof(entries));
+    for (int k = 0; k < MAX_SNAPSHOTS; ++k) {
+        Snapshot &snap = slots[k];
+        snap.entry = entries[k];
+        if (snap.entry.state == SNAPSHOT_FREE) {
+            continue;
+        }
+        // 冻结位图
+        std::vector<uint32_t> bitmap_blocks = frozen_blocks(snap, false);
+        snap.frozen.assign(bitmap_blocks.size() * geometry.block_size, 0);
+        for (size_t i = 0; i < bitmap_blocks.size(); ++i) {
+            journal.read(geometry.offset(bitmap_blocks[i]), snap.frozen.data() + i * geometry.block_size, geometry.block_size);
+        }
+        // 映射块链
+        uint32_t map_id = snap.entry.map_head;
+        while (map_id != UINT32_MAX && snap.pairs.size() < snap.entry.map_count) {
+            SnapMapBlock mb = SnapMapBlock::read_map_block(map_id);
+            snap.map_blocks.push_back(map_id);
+            for (uint32_t j = 0; j < mb.count; ++j) {
+                snap.pairs.emplace_back(mb.pairs[j][0], mb.pairs[j][1]);
+                snap.remap[mb.pairs[j][0]] = mb.pairs[j][1];
+            }
+            map_id = mb.next;
+        }
+        snap.persisted = snap.pairs.size();
+    }
+}
+
+/**
+ * @brief 清空内存中的快照信息，用于格式化
+ */
+void SnapshotTable::clear() {
+    for (auto &snap : slots) {
+        snap = Snapshot();
+        snap.entry = {};
+    }
+    table_block = 0;
+    view = -1;
+}
+
+/**
+ * @brief 按名字查找有效的快照
+ * @param name 快照名
+ * @return 快照在表中的位置, 不存在返回-1
+ */
+int SnapshotTable::find(const std::string &name) const {
+    for (int k = 0; k < MAX_SNAPSHOTS; ++k) {
+        if (slots[k].entry.state == SNAPSHOT_ACTIVE && name == slots[k].entry.name) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 创建快照
+ * 只复制块位图并登记快照，不复制任何数据块
+ * @param name 快照名
+ * @param _shell_output 输出信息
+ * @return 是否创建成功
+ */
+bool SnapshotTable::create(const std::string &name, std::string &_shell_output) {
+    if (name.empty() || name.size() >= sizeof(SnapshotEntry::name)) {
+        _shell_output += __ERROR + "快照名不合法" + __NORMAL + "\n";
+        return false;
+    }
+    if (find(name) != -1) {
+        _shell_output += __ERROR + "快照" + name + "已存在" + __NORMAL + "\n";
+        return false;
+    }
+    int slot = -1;
+    for (int k = 0; k < MAX_SNAPSHOTS && slot == -1; ++k) {
+        if (slots[k].entry.state == SNAPSHOT_FREE) {
+            slot = k;
+        }
+    }
+    if (slot == -1) {
+        _shell_output += __ERROR + "快照数量已达上限" + __NORMAL + "\n";
+        return false;
+    }
+    // 之前提交的事务先落盘，快照冻结的就是此刻磁盘上的状态
+    journal.flush();
+    if (table_block == 0) {
+        table_block = block_bitmap.get_free_block();
+        if (table_block == UINT32_MAX) {
+            table_block = 0;
+            _shell_output += __ERROR + "磁盘空间不足" + __NORMAL + "\n";
+            return false;
+        }
+        SuperBlock sb = SuperBlock::read_super_block();
+        sb.snapshot_table = table_block;
+        sb.save_super_block();
+    }
+    Snapshot &snap = slots[slot];
+    snap = Snapshot();
+    snap.frozen = block_bitmap.bitmap.bytes;
+    // 快照自身的元数据块不属于快照内容
+    std::vector<uint32_t> owned = {table_block};
+    for (int k = 0; k < MAX_SNAPSHOTS; ++k) {
+        if (k == slot || slots[k].entry.state == SNAPSHOT_FREE) {
+            continue;
+        }
+        std::vector<uint32_t> bitmap_blocks = frozen_blocks(slots[k], true);
+        owned.insert(owned.end(), bitmap_blocks.begin(), bitmap_blocks.end());
+        owned.insert(owned.end(), slots[k].map_blocks.begin(), slots[k].map_blocks.end());
+        for (auto &pair : slots[k].pairs) {
+            owned.push_back(pair.second);
+        }
+    }
+    for (uint32_t block_id : owned) {
+        snap.frozen[block_id / 8] &= static_cast<uint8_t>(~(1u << (block_id % 8)));
+    }
+    // 冻结位图按块补齐后写入新分配的数据块, 索引块放不下时链接下一个索引块
+    const uint32_t per_index = geometry.index_entries();
+    size_t count = (snap.frozen.size() + geometry.block_size - 1) / geometry.block_size;
+    std::vector<uint8_t> padded(snap.frozen);
+    padded.resize(count * geometry.block_size, 0);
+    IndexBlock ib;
+    ib.next_index = UINT32_MAX;
+    ib.block_id = get_free_block();
+    uint32_t bitmap_index = ib.block_id;
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0 && i % per_index == 0) {
+            ib.next_index = get_free_block();
+            ib.save_index_block();
+            uint32_t next = ib.next_index;
+            ib = IndexBlock();
+            ib.block_id = next;
+            ib.next_index = UINT32_MAX;
+        }
+        ib.index[i % per_index] = get_free_block();
+        journal.write(geometry.offset(ib.index[i % per_index]), padded.data() + i * geometry.block_size, geometry.block_size);
+    }
+    ib.save_index_block();
+    snap.entry = {};
+    snap.entry.state = SNAPSHOT_ACTIVE;
+    snap.entry.ctime = static_cast<uint32_t>(time(0));
+    snap.entry.bitmap_index = bitmap_index;
+    snap.entry.map_head = UINT32_MAX;
+    snap.entry.map_count = 0;
+    strcpy(snap.entry.name, name.c_str());
+    save_table();
+    // 本事务中已经改动过的块在磁盘上仍是快照时刻的内容，也要保存
+    std::vector<uint32_t> dirty;
+    for (auto &block : journal.running) {
+        dirty.push_back(block.first);
+    }
+    for (uint32_t block_id : dirty) {
+        preserve(block_id);
+    }
+    _shell_output += __SUCCESS + "快照" + name + "创建成功" + __NORMAL + "\n";
+    return true;
+}
+
+/**
+ * @brief 删除快照
+ * 只把快照标记为删除中，占用的块由reclaim在后台分批回收
+ * @param name 快照名
+ * @param _shell_output 输出信息
+ * @return 是否删除成功
+ */
+bool SnapshotTable::remove(const std::string &name, std::string &_shell_output) {
+    int slot = find(name);
+    if (slot == -1) {
+        _shell_output += __ERROR + "快照" + name + "不存在" + __NORMAL + "\n";
+        return false;
+    }
+    slots[slot].entry.state = SNAPSHOT_DELETING;
+    save_table();
+    _shell_output += __SUCCESS + "快照" + name + "已删除，空间将在后台回收" + __NORMAL + "\n";
+    return true;
+}
+
+/**
+ * @brief 列出所有快照
+ * @return 快照列表
+ */
+std::string SnapshotTable::list() const {
+    std::ostringstream result;
+    result << std::left << std::setw(20) << "name" << std::setw(22) << "create time" << std::setw(14) << "saved blocks" << "state" << std::endl;
+    result << std::setfill('-') << std::setw(68) << "-" << std::setfill(' ') << std::endl;
+    for (const auto &snap : slots) {
+        if (snap.entry.state == SNAPSHOT_FREE) {
+            continue;
+        }
+        result << std::left << std::setw(20) << snap.entry.name << std::setw(22) << format_time(snap.entry.ctime)
+               << std::setw(14) << snap.entry.map_count << (snap.entry.state == SNAPSHOT_ACTIVE ? "有效" : "回收中") << std::endl;
+    }
+    return result.str();
+}
+
+/**
+ * @brief 块第一次被改写前调用，为需要它的快照保存快照时刻的内容
+ * 多个快照需要同一个块时共用一份副本
+ * @param block_id 将被改写的块号
+ * @return 是否保存了旧内容
+ */
+bool SnapshotTable::preserve(uint32_t block_id) {
+    std::vector<int> need;
+    for (int k = 0; k < MAX_SNAPSHOTS; ++k) {
+        const Snapshot &snap = slots[k];
+        if (snap.entry.state == SNAPSHOT_ACTIVE && snap.is_frozen(block_id) && !snap.remap.count(block_id)) {
+            need.push_back(k);
+        }
+    }
+    if (need.empty()) {
+        return false;
+    }
+    // 磁盘上的内容就是快照时刻的内容；先占位，分配副本时递归改写同一个块不会重复保存
+    std::vector<char> image(geometry.block_size);
+    journal.read_disk(geometry.offset(block_id), image.data(), geometry.block_size);
+    for (int k : need) {
+        slots[k].remap[block_id] = UINT32_MAX;
+    }
+    ++preserve_depth;
+    uint32_t copy_id = get_free_block();
+    if (copy_id == UINT32_MAX) {
+        // 空间不足，无法保存旧内容的快照只能作废
+        for (int k : need) {
+            slots[k].remap.erase(block_id);
+            slots[k].entry.state = SNAPSHOT_DELETING;
+            std::cerr << __ERROR << "磁盘空间不足，快照" << slots[k].entry.name << "已失效" << __NORMAL << std::endl;
+        }
+        save_table();
+        --preserve_depth;
+        return false;
+    }
+    for (int k : need) {
+        slots[k].remap[block_id] = copy_id;
+        slots[k].pairs.emplace_back(block_id, copy_id);
+        ++slots[k].entry.map_count;
+    }
+    journal.write_data(geometry.offset(copy_id), image.data(), geometry.block_size);
+    // 映射在最外层统一写入映射块
+    if (--preserve_depth == 0) {
+        save_maps();
+    }
+    return true;
+}
+
+/**
+ * @brief 把块号转换为当前挂载的快照中对应内容所在的块号
+ * @param block_id 块号
+ * @return 快照时刻内容所在的块号
+ */
+uint32_t SnapshotTable::translate(uint32_t block_id) const {
+    if (view < 0) {
+        return block_id;
+    }
+    auto it = slots[view].remap.find(block_id);
+    return it == slots[view].remap.end() ? block_id : it->second;
+}
+
+/**
+ * @brief 后台回收已删除快照占用的块
+ * @param budget 本次最多回收的块数
+ */
+void SnapshotTable::reclaim(uint32_t budget) {
+    const uint32_t per_block = sizeof(SnapMapBlock::pairs) / sizeof(SnapMapBlock::pairs[0]);
+    for (int k = 0; k < MAX_SNAPSHOTS && budget > 0; ++k) {
+        Snapshot &snap = slots[k];
+        if (snap.entry.state != SNAPSHOT_DELETING) {
+            continue;
+        }
+        journal.begin();
+        // 从映射的末尾开始回收，映射块随之截断，中途崩溃也不会重复释放
+        while (budget > 0 && !snap.pairs.empty()) {
+            auto pair = snap.pairs.back();
+            snap.pairs.pop_back();
+            snap.remap.erase(pair.first);
+            if (!is_shared_copy(k, pair.first, pair.second)) {
+                block_bitmap.free_block(pair.second);
+            }
+            --snap.entry.map_count;
+            snap.persisted = snap.pairs.size();
+            --budget;
+            uint32_t left = static_cast<uint32_t>(snap.pairs.size() % per_block);
+            if (left == 0) {
+                block_bitmap.free_block(snap.map_blocks.back());
+                snap.map_blocks.pop_back();
+                if (snap.map_blocks.empty()) {
+                    snap.entry.map_head = UINT32_MAX;
+                } else {
+                    SnapMapBlock prev = SnapMapBlock::read_map_block(snap.map_blocks.back());
+                    prev.next = UINT32_MAX;
+                    prev.save_map_block();
+                }
+            } else {
+                SnapMapBlock last = SnapMapBlock::read_map_block(snap.map_blocks.back());
+                last.count = left;
+                last.save_map_block();
+            }
+        }
+        if (snap.pairs.empty() && budget > 0) {
+            for (uint32_t block_id : frozen_blocks(snap, true)) {
+                block_bitmap.free_block(block_id);
+            }
+            snap = Snapshot();
+            snap.entry = {};
+            --budget;
+        }
+        save_table();
+        journal.commit();
+    }
+}
+
+/**
+ * @brief 从超级块读取链表的头
+ */
+void OrphanList::load() {
+    head = SuperBlock::read_super_block().orphan_head;
+}
+
+/**
+ * @brief 把已删除目录项的inode链入孤儿链表, 不再计入所有者的用量
+ * @param inode 文件或目录的inode, 链接数置为0
+ */
+void OrphanList::push(Inode &inode) {
+    quota_table.charge(inode, -static_cast<int64_t>(inode.i_blocks), -1);
+    inode.i_links_count = 0;
+    inode.i_atime = head;
+    inode.save_inode();
+    head = inode.i_id;
+    save_head();
+}
+
+/**
+ * @brief 在命令的间隙回收孤儿inode
+ * 文件从末尾截断budget个块; 目录每次处理最后一个目录块, 其中的文件和子目录链到这个目录之后, 再截断这个块。
+ * 仍被打开的文件等到关闭后再回收
+ * @param budget 本轮最多释放的块数和处理的目录项数
+ */
+void OrphanList::reclaim(uint32_t budget) {
+    if (empty()) {
+        return;
+    }
+    journal.begin();
+    uint32_t prev = 0;
+    uint32_t cur = head;
+    while (cur != 0 && budget > 0) {
+        Inode inode = Inode::read_inode(cur);
+        uint32_t next = inode.i_atime;
+        if (lock_manager.locked(cur) || !release(inode, budget, next)) {
+            prev = cur;
+            cur = next;
+            continue;
+        }
+        // 已经全部释放, 从链表中摘下
+        if (prev == 0) {
+            head = next;
+            save_head();
+        } else {
+            Inode prev_inode = Inode::read_inode(prev);
+            prev_inode.i_atime = next;
+            prev_inode.save_inode();
+        }
+        cur = next;
+    }
+    journal.commit();
+}
+
+/**
+ * @brief 只改写超级块中链表的头
+ */
+void OrphanList::save_head() {
+    journal.write(offsetof(SuperBlock, orphan_head), &head, sizeof(head));
+}
+
+/**
+ * @brief 释放孤儿inode的一部分
+ * @param inode 孤儿inode
+ * @param budget 剩余的预算, 按处理的块数和目录项数扣减
+ * @param next 链表中的下一个孤儿, 目录的子项链在目录之后时随之改变
+ * @return 是否已经全部释放
+ */
+bool OrphanList::release(Inode &inode, uint32_t &budget, uint32_t &next) {
+    if (inode.is_inline()) {
+        inode_bitmap.free_inode(inode.i_id);
+        return true;
+    }
+    BlockMap block_map(inode.i_indirect);
+    uint32_t size = block_map.size();
+    uint32_t count = size;
+    if (inode.i_type == DIR_TYPE && count > 0) {
+        uint32_t last = count - 1;
+        DirBlock db = DirBlock::read_dir_block(block_map.lookup(last));
+        for (uint32_t j = last == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+            if (db.entries[j].type == UNDEFINE_TYPE) {
+                continue;
+            }
+            Inode child = Inode::read_inode(db.entries[j].inode_id);
+            quota_table.charge(child, -static_cast<int64_t>(child.i_blocks), -1);
+            name_index.remove(db.entries[j].name, child.i_id);
+            child.i_links_count = 0;
+            child.i_atime = next;
+            child.save_inode();
+            next = child.i_id;
+            budget -= std::min(budget, 1u);
+        }
+        inode.i_atime = next;
+        count = last;
+    } else {
+        count -= std::min(count, budget);
+    }
+    budget -= std::min(budget, size - count);
+    block_map.truncate(count, inode);
+    if (count > 0) {
+        block_map.save();
+        inode.save_inode();
+        return false;
+    }
+    block_bitmap.free_block(inode.i_indirect);
+    inode_bitmap.free_inode(inode.i_id);
+    return true;
+}
+
+/**
+ * @brief 挂载时读取配额表
+ */
+void QuotaTable::load() {
+    table_block = SuperBlock::read_super_block().quota_table;
+    std::fill(std::begin(entries), std::end(entries), QuotaEntry{});
+    if (table_block != 0) {
+        journal.read(geometry.offset(table_block), entries, sizeof(entries));
+    }
+}
+
+/**
+ * @brief 分配并清空配额表, 用于格式化和升级, 由调用者把块号写入超级块
+ * @return 是否分配成功
+ */
+bool QuotaTable::create() {
+    static_assert(sizeof(QuotaEntry) * MAX_QUOTAS <= MIN_BLOCK_SIZE, "配额表放不进一个块");
+    std::fill(std::begin(entries), std::end(entries), QuotaEntry{});
+    table_block = block_bitmap.get_free_block();
+    if (table_block == UINT32_MAX) {
+        table_block = 0;
+        return false;
+    }
+    journal.write(geometry.offset(table_block), entries, sizeof(entries));
+    return true;
+}
+
+/**
+ * @brief 遍历所有inode重新统计用量, 保留已设置的限额, 用于升级旧磁盘
+ * 孤儿inode已经不计入用量
+ */
+void QuotaTable::rebuild() {
+    for (QuotaEntry &entry : entries) {
+        entry.blocks = entry.inodes = 0;
+    }
+    for (uint32_t id = 0; id < inode_bitmap.capacity(); id++) {
+        if (!inode_bitmap.is_used(id)) {
+            continue;
+        }
+        Inode inode = Inode::read_inode(id);
+        if (inode.i_links_count > 0) {
+            charge(inode, inode.i_blocks, 1);
+        }
+    }
+}
+
+/**
+ * @brief 把inode的块数和inode数的变化计入所有者和所属组的用量
+ * 孤儿inode链入链表时已经不再计入用量, 仍打开着它的写句柄之后的变化也不计入
+ * @param inode 发生变化的inode
+ * @param blocks 块数的变化
+ * @param inodes inode数的变化
+ */
+void QuotaTable::charge(const Inode &inode, int64_t blocks, int32_t inodes) {
+    if (table_block == 0 || inode.i_links_count == 0 || (blocks == 0 && inodes == 0)) {
+        return;
+    }
+    for (int slot : {find_or_add(QUOTA_USER, inode.i_uid), find_or_add(QUOTA_GROUP, inode.i_gid)}) {
+        if (slot == -1) {
+            continue;
+        }
+        QuotaEntry &entry = entries[slot];
+        entry.blocks = static_cast<uint32_t>(std::max<int64_t>(0, entry.blocks + blocks));
+        entry.inodes = static_cast<uint32_t>(std::max<int64_t>(0, static_cast<int64_t>(entry.inodes) + inodes));
+        save_entry(slot);
+    }
+}
+
+/**
+ * @brief 用户在硬限额内还能使用的块数
+ * @return 用户和所属组剩余块数中较小的一个, 都不限制时返回UINT32_MAX
+ */
+uint32_t QuotaTable::room(uint32_t uid, uint32_t gid) const {
+    uint32_t result = UINT32_MAX;
+    for (int slot : {find(QUOTA_USER, uid), find(QUOTA_GROUP, gid)}) {
+        if (slot != -1 && entries[slot].block_hard != 0) {
+            const QuotaEntry &entry = entries[slot];
+            result = std::min(result, entry.block_hard > entry.blocks ? entry.block_hard - entry.blocks : 0);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief 用户是否还能创建文件或目录
+ * @param blocks 新的文件或目录立即占用的块数
+ */
+bool QuotaTable::can_create(uint32_t uid, uint32_t gid, uint32_t blocks) const {
+    if (room(uid, gid) < blocks) {
+        return false;
+    }
+    for (int slot : {find(QUOTA_USER, uid), find(QUOTA_GROUP, gid)}) {
+        if (slot != -1 && entries[slot].inode_hard != 0 && entries[slot].inodes >= entries[slot].inode_hard) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 用户或所属组的用量是否超过了软限额
+ */
+bool QuotaTable::over_soft(uint32_t uid, uint32_t gid) const {
+    for (int slot : {find(QUOTA_USER, uid), find(QUOTA_GROUP, gid)}) {
+        if (slot == -1) {
+            continue;
+        }
+        const QuotaEntry &entry = entries[slot];
+        if ((entry.block_soft != 0 && entry.blocks > entry.block_soft) || (entry.inode_soft != 0 && entry.inodes > entry.inode_soft)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief 设置用户或组的限额
+ * @param kind QUOTA_USER或QUOTA_GROUP
+ * @param id 用户ID或组ID, root不受限制
+ * @param blocks 块数的软限额和硬限额, 为空时不修改
+ * @param inodes inode数的软限额和硬限额, 为空时不修改
+ * @param _shell_output 输出信息
+ * @return 是否设置成功
+ */
+bool QuotaTable::set_limit(uint32_t kind, uint32_t id, const uint32_t *blocks, const uint32_t *inodes, std::string &_shell_output) {
+    if (id == 0) {
+        _shell_output += __ERROR + "不能限制root" + __NORMAL + "\n";
+        return false;
+    }
+    if ((blocks && blocks[1] != 0 && blocks[0] > blocks[1]) || (inodes && inodes[1] != 0 && inodes[0] > inodes[1])) {
+        _shell_output += __ERROR + "软限额不能超过硬限额" + __NORMAL + "\n";
+        return false;
+    }
+    int slot = find_or_add(kind, id);
+    if (slot == -1) {
+        _shell_output += __ERROR + "配额表已满" + __NORMAL + "\n";
+        return false;
+    }
+    QuotaEntry &entry = entries[slot];
+    if (blocks) {
+        entry.block_soft = blocks[0];
+        entry.block_hard = blocks[1];
+    }
+    if (inodes) {
+        entry.inode_soft = inodes[0];
+        entry.inode_hard = inodes[1];
+    }
+    save_entry(slot);
+    return true;
+}
+
+/**
+ * @brief 列出用量和限额, root看到所有用户和组, 其他用户只看到自己和所属的组
+ * 超过软限额的用量后面标*
+ */
+std::string QuotaTable::list(const User &user) const {
+    std::ostringstream result;
+    result << std::left << std::setw(8) << "type" << std::setw(8) << "id" << std::setw(10) << "blocks" << std::setw(8) << "soft" << std::setw(8) << "hard"
+           << std::setw(10) << "inodes" << std::setw(8) << "soft" << "hard" << std::endl;
+    result << std::setfill('-') << std::setw(68) << "-" << std::setfill(' ') << std::endl;
+    auto limit = [](uint32_t value) { return value == 0 ? std::string("-") : std::to_string(value); };
+    auto usage = [](uint32_t used, uint32_t soft) { return std::to_string(used) + (soft != 0 && used > soft ? "*" : ""); };
+    for (const QuotaEntry &entry : entries) {
+        if (entry.kind == QUOTA_FREE || (user.uid != 0 && entry.id != (entry.kind == QUOTA_USER ? user.uid : user.gid))) {
+            continue;
+        }
+        result << std::left << std::setw(8) << (entry.kind == QUOTA_USER ? "user" : "group") << std::setw(8) << entry.id
+               << std::setw(10) << usage(entry.blocks, entry.block_soft) << std::setw(8) << limit(entry.block_soft) << std::setw(8) << limit(entry.block_hard)
+               << std::setw(10) << usage(entry.inodes, entry.inode_soft) << std::setw(8) << limit(entry.inode_soft) << limit(entry.inode_hard) << std::endl;
+    }
+    return result.str();
+}
+
+/**
+ * @brief 查找用户或组的表项
+ * @return 表项的位置, 不存在返回-1
+ */
+int QuotaTable::find(uint32_t kind, uint32_t id) const {
+    for (int k = 0; k < MAX_QUOTAS; ++k) {
+        if (entries[k].kind == kind && entries[k].id == id) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 查找用户或组的表项, 不存在时占用一个空闲表项
+ * @return 表项的位置, 表满时返回-1
+ */
+int QuotaTable::find_or_add(uint32_t kind, uint32_t id) {
+    int slot = find(kind, id);
+    for (int k = 0; k < MAX_QUOTAS && slot == -1; ++k) {
+        if (entries[k].kind == QUOTA_FREE) {
+            slot = k;
+            entries[k] = QuotaEntry{kind, id, 0, 0, 0, 0, 0, 0};
+        }
+    }
+    return slot;
+}
+
+/**
+ * @brief 只改写配额表中的一个表项
+ */
+void QuotaTable::save_entry(int slot) {
+    journal.write(geometry.offset(table_block) + slot * sizeof(QuotaEntry), &entries[slot], sizeof(QuotaEntry));
+}
+
+/**
+ * @brief 保存快照表
+ */
+void SnapshotTable::save_table() {
+    SnapshotEntry entries[MAX_SNAPSHOTS];
+    for (int k = 0; k < MAX_SNAPSHOTS; ++k) {
+        entries[k] = slots[k].entry;
+    }
+    journal.write(geometry.offset(table_block), entries, sizeof(entries));
+}
+
+/**
+ * @brief 把内存中新增的映射写入映射块
+ * 分配映射块时可能递归触发新的保存，循环直到所有映射都写入
+ */
+void SnapshotTable::save_maps() {
+    if (saving_maps) {
+        return;
+    }
+    saving_maps = true;
+    const size_t per_block = sizeof(SnapMapBlock::pairs) / sizeof(SnapMapBlock::pairs[0]);
+    bool changed = false;
+    for (auto &snap : slots) {
+        while (snap.entry.state != SNAPSHOT_FREE && snap.persisted < snap.pairs.size()) {
+            changed = true;
+            SnapMapBlock mb;
+            if (snap.persisted % per_block == 0) { // 最后一个映射块已满
+                mb = {};
+                mb.block_id = block_bitmap.get_free_block();
+                mb.next = UINT32_MAX;
+                if (snap.map_blocks.empty()) {
+                    snap.entry.map_head = mb.block_id;
+                } else {
+                    SnapMapBlock prev = SnapMapBlock::read_map_block(snap.map_blocks.back());
+                    prev.next = mb.block_id;
+                    prev.save_map_block();
+                }
+                snap.map_blocks.push_back(mb.block_id);
+            } else {
+                mb = SnapMapBlock::read_map_block(snap.map_blocks.back());
+            }
+            while (mb.count < per_block && snap.persisted < snap.pairs.size()) {
+                mb.pairs[mb.count][0] = snap.pairs[snap.persisted].first;
+                mb.pairs[mb.count][1] = snap.pairs[snap.persisted].second;
+                ++mb.count;
+                ++snap.persisted;
+            }
+            mb.save_map_block();
+        }
+    }
+    if (changed) {
+        save_table();
+    }
+    saving_maps = false;
+}
+
+/**
+ * @brief 为旧内容副本分配一个数据块
+ * 优先使用不属于任何快照的空闲块，否则副本块本身也要先保存，会连锁复制
+ * @return 数据块号, 没有空闲块时返回UINT32_MAX
+ */
+uint32_t SnapshotTable::get_free_block() {
+    for (uint32_t i = geometry.data_block_start; i < geometry.block_count; i++) {
+        if (block_bitmap.bitmap.test(i)) {
+            continue;
+        }
+        bool frozen = false;
+        for (const auto &snap : slots) {
+            frozen = frozen || (snap.entry.state == SNAPSHOT_ACTIVE && snap.is_frozen(i));
+        }
+        if (!frozen) {
+            block_bitmap.take(i);
+            block_bitmap.save_bitmap_block(i);
+            return i;
+        }
+    }
+    return block_bitmap.get_free_block();
+}
+
+/**
+ * @brief 获取保存冻结位图的所有块
+ * @param snap 快照
+ * @param with_index 是否包含索引块
+ * @return 按顺序排列的位图数据块, 需要时在前面附带索引块
+ */
+std::vector<uint32_t> SnapshotTable::frozen_blocks(const Snapshot &snap, bool with_index) const {
+    std::vector<uint32_t> blocks;
+    uint32_t index_id = snap.entry.bitmap_index;
+    while (index_id != UINT32_MAX) {
+        IndexBlock ib = IndexBlock::read_index_block(index_id);
+        if (with_index) {
+            blocks.push_back(ib.block_id);
+        }
+        for (uint32_t i = 0; i < geometry.index_entries() && ib.index[i] != UINT32_MAX; ++i) {
+            blocks.push_back(ib.index[i]);
+        }
+        index_id = ib.next_index;
+    }
+    return blocks;
+}
+
+/**
+ * @brief 判断旧内容副本是否还被其他快照使用
+ * @param slot 正在回收的快照
+ * @param block_id 原块号
+ * @param copy_id 旧内容所在块号
+ */
+bool SnapshotTable::is_shared_copy(int slot, uint32_t block_id, uint32_t copy_id) const {
+    for (int k = 0; k < MAX_SNAPSHOTS; ++k) {
+        if (k == slot || slots[k].entry.state == SNAPSHOT_FREE) {
+            continue;
+        }
+        auto it = slots[k].remap.find(block_id);
+        if (it != slots[k].remap.end() && it->second == copy_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief 列出打开的文件
+ * @return 打开文件列表
+ */
+std::string FileTable::list() const {
+    std::ostringstream result;
+    result << std::left << std::setw(6) << "fd" << std::setw(8) << "mode" << std::setw(14) << "offset" << std::setw(10) << "buffered" << "path" << std::endl;
+    result << std::setfill('-') << std::setw(58) << "-" << std::setfill(' ') << std::endl;
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        if (files[fd].inode_id == UINT32_MAX) {
+            continue;
+        }
+        result << std::left << std::setw(6) << fd << std::setw(8) << (files[fd].is_write ? "rw" : "r")
+               << std::setw(14) << files[fd].offset << std::setw(10) << files[fd].pending.size() << files[fd].path << std::endl;
+    }
+    return result.str();
+}
+
+/**
+ * @brief 一次获得一组锁
+ * 任何一个拿不到时都不加锁, 而是在这些inode的等待队列中排队, 之后用同样的请求重试
+ * @param owner 用户编号
+ * @param requests 需要的锁, 同一个inode出现多次时按最强的模式加锁
+ * @return 是否全部获得
+ */
+bool LockManager::acquire(int owner, std::vector<LockRequest> requests) {
+    // 按inode编号排序并合并, 所有命令以相同的顺序加锁
+    std::sort(requests.begin(), requests.end(), [](const LockRequest &a, const LockRequest &b) {
+        return a.inode_id < b.inode_id || (a.inode_id == b.inode_id && a.mode > b.mode);
+    });
+    requests.erase(std::unique(requests.begin(), requests.end(), [](const LockRequest &a, const LockRequest &b) {
+        return a.inode_id == b.inode_id;
+    }), requests.end());
+    bool granted = true;
+    for (const LockRequest &request : requests) {
+        granted = granted && grantable(owner, request.inode_id, request.mode);
+    }
+    if (!granted) {
+        // 不再需要的inode上的排队作废, 需要的inode上保持原来的位置
+        std::vector<uint32_t> stale;
+        for (const auto &entry : locks) {
+            bool needed = std::any_of(requests.begin(), requests.end(), [&](const LockRequest &r) { return r.inode_id == entry.first; });
+            if (!needed) {
+                stale.push_back(entry.first);
+            }
+        }
+        for (uint32_t inode_id : stale) {
+            dequeue(owner, inode_id);
+        }
+        for (const LockRequest &request : requests) {
+            auto &queue = locks[request.inode_id].queue;
+            auto it = std::find_if(queue.begin(), queue.end(), [&](const std::pair<int, LockMode> &w) { return w.first == owner; });
+            if (it == queue.end()) {
+                queue.emplace_back(owner, request.mode);
+            } else {
+                it->second = request.mode;
+            }
+        }
+        since.emplace(owner, static_cast<uint32_t>(time(0)));
+        return false;
+    }
+    cancel(owner);
+    for (const LockRequest &request : requests) {
+        locks[request.inode_id].holders[owner].count[request.mode]++;
+    }
+    return true;
+}
+
+/**
+ * @brief 释放acquire获得的一组锁
+ * @param owner 用户编号
+ * @param requests 获得锁时的请求
+ */
+void LockManager::release(int owner, const std::vector<LockRequest> &requests) {
+    for (const LockRequest &request : requests) {
+        auto lock = locks.find(request.inode_id);
+        if (lock == locks.end()) {
+            continue;
+        }
+        auto holder = lock->second.holders.find(owner);
+        if (holder != lock->second.holders.end()) {
+            uint32_t *count = holder->second.count;
+            count[request.mode] -= std::min(count[request.mode], 1u);
+            if (count[LOCK_SHARED] == 0 && count[LOCK_WRITE] == 0 && count[LOCK_EXCLUSIVE] == 0) {
+                lock->second.holders.erase(holder);
+            }
+        }
+        if (lock->second.holders.empty() && lock->second.queue.empty()) {
+            locks.erase(lock);
+        }
+    }
+}
+
+/**
+ * @brief 放弃等待, 从所有等待队列中移除
+ * @param owner 用户编号
+ */
+void LockManager::cancel(int owner) {
+    std::vector<uint32_t> inodes;
+    for (const auto &entry : locks) {
+        inodes.push_back(entry.first);
+    }
+    for (uint32_t inode_id : inodes) {
+        dequeue(owner, inode_id);
+    }
+    since.erase(owner);
+}
+
+/**
+ * @brief 判断现在能否获得某个inode的锁
+ * 与其他持有者兼容, 并且排在前面的其他等待者都与之兼容时才能获得; 已经持有同样或更强的锁时直接获得
+ */
+bool LockManager::grantable(int owner, uint32_t inode_id, LockMode mode) const {
+    auto lock = locks.find(inode_id);
+    if (lock == locks.end()) {
+        return true;
+    }
+    auto own = lock->second.holders.find(owner);
+    if (own != lock->second.holders.end()) {
+        for (int held = mode; held <= LOCK_EXCLUSIVE; held++) {
+            if (own->second.count[held] > 0) {
+                return true;
+            }
+        }
+    }
+    for (const auto &holder : lock->second.holders) {
+        for (int held = LOCK_SHARED; held <= LOCK_EXCLUSIVE; held++) {
+            if (holder.first != owner && holder.second.count[held] > 0 && !compatible(static_cast<LockMode>(held), mode)) {
+                return false;
+            }
+        }
+    }
+    for (const auto &waiter : lock->second.queue) {
+        if (waiter.first == owner) {
+            break;
+        }
+        if (!compatible(waiter.second, mode)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 把用户从某个inode的等待队列中移除, 没有人持有或等待的锁随之删除
+ */
+void LockManager::dequeue(int owner, uint32_t inode_id) {
+    auto lock = locks.find(inode_id);
+    if (lock == locks.end()) {
+        return;
+    }
+    auto &queue = lock->second.queue;
+    queue.erase(std::remove_if(queue.begin(), queue.end(), [&](const std::pair<int, LockMode> &w) { return w.first == owner; }), queue.end());
+    if (lock->second.holders.empty() && queue.empty()) {
+        locks.erase(lock);
+    }
+}
+
+/**
+ * @brief 读者固定文件当前的版本
+ * 文件在上一个版本创建之后没有被写入时共用那个版本
+ * @param inode_id 文件的inode编号
+ * @return 版本编号
+ */
+uint64_t VersionTable::pin(uint32_t inode_id) {
+    auto changed_at = changed.find(inode_id);
+    for (auto &entry : versions) {
+        if (entry.second.inode_id == inode_id && (changed_at == changed.end() || entry.second.epoch > changed_at->second)) {
+            entry.second.readers++;
+            return entry.first;
+        }
     }
+    FileVersion &version = versions[next_id];
+    version.inode_id = inode_id;
+    version.epoch = ++epoch;
+    version.size = Inode::read_inode(inode_id).i_size;
+    version.readers = 1;
+    return next_id++;
+}
 
-    /**
-     * @brief 从文件中读取目录块
-     * @param block_id 目录块号
-     * @return 读取到的目录块
-     */
-    static DirBlock read_dir_block(uint32_t block_id) {
-        DirBlock db;
-        std::ifstream file(disk_path, std::ios::binary | std::ios::in);
-        file.seekg(block_id * BLOCK_SIZE);
-        file.read(reinterpret_cast<char *>(&db), sizeof(DirBlock));
-        file.close();
-        return db;
+/**
+ * @brief 读者不再使用版本, 最后一个读者离开时回收版本和其中保存的旧内容
+ * @param id 版本编号
+ */
+void VersionTable::unpin(uint64_t id) {
+    auto it = versions.find(id);
+    if (it == versions.end() || --it->second.readers > 0) {
+        return;
     }
-};
+    uint32_t inode_id = it->second.inode_id;
+    versions.erase(it);
+    if (std::none_of(versions.begin(), versions.end(), [&](const std::pair<const uint64_t, FileVersion> &entry) { return entry.second.inode_id == inode_id; })) {
+        changed.erase(inode_id);
+    }
+}
 
 /**
- * 索引块
- * 一个索引块存储254个索引，每个索引指向一个数据块
- * 保留当前索引块的块号，以及下一个索引块的块号
+ * @brief 写入文件之前调用, 把将被改写、仍被读者固定的块的旧内容保存到版本中
+ * 追加的内容在旧版本的大小之外, 不需要保存
+ * @param file_inode 写入前的inode
+ * @param offset 写入的起始字节偏移
+ * @param end 写入的结束字节偏移
  */
-struct IndexBlock {
-    uint32_t block_id;
-    uint32_t next_index;
-    uint32_t index[254];
-    IndexBlock() {}
-    IndexBlock(uint32_t id) {
-        memset(index, UINT32_MAX, sizeof(index));
-        next_index = UINT32_MAX;
-        block_id = id;
-        index[0] = block_bitmap.get_free_block();
+void VersionTable::preserve(const Inode &file_inode, uint64_t offset, uint64_t end) {
+    if (std::none_of(versions.begin(), versions.end(), [&](const std::pair<const uint64_t, FileVersion> &entry) { return entry.second.inode_id == file_inode.i_id; })) {
+        return;
+    }
+    changed[file_inode.i_id] = ++epoch;
+    uint64_t stop = std::min(end, file_inode.i_size);
+    if (offset >= stop) {
+        return;
+    }
+    uint32_t first = static_cast<uint32_t>(offset / geometry.block_size);
+    uint32_t last = static_cast<uint32_t>((stop - 1) / geometry.block_size);
+    // 需要保存时整段只读一次, 压缩的文件每簇只解压一次
+    std::string span;
+    bool loaded = false;
+    for (auto &entry : versions) {
+        FileVersion &version = entry.second;
+        if (version.inode_id != file_inode.i_id) {
+            continue;
+        }
+        for (uint32_t n = first; n <= last && geometry.offset(n) < version.size; n++) {
+            if (version.saved.find(n) == version.saved.end()) {
+                if (!loaded) {
+                    span = read_file_range(file_inode, geometry.offset(first), geometry.offset(last + 1) - geometry.offset(first));
+                    loaded = true;
+                }
+                size_t at = static_cast<size_t>(geometry.offset(n - first));
+                version.saved[n] = at < span.size() ? span.substr(at, static_cast<size_t>(std::min<uint64_t>(geometry.block_size, version.size - geometry.offset(n)))) : "";
+            }
+        }
     }
+}
 
-    /**
-     * @brief 保存索引块到文件
-     */
-    void save_index_block() {
-        std::ofstream file(disk_path, std::ios::binary | std::ios::out | std::ios::in);
-        file.seekp(block_id * BLOCK_SIZE);
-        file.write(reinterpret_cast<const char *>(this), sizeof(IndexBlock));
-        file.close();
+/**
+ * @brief 按版本读取文件的一段
+ * 从当前的文件读出, 打开之后被改写的块换成保存的旧内容
+ * @param id 版本编号
+ * @param offset 起始字节偏移
+ * @param length 最多读取的字节数
+ * @param cursor 打开文件时缓存的区段, 可以为空
+ * @return 读出的内容, 不超过版本的大小
+ */
+std::string VersionTable::read(uint64_t id, uint64_t offset, uint64_t length, Extent *cursor) const {
+    auto it = versions.find(id);
+    if (it == versions.end() || offset >= it->second.size) {
+        return "";
     }
+    const FileVersion &version = it->second;
+    length = std::min(length, version.size - offset);
+    std::string result = read_file_range(Inode::read_inode(version.inode_id), offset, length, cursor);
+    uint64_t end = offset + result.size();
+    for (auto saved = version.saved.lower_bound(static_cast<uint32_t>(offset / geometry.block_size));
+         saved != version.saved.end() && geometry.offset(saved->first) < end; ++saved) {
+        uint64_t begin = std::max(offset, geometry.offset(saved->first));
+        uint64_t stop = std::min(end, geometry.offset(saved->first) + saved->second.size());
+        if (begin < stop) {
+            result.replace(static_cast<size_t>(begin - offset), static_cast<size_t>(stop - begin), saved->second,
+                           static_cast<size_t>(begin - geometry.offset(saved->first)), static_cast<size_t>(stop - begin));
+        }
+    }
+    return result;
+}
 
-    /**
-     * @brief 从文件中读取索引块
-     * @param id 索引块的块号
-     * @return 读取到的索引块
-     */
-    static IndexBlock read_index_block(uint32_t id) {
-        IndexBlock ib;
-        std::ifstream file(disk_path, std::ios::binary | std::ios::in);
-        file.seekg(id * BLOCK_SIZE);
-        file.read(reinterpret_cast<char *>(&ib), sizeof(IndexBlock));
-        file.close();
-        return ib;
+/**
+ * @brief 创建线程池
+ * @param threads 线程数, 包括调用wait的线程; 0表示按CPU核数, 最多WALK_MAX_THREADS个
+ */
+WorkPool::WorkPool(unsigned threads) {
+    if (threads == 0) {
+        threads = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), WALK_MAX_THREADS);
     }
-};
+    for (unsigned k = 0; k < threads; k++) {
+        queues.emplace_back(new Queue());
+    }
+    current() = threads - 1;
+    for (unsigned k = 0; k + 1 < threads; k++) {
+        workers.emplace_back([this, k] {
+            current() = k;
+            while (!stopping.load()) {
+                if (!run_one(k)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+}
 
-struct User {
-    std::string username;
-    uint32_t uid;
-    uint32_t gid;
+/**
+ * @brief 通知线程退出并等待
+ */
+WorkPool::~WorkPool() {
+    stopping.store(true);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
 
-    User() {}
-    User(std::string _username, uint32_t _uid, uint32_t _gid) {
-        username = _username;
-        uid = _uid;
-        gid = _gid;
+/**
+ * @brief 把任务放入当前线程的队列
+ * @param task 任务, 可以继续放入新的任务
+ * @return 是否放入, 排队的任务达到WALK_MAX_QUEUED时返回false, 由调用者直接执行
+ */
+bool WorkPool::spawn(std::function<void()> task) {
+    if (queued.load() >= WALK_MAX_QUEUED) {
+        return false;
     }
-    void set(std::string _username, uint32_t _uid, uint32_t _gid) {
-        username = _username;
-        uid = _uid;
-        gid = _gid;
+    ++queued;
+    ++pending;
+    Queue &queue = *queues[current()];
+    std::lock_guard<std::mutex> guard(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+    return true;
+}
+
+/**
+ * @brief 参与执行, 直到所有任务完成
+ */
+void WorkPool::wait() {
+    while (pending.load() > 0) {
+        if (!run_one(queues.size() - 1)) {
+            std::this_thread::yield();
+        }
     }
-};
+}
 
-//------------------------------------------------------------------------------------------------
-// 函数定义
-//------------------------------------------------------------------------------------------------
+/**
+ * @brief 执行一个任务, 先取自己队尾的任务, 没有时从其他队列的队首窃取
+ * @param self 当前线程的队列
+ * @return 是否执行了任务
+ */
+bool WorkPool::run_one(size_t self) {
+    std::function<void()> task;
+    for (size_t k = 0; k < queues.size() && !task; k++) {
+        Queue &queue = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (k == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task) {
+        return false;
+    }
+    --queued;
+    task();
+    --pending;
+    return true;
+}
 
 /**
- * @brief 将时间戳转为字符串
- * @param time 时间戳
- * @return 当前时区的时间字符串
+ * @brief 当前线程在线程池中的队列编号
  */
-std::string format_time(uint32_t raw_time) {
-    time_t time = static_cast<time_t>(raw_time);
-    struct tm *local_tm = localtime(&time);
-    char local_buffer[80];
-    strftime(local_buffer, 80, "%Y-%m-%d %H:%M:%S", local_tm);
-    return std::string(local_buffer);
+size_t &WorkPool::current() {
+    thread_local size_t index = 0;
+    return index;
+}
+
+/**
+ * @brief 在当前位置写入, 位于文件末尾时先放入追加缓冲
+ * 缓冲的内容只预留块, 空间不足或超出配额时在这里就报告, 写入磁盘时才分配具体的块;
+ * 缓冲达到APPEND_BUFFER_SIZE时把其中的整块写入磁盘, 不满一块的尾部继续留在缓冲中
+ * @param content 写入的内容
+ * @return 是否全部写入, 磁盘空间不足或超出配额时只接受预留得下的部分
+ */
+bool OpenFile::append(const std::string &content) {
+    if (pending.empty()) {
+        Inode file_inode = Inode::read_inode(inode_id);
+        if (offset != file_inode.i_size) {
+            // 改写文件中间的内容, 直接写入
+            DirStats before = file_stats(file_inode);
+            uint64_t written = write_file_range(file_inode, offset, content, &cursor);
+            update_dir_stats(parent_id, before, file_stats(file_inode));
+            offset += written;
+            return written == content.size();
+        }
+        pending_start = offset;
+        pending_since = static_cast<uint32_t>(time(0));
+        mapped = file_inode.is_inline() ? 0 : BlockMap(file_inode.i_indirect).size();
+    }
+    uint64_t end = pending_start + pending.size() + content.size();
+    uint64_t need = (end + geometry.block_size - 1) / geometry.block_size;
+    size_t accepted = content.size();
+    // 超出所有者配额的部分不接受, 缓冲中的内容还没有计入用量
+    Inode owner = Inode::read_inode(inode_id);
+    if (owner.is_inline() && end <= geometry.inline_size()) {
+        need = 0; // 内联数据区放得下, 不需要块
+    }
+    uint64_t allowed = mapped + static_cast<uint64_t>(quota_table.room(owner.i_uid, owner.i_gid));
+    if (need > allowed) {
+        std::cout << __ERROR << "超出磁盘配额" << __NORMAL << std::endl;
+        need = allowed;
+        uint64_t limit = geometry.offset(static_cast<uint32_t>(allowed));
+        uint64_t buffered = pending_start + pending.size();
+        accepted = limit > buffered ? static_cast<size_t>(std::min<uint64_t>(content.size(), limit - buffered)) : 0;
+    }
+    if (need > mapped + reserved && !block_bitmap.reserve(static_cast<uint32_t>(std::min<uint64_t>(need - mapped - reserved, UINT32_MAX)))) {
+        // 预留剩下的所有块, 只接受放得下的内容
+        uint32_t spare = block_bitmap.available();
+        block_bitmap.reserve(spare);
+        reserved += spare;
+        uint64_t limit = geometry.offset(mapped + reserved);
+        uint64_t buffered = pending_start + pending.size();
+        accepted = limit > buffered ? static_cast<size_t>(std::min<uint64_t>(content.size(), limit - buffered)) : 0;
+    } else if (need > mapped + reserved) {
+        reserved = static_cast<uint32_t>(need - mapped);
+    }
+    pending.append(content, 0, accepted);
+    offset += accepted;
+    if (pending.empty()) {
+        pending_since = 0;
+    }
+    bool flushed = pending.size() < APPEND_BUFFER_SIZE || flush(true);
+    return flushed && accepted == content.size();
+}
+
+/**
+ * @brief 把追加缓冲写入磁盘
+ * 整个缓冲只做一次区段分配, 每个区段一次写入, inode和区段树各保存一次
+ * @param whole_blocks 为真时只写到最后一个块边界
+ * @return 是否全部写入, 磁盘空间不足时丢弃写不下的内容
+ */
+bool OpenFile::flush(bool whole_blocks) {
+    size_t count = pending.size();
+    if (whole_blocks) {
+        uint64_t boundary = (pending_start + count) / geometry.block_size * geometry.block_size;
+        count = boundary > pending_start ? static_cast<size_t>(boundary - pending_start) : 0;
+    }
+    if (count == 0) {
+        return true;
+    }
+    // 挂载快照的用户执行命令时也可能触发写入, 写入总是针对实时文件系统
+    int view = snapshot_table.view;
+    snapshot_table.view = -1;
+    // 预留的块交还给分配器, 由这次写入实际分配
+    block_bitmap.unreserve(reserved);
+    reserved = 0;
+    Inode file_inode = Inode::read_inode(inode_id);
+    DirStats before = file_stats(file_inode);
+    uint64_t written = write_file_range(file_inode, pending_start, pending.substr(0, count), &cursor);
+    update_dir_stats(parent_id, before, file_stats(file_inode));
+    snapshot_table.view = view;
+    if (written < count) {
+        pending.clear();
+        offset = file_inode.i_size;
+        return false;
+    }
+    pending.erase(0, count);
+    pending_start += count;
+    mapped = std::max<uint32_t>(mapped, static_cast<uint32_t>((pending_start + geometry.block_size - 1) / geometry.block_size));
+    if (pending.empty()) {
+        pending_since = 0;
+    } else {
+        // 留在缓冲中的尾部重新预留
+        uint32_t need = static_cast<uint32_t>((pending_start + pending.size() + geometry.block_size - 1) / geometry.block_size);
+        if (need > mapped && block_bitmap.reserve(need - mapped)) {
+            reserved = need - mapped;
+        }
+    }
+    return true;
 }
 
 /**
  * @brief 创建或格式化磁盘
- * 初始化磁盘，写入100MB的0x00数据，初始化超级块，修改位图信息，创建根目录
+ * 按给定的几何参数创建稀疏镜像，初始化超级块，修改位图信息，创建根目录
+ * 镜像未写入的区域读出全为0，格式化耗时与镜像大小无关
+ * 参数需要先经过Geometry::check检查
+ * @param fs_size 镜像大小（字节）
+ * @param block_size 块大小（字节）
+ * @param inode_count inode 总数
  */
-void init_disk() {
+void init_disk(uint64_t fs_size, uint32_t block_size, uint32_t inode_count) {
+    // 格式化期间不记日志，丢弃所有未写回的脏块和快照
+    journal.format(0, 0);
+    snapshot_table.clear();
+    orphan_list.head = 0;
+    quota_table.table_block = 0;
+    name_index.clear();
+    geometry = Geometry::layout(fs_size, block_size, inode_count);
     std::filesystem::create_directories(std::filesystem::path(disk_path).parent_path());
-    std::ofstream file(disk_path, std::ios::binary | std::ios::out);
-    // 初始化 写入 100MB 的0x00数据
-    const int fileSize = FS_SIZE;
-    const int bufferSize = 4096;
-    char buffer[bufferSize] = {0};
-    for (int i = 0; i < fileSize; i += bufferSize) {
-        file.write(buffer, bufferSize);
+    // 截断为稀疏镜像，只有元数据区会被实际写入，数据块在首次写入时才补零
+    const uint64_t fileSize = geometry.offset(geometry.block_count);
+    if (!create_sparse_file(disk_path, fileSize)) {
+        std::cout << __ERROR << "无法创建磁盘镜像" << disk_path << __NORMAL << std::endl;
+        return;
     }
-    file.close();
-    // 初始化超级块，修改位图信息
-    SuperBlock sb = {
-        FS_SIZE,
-        BLOCK_SIZE,
-        INODE_COUNT,
-        BLOCK_COUNT,
-        FREE_INODES,
-        FREE_BLOCKS,
-        INODE_BITMAP_START,
-        BLOCK_BITMAP_START,
-        INODE_LIST_START,
-        DATA_BLOCK_START,
-        static_cast<uint32_t>(time(0)),
-        static_cast<uint32_t>(time(0))};
+    // 初始化位图，紧接着元数据区划出日志区
     inode_bitmap.init_bitmap();
     block_bitmap.init_bitmap();
+    uint32_t journal_start = block_bitmap.get_free_run(JOURNAL_BLOCKS);
+    // inode分配树的根, inode表用完后才会挂上inode块
+    IndexBlock tree_ib;
+    tree_ib.block_id = block_bitmap.get_free_block();
+    tree_ib.next_index = UINT32_MAX;
+    tree_ib.save_index_block();
+    inode_bitmap.tree_root = tree_ib.block_id;
+    quota_table.create();
+    // 初始化超级块
+    SuperBlock sb = {
+        static_cast<uint32_t>(fileSize),
+        geometry.block_size,
+        geometry.inode_count,
+        geometry.block_count,
+        geometry.inode_count,
+        geometry.block_count - geometry.data_block_start,
+        geometry.inode_bitmap_start,
+        geometry.block_bitmap_start,
+        geometry.inode_list_start,
+        geometry.data_block_start,
+        static_cast<uint32_t>(time(0)),
+        static_cast<uint32_t>(time(0)),
+        journal_start,
+        JOURNAL_BLOCKS,
+        0,
+        tree_ib.block_id,
+        FS_VERSION,
+        0,
+        static_cast<uint32_t>(fileSize >> 32),
+        0,
+        quota_table.table_block,
+        geometry.inode_size};
     // 创建根目录
     std::ofstream file1(disk_path, std::ios::binary | std::ios::out | std::ios::in);
     Inode root_inode = {
         inode_bitmap.get_free_inode(),  // inode 编号, 表示为位置
-        sizeof(DirBlock),               // 文件大小, 初始化为两个目录项（.和..）
-        2,                              // 文件所占数据块数量, 一个索引块和一个目录块
         1,                              // 链接数
-        block_bitmap.get_free_block(),  // 一级间接块指针 600-102399
         DIR_TYPE,                       // 文件系统标志
+        geometry.block_size,            // 文件大小, 一个目录块
+        1,                              // 文件所占数据块数量, 先计入根映射块, 目录块在映射时计入
+        block_bitmap.get_free_block(),  // 区段树的根节点
         777,                            // 文件权限
         0,                              // 用户 ID
         0,                              // 组 ID
@@ -540,16 +4261,298 @@ void init_disk() {
         static_cast<uint32_t>(time(0)), // 修改时间
         static_cast<uint32_t>(time(0))  // 访问时间
     };
+    BlockMap root_map(root_inode.i_indirect);
+    root_map.init();
+    uint32_t root_block = root_map.map(0, root_inode);
+    root_map.save();
     root_inode.save_inode();
-    IndexBlock root_ib(root_inode.i_indirect);
-    root_ib.save_index_block();
     DirBlock root_db;
     root_db.init_DirBlock(root_inode.i_id, root_inode.i_id);
-    root_db.save_dir_block(root_ib.index[0]);
+    DirStats root_stats;
+    root_stats.blocks = root_inode.i_blocks;
+    root_db.set_stats(root_stats);
+    root_db.save_dir_block(root_block);
+    quota_table.charge(root_inode, root_inode.i_blocks, 1);
     // 添加一个root用户
     adduser("root", "240be518fabd2724ddb6f04eeb1da5967448d7e831c08c8fa822809f74c720a9", 0, 0);
-    // 最后保存超级块
+    // 最后保存超级块，并启用日志
     sb.save_super_block(disk_path, 0);
+    journal.format(journal_start, JOURNAL_BLOCKS);
+}
+
+/**
+ * @brief 在线扩容磁盘
+ * 先扩展镜像文件，再把新区域中各组的位图块直接写入并落盘，这些块在超级块更新前不属于文件系统；
+ * 最后在当前事务中更新超级块，新容量随事务提交一起生效。已有数据不移动，任何一步崩溃都只会留下旧的文件系统
+ * @param fs_size 新的镜像大小（字节）
+ * @param shell_output 输出信息
+ * @return 是否扩容成功
+ */
+bool resize_disk(uint64_t fs_size, std::string &shell_output) {
+    uint64_t new_count = fs_size / geometry.block_size;
+    if (new_count > MAX_BLOCK_COUNT) {
+        shell_output += __ERROR + "镜像最多" + std::to_string(MAX_BLOCK_COUNT) + "个块" + __NORMAL + "\n";
+        return false;
+    }
+    if (new_count <= geometry.block_count) {
+        shell_output += __ERROR + "新的大小必须大于当前大小" + __NORMAL + "\n";
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::resize_file(disk_path, geometry.offset(static_cast<uint32_t>(new_count)), ec);
+    if (ec) {
+        shell_output += __ERROR + "无法扩展磁盘镜像: " + ec.message() + __NORMAL + "\n";
+        return false;
+    }
+    // 新区域中每组的第一个块是这一组的位图，初始时只有它自己被占用
+    uint32_t old_count = geometry.block_count;
+    uint32_t first_group = geometry.bitmap_blocks();
+    std::vector<uint8_t> group(geometry.block_size, 0);
+    group[0] = 1;
+    for (uint32_t n = first_group; geometry.bitmap_block(n) < new_count; n++) {
+        uint32_t block_id = geometry.bitmap_block(n);
+        if (block_id >= old_count) {
+            journal.write_data(geometry.offset(block_id), group.data(), group.size());
+        }
+    }
+    std::FILE *fp = std::fopen(disk_path.c_str(), "rb+");
+    if (fp != nullptr) {
+        sync_file(fp);
+        std::fclose(fp);
+    }
+    geometry.block_count = static_cast<uint32_t>(new_count);
+    block_bitmap.bitmap.extend(geometry.block_count);
+    block_bitmap.count_groups();
+    SuperBlock sb = SuperBlock::read_super_block();
+    sb.set_image_size(geometry.offset(geometry.block_count));
+    sb.block_count = geometry.block_count;
+    sb.save_super_block();
+    return true;
+}
+
+/**
+ * @brief 把旧格式的块映射改写为区段树
+ * 按旧格式列出数据块并释放根以外的映射块，再把根映射块改写为区段树，连续的数据块合并为一个区段
+ * @param inode 文件或目录的inode
+ * @param version 旧映射格式对应的磁盘版本
+ */
+void convert_block_map(Inode &inode, uint32_t version) {
+    BlockMap old_map(inode.i_indirect, version);
+    std::vector<uint32_t> blocks = old_map.blocks();
+    for (uint32_t block_id : old_map.legacy_blocks()) {
+        block_bitmap.free_block(block_id);
+        inode.i_blocks--;
+    }
+    BlockMap block_map(inode.i_indirect);
+    block_map.init();
+    for (uint32_t n = 0; n < blocks.size(); n++) {
+        block_map.map(n, inode, blocks[n]);
+    }
+    block_map.save();
+    inode.save_inode();
+}
+
+/**
+ * @brief 把旧格式的磁盘升级到当前版本
+ * 版本0的目录项中inode编号为16位，逐个目录改写为32位的目录项，并创建inode分配树；
+ * 版本1、2的块映射是索引块链表或多级索引，逐个inode改写为区段树。
+ * 版本3的inode中文件大小是32位的，逐个inode改写为64位大小的格式。
+ * 版本4的目录没有子树统计，从根目录开始重新计算。
+ * 版本5没有配额表，分配配额表后遍历inode统计每个用户和组的用量。
+ * 每UPGRADE_BATCH个inode作为一个事务，连同进度一起提交，中途崩溃后下次挂载从进度处继续
+ */
+void upgrade_disk() {
+    SuperBlock sb = SuperBlock::read_super_block();
+    if (sb.version >= FS_VERSION) {
+        return;
+    }
+    std::cout << "正在升级磁盘格式..." << std::endl;
+    if (sb.version < FS_VERSION_INODE32) {
+        for (uint32_t id = sb.upgrade_cursor; id < geometry.inode_count;) {
+            journal.begin();
+            for (uint32_t end = std::min(id + UPGRADE_BATCH, geometry.inode_count); id < end; id++) {
+                if (!inode_bitmap.bitmap.test(id)) {
+                    continue;
+                }
+                Inode inode = Inode::read_inode(id);
+                if (inode.i_type != DIR_TYPE) {
+                    continue;
+                }
+                for (uint32_t block_id : BlockMap(inode.i_indirect, sb.version).blocks()) {
+                    DirBlock::read_legacy_dir_block(block_id).save_dir_block(block_id);
+                }
+            }
+            sb.upgrade_cursor = id;
+            journal.write(geometry.offset(0), &sb, sizeof(SuperBlock));
+            journal.commit();
+            journal.flush();
+        }
+        journal.begin();
+        IndexBlock tree_ib;
+        tree_ib.block_id = block_bitmap.get_free_block();
+        tree_ib.next_index = UINT32_MAX;
+        tree_ib.save_index_block();
+        sb.inode_tree = tree_ib.block_id;
+        sb.version = FS_VERSION_INODE32;
+        sb.upgrade_cursor = 0;
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+    }
+    if (sb.version < FS_VERSION_EXTENT) {
+        for (uint32_t id = sb.upgrade_cursor; id < inode_bitmap.capacity();) {
+            journal.begin();
+            for (uint32_t end = std::min(id + UPGRADE_BATCH, inode_bitmap.capacity()); id < end; id++) {
+                if (inode_bitmap.is_used(id)) {
+                    Inode inode = Inode::read_inode(id);
+                    convert_block_map(inode, sb.version);
+                }
+            }
+            sb.upgrade_cursor = id;
+            journal.write(geometry.offset(0), &sb, sizeof(SuperBlock));
+            journal.commit();
+            journal.flush();
+        }
+        journal.begin();
+        sb.version = FS_VERSION_EXTENT;
+        sb.upgrade_cursor = 0;
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+    }
+    if (sb.version < FS_VERSION_SIZE64) {
+        for (uint32_t id = sb.upgrade_cursor; id < inode_bitmap.capacity();) {
+            journal.begin();
+            for (uint32_t end = std::min(id + UPGRADE_BATCH, inode_bitmap.capacity()); id < end; id++) {
+                if (inode_bitmap.is_used(id)) {
+                    // 此时的版本号仍是旧的, save_inode会按旧格式保存, 直接写入新格式
+                    Inode inode = Inode::read_legacy_inode(id);
+                    journal.write(inode_bitmap.inode_offset(id), &inode, sizeof(Inode));
+                }
+            }
+            sb.upgrade_cursor = id;
+            journal.write(geometry.offset(0), &sb, sizeof(SuperBlock));
+            journal.commit();
+            journal.flush();
+        }
+        journal.begin();
+        sb.version = FS_VERSION_SIZE64;
+        sb.upgrade_cursor = 0;
+        sb.set_image_size(geometry.offset(geometry.block_count));
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+        geometry.version = sb.version;
+    }
+    if (sb.version < FS_VERSION_DIR_STATS) {
+        rebuild_dir_stats();
+        journal.flush();
+        journal.begin();
+        sb.version = FS_VERSION_DIR_STATS;
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+        geometry.version = sb.version;
+    }
+    if (sb.version < FS_VERSION_QUOTA) {
+        journal.begin();
+        quota_table.create();
+        quota_table.rebuild();
+        sb.quota_table = quota_table.table_block;
+        sb.version = FS_VERSION_QUOTA;
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+        geometry.version = sb.version;
+    }
+    if (sb.version < FS_VERSION_INLINE) {
+        // 旧磁盘的inode表没有内联数据区, 文件仍然按区段映射
+        journal.begin();
+        sb.inode_size = INODE_SIZE;
+        sb.version = FS_VERSION_INLINE;
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+        geometry.version = sb.version;
+    }
+    if (sb.version < FS_VERSION_COMPRESS) {
+        // 旧磁盘上没有压缩的文件, 只需改写版本号
+        journal.begin();
+        sb.version = FS_VERSION_COMPRESS;
+        sb.save_super_block();
+        journal.commit();
+        journal.flush();
+        geometry.version = sb.version;
+    }
+    std::cout << "磁盘格式已升级到版本" << FS_VERSION << std::endl;
+}
+
+/**
+ * @brief 统计普通文件的区段数, 区段越多说明碎片越多
+ * @return 统计信息
+ */
+std::string extent_summary() {
+    uint32_t files = 0, inlined = 0;
+    uint64_t extents = 0;
+    size_t most = 0;
+    for (uint32_t id = 0; id < inode_bitmap.capacity(); id++) {
+        if (!inode_bitmap.is_used(id)) {
+            continue;
+        }
+        Inode inode = Inode::read_inode(id);
+        if (inode.i_type != FILE_TYPE) {
+            continue;
+        }
+        files++;
+        if (inode.is_inline()) {
+            inlined++;
+            continue;
+        }
+        size_t count = BlockMap(inode.i_indirect).extents().size();
+        extents += count;
+        most = std::max(most, count);
+    }
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2);
+    oss << "文件数: \t" << files << "\t\t平均区段数: \t" << (files == 0 ? 0.0 : static_cast<double>(extents) / files) << std::endl;
+    oss << "总区段数: \t" << extents << "\t\t最多区段数: \t" << most << std::endl;
+    oss << "内联文件数: \t" << inlined << "\t\t内联区大小: \t" << geometry.inline_size() << " B" << std::endl;
+    return oss.str();
+}
+
+/**
+ * @brief 统计压缩文件的压缩比, 以及启动以来压缩和解压的耗时
+ * 压缩比是压缩文件的总大小与占用的数据块之比, 不计区段树的节点
+ * @return 统计信息
+ */
+std::string compression_summary() {
+    uint32_t files = 0;
+    uint64_t raw = 0, stored = 0;
+    for (uint32_t id = 0; id < inode_bitmap.capacity(); id++) {
+        if (!inode_bitmap.is_used(id)) {
+            continue;
+        }
+        Inode inode = Inode::read_inode(id);
+        if (!inode.is_compressed()) {
+            continue;
+        }
+        files++;
+        raw += inode.i_size;
+        if (!inode.is_inline()) {
+            for (const Extent &extent : BlockMap(inode.i_indirect).extents()) {
+                stored += geometry.offset(extent.length);
+            }
+        }
+    }
+    // 每秒处理的MB数
+    auto speed = [](uint64_t bytes, uint64_t ns) { return ns == 0 ? 0.0 : bytes * 1000.0 / ns; };
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(2);
+    oss << "压缩文件数: \t" << files << "\t\t压缩比: \t" << (stored == 0 ? 0.0 : static_cast<double>(raw) / stored) << std::endl;
+    oss << "压缩前大小: \t" << raw << " B\t占用空间: \t" << stored << " B" << std::endl;
+    oss << "压缩耗时: \t" << compress_stats.pack_ns / 1000000.0 << " ms\t压缩速度: \t" << speed(compress_stats.packed_in, compress_stats.pack_ns) << " MB/s" << std::endl;
+    oss << "解压耗时: \t" << compress_stats.unpack_ns / 1000000.0 << " ms\t解压速度: \t" << speed(compress_stats.unpacked, compress_stats.unpack_ns) << " MB/s" << std::endl;
+    return oss.str();
 }
 
 /**
@@ -560,61 +4563,61 @@ void init_disk() {
  * @return 目录的内容
  */
 std::string show_directory(uint32_t inode_id,User cur_user, bool show_recursion) {
-    std::vector<uint32_t> sons;
-    std::ostringstream result;
-    Inode inode = Inode::read_inode(inode_id);
-    if (inode.i_type != DIR_TYPE) {
-        return "";
-    }
-    std::string path = get_absolute_path(inode_id);
-    result << __SUCCESS << "目录: " << path << __NORMAL << std::endl;
-
-    IndexBlock index_block = IndexBlock::read_index_block(inode.i_indirect);
-    result << std::left << std::setw(18) << "name" <<std::setw(10)<<"owner"<< std::setw(10) << "mode" << std::setw(10) << "size" << std::setw(10) << "last change" << std::endl;
-    result <<std::setfill('-')<<std::setw(68)<<"-"<<std::setfill(' ')<<std::endl;
-    // std::cout << std::left << std::setw(10) << "name" << std::setw(10) << "mode" << std::setw(10) << "size" << std::setw(10) << "last change" << std::endl;
-    for (uint32_t i = 0; i < 254; ++i) { // 访问索引块
-        if (index_block.index[i] == UINT32_MAX) {
-            break;
+    // 列出一个目录, 有权限读的子目录放入sons
+    auto list = [&cur_user](uint32_t dir_id, std::vector<uint32_t> &sons) -> std::string {
+        std::ostringstream result;
+        Inode inode = Inode::read_inode(dir_id);
+        if (inode.i_type != DIR_TYPE) {
+            return "";
         }
-        DirBlock dir_block = DirBlock::read_dir_block(index_block.index[i]);
-        for (int j = 0; j < 32; ++j) {
-            if (dir_block.entries[j].type == UNDEFINE_TYPE) {
-                continue;
-            }
-            Inode temp_inode = Inode::read_inode(dir_block.entries[j].inode_id);
-            std::string print_name = std::string(dir_block.entries[j].name);
-            std::string path_color = __NORMAL;
-            if (dir_block.entries[j].type == DIR_TYPE) {
-                if (std::string(dir_block.entries[j].name) != "." && std::string(dir_block.entries[j].name) != "..") {
-                    Inode __inode = Inode::read_inode(dir_block.entries[j].inode_id);
-                    // 判断是否有权限读这个子目录
-                    if (!is_able_to_read(__inode.i_id, cur_user)) {
-                        continue;
+        std::string path = get_absolute_path(dir_id);
+        result << __SUCCESS << "目录: " << path << __NORMAL << std::endl;
+
+        result << std::left << std::setw(18) << "name" <<std::setw(10)<<"owner"<< std::setw(10) << "mode" << std::setw(10) << "size" << std::setw(9) << "extents" << std::setw(10) << "last change" << std::endl;
+        result <<std::setfill('-')<<std::setw(77)<<"-"<<std::setfill(' ')<<std::endl;
+        // std::cout << std::left << std::setw(10) << "name" << std::setw(10) << "mode" << std::setw(10) << "size" << std::setw(10) << "last change" << std::endl;
+        for (uint32_t block_id : BlockMap(inode.i_indirect).blocks()) { // 访问目录块
+            DirBlock dir_block = DirBlock::read_dir_block(block_id);
+            for (uint32_t j = 0; j < geometry.dir_entries(); ++j) {
+                if (dir_block.entries[j].type == UNDEFINE_TYPE) {
+                    continue;
+                }
+                Inode temp_inode = Inode::read_inode(dir_block.entries[j].inode_id);
+                std::string print_name = std::string(dir_block.entries[j].name);
+                std::string path_color = __NORMAL;
+                if (dir_block.entries[j].type == DIR_TYPE) {
+                    if (std::string(dir_block.entries[j].name) != "." && std::string(dir_block.entries[j].name) != "..") {
+                        Inode __inode = Inode::read_inode(dir_block.entries[j].inode_id);
+                        // 判断是否有权限读这个子目录
+                        if (!is_able_to_read(__inode.i_id, cur_user)) {
+                            continue;
+                        }
+                        sons.push_back(dir_block.entries[j].inode_id);
                     }
-                    sons.push_back(dir_block.entries[j].inode_id);
+                    path_color = __PATH;
+                    print_name += "/";
                 }
-                path_color = __PATH;
-                print_name += "/";
-            }
-            std::string user_name =get_username(temp_inode.i_uid);
-            std::string name_color = __NORMAL;
-            if (user_name == cur_user.username) {
-                name_color = __USER;
+                std::string user_name =get_username(temp_inode.i_uid);
+                std::string name_color = __NORMAL;
+                if (user_name == cur_user.username) {
+                    name_color = __USER;
+                }
+                result<<path_color<< std::left << std::setw(18) << print_name<<__NORMAL 
+                <<name_color<<std::setw(10)<<user_name <<__NORMAL
+                << std::setw(10) << std::to_string(temp_inode.permission()) + (temp_inode.is_compressed() ? "c" : "") << std::setw(10) << temp_inode.i_size << std::setw(9) << (temp_inode.is_inline() ? 0 : BlockMap(temp_inode.i_indirect).extents().size())
+                << std::setw(10) << format_time(temp_inode.i_mtime) << std::endl;
+                // std::cout << std::left << std::setw(10) << print_name << std::setw(10) << temp_inode.i_mode << std::setw(10) << temp_inode.i_size << std::setw(10) << format_time(temp_inode.i_mtime) << std::endl;
             }
-            result<<path_color<< std::left << std::setw(18) << print_name<<__NORMAL 
-            <<name_color<<std::setw(10)<<user_name <<__NORMAL
-            << std::setw(10) << temp_inode.i_mode << std::setw(10) << temp_inode.i_size << std::setw(10) << format_time(temp_inode.i_mtime) << std::endl;
-            // std::cout << std::left << std::setw(10) << print_name << std::setw(10) << temp_inode.i_mode << std::setw(10) << temp_inode.i_size << std::setw(10) << format_time(temp_inode.i_mtime) << std::endl;
-        }
-    }
-    std::string resultstr = result.str()+ "\n";
-    if (show_recursion) {
-        for (auto son_inode_id : sons) {
-            resultstr += show_directory(son_inode_id, cur_user,show_recursion);
         }
+        return result.str() + "\n";
+    };
+    if (!show_recursion) {
+        std::vector<uint32_t> sons;
+        return list(inode_id, sons);
     }
-    return resultstr;
+    // 递归显示时各个子目录并行列出, 再按先序拼接
+    TreeWalk<std::string> walk(list, [](std::string &into, std::string &from) { into += from; });
+    return walk.run(inode_id);
 }
 
 /**
@@ -660,36 +4663,24 @@ bool is_path_dir(const std::string &path, uint32_t &purpose_id, std::string &_sh
     }
     for (const auto &p : path_list) {
         temp_inode = Inode::read_inode(temp_inodeid); // 开始目录的 inode
-        IndexBlock temp_ib = IndexBlock::read_index_block(temp_inode.i_indirect);
 
         bool found = false;
-        while (true) {
-            for (uint32_t i = 0; i < 254; ++i) { // 访问索引块
-                if (temp_ib.index[i] == UINT32_MAX) {
-                    break;
-                }
-
-                // 读取目录块，遍历目录项，找到 p
-                DirBlock dir_block = DirBlock::read_dir_block(temp_ib.index[i]);
-                for (int j = 0; j < 32; ++j) {
-                    if (dir_block.entries[j].type == UNDEFINE_TYPE) {
-                        continue;
-                    }
-                    if (dir_block.entries[j].name == p && dir_block.entries[j].type == DIR_TYPE) {
-                        temp_inodeid = dir_block.entries[j].inode_id;
-                        found = true;
-                        break;
-                    }
+        for (uint32_t block_id : BlockMap(temp_inode.i_indirect).blocks()) {
+            // 读取目录块，遍历目录项，找到 p
+            DirBlock dir_block = DirBlock::read_dir_block(block_id);
+            for (uint32_t j = 0; j < geometry.dir_entries(); ++j) {
+                if (dir_block.entries[j].type == UNDEFINE_TYPE) {
+                    continue;
                 }
-                if (found) {
+                if (dir_block.entries[j].name == p && dir_block.entries[j].type == DIR_TYPE) {
+                    temp_inodeid = dir_block.entries[j].inode_id;
+                    found = true;
                     break;
                 }
             }
-            if (found || temp_ib.next_index == UINT32_MAX) {
+            if (found) {
                 break;
             }
-            // 读取下一个 IndexBlock
-            temp_ib = IndexBlock::read_index_block(temp_ib.next_index);
         }
 
         if (!found) {
@@ -738,33 +4729,23 @@ bool is_dir_exit(const std::string &path, uint32_t &purpose_id) {
     }
     for (const auto &p : path_list) {
         temp_inode = Inode::read_inode(temp_inodeid); // 开始目录的 inode
-        IndexBlock temp_ib = IndexBlock::read_index_block(temp_inode.i_indirect);
 
         bool found = false;
-        while (true) {
-            for (uint32_t i = 0; i < 254; ++i) {
-                if (temp_ib.index[i] == UINT32_MAX) {
-                    break;
-                }
-                DirBlock dir_block = DirBlock::read_dir_block(temp_ib.index[i]);
-                for (int j = 0; j < 32; ++j) {
-                    if (dir_block.entries[j].type == UNDEFINE_TYPE) {
-                        continue;
-                    }
-                    if (dir_block.entries[j].name == p && dir_block.entries[j].type == DIR_TYPE) {
-                        temp_inodeid = dir_block.entries[j].inode_id;
-                        found = true;
-                        break;
-                    }
+        for (uint32_t block_id : BlockMap(temp_inode.i_indirect).blocks()) {
+            DirBlock dir_block = DirBlock::read_dir_block(block_id);
+            for (uint32_t j = 0; j < geometry.dir_entries(); ++j) {
+                if (dir_block.entries[j].type == UNDEFINE_TYPE) {
+                    continue;
                 }
-                if (found) {
+                if (dir_block.entries[j].name == p && dir_block.entries[j].type == DIR_TYPE) {
+                    temp_inodeid = dir_block.entries[j].inode_id;
+                    found = true;
                     break;
                 }
             }
-            if (found || temp_ib.next_index == UINT32_MAX) {
+            if (found) {
                 break;
             }
-            temp_ib = IndexBlock::read_index_block(temp_ib.next_index);
         }
         if (!found) {
             return false;
@@ -779,33 +4760,22 @@ bool is_dir_exit(const std::string &path, uint32_t &purpose_id) {
  * @param name 文件名
  * @param cur_inode 当前目录的inode
  */
-bool is_file_exit(const std::string &name, Inode cur_inode) {
-    IndexBlock cur_ib = IndexBlock::read_index_block(cur_inode.i_indirect);
-
-    bool found = false;
-    while (true) {
-        for (uint32_t i = 0; i < 254; ++i) {
-            if (cur_ib.index[i] == UINT32_MAX) {
-                break;
-            }
-            DirBlock dir_block = DirBlock::read_dir_block(cur_ib.index[i]);
-            for (int j = 0; j < 32; ++j) {
-                if (dir_block.entries[j].type == UNDEFINE_TYPE) {
-                    continue;
-                }
-                if (dir_block.entries[j].name == name && dir_block.entries[j].type == FILE_TYPE) {
-                    found = true;
-                    break;
-                }
+bool is_file_exit(const std::string &name, Inode cur_inode) {
+    bool found = false;
+    for (uint32_t block_id : BlockMap(cur_inode.i_indirect).blocks()) {
+        DirBlock dir_block = DirBlock::read_dir_block(block_id);
+        for (uint32_t j = 0; j < geometry.dir_entries(); ++j) {
+            if (dir_block.entries[j].type == UNDEFINE_TYPE) {
+                continue;
             }
-            if (found) {
+            if (dir_block.entries[j].name == name && dir_block.entries[j].type == FILE_TYPE) {
+                found = true;
                 break;
             }
         }
-        if (found || cur_ib.next_index == UINT32_MAX) {
+        if (found) {
             break;
         }
-        cur_ib = IndexBlock::read_index_block(cur_ib.next_index);
     }
     if (!found) {
         return false;
@@ -813,6 +4783,27 @@ bool is_file_exit(const std::string &name, Inode cur_inode) {
     return true;
 }
 
+/**
+ * @brief 在目录中查找指向某个子目录的目录项名
+ * @param dir_inode 目录的inode
+ * @param inode_id 子目录的inode_id
+ * @param name 找到的目录项名
+ * @return 是否找到
+ */
+bool get_entry_name(const Inode &dir_inode, uint32_t inode_id, std::string &name) {
+    for (uint32_t block_id : BlockMap(dir_inode.i_indirect).blocks()) {
+        DirBlock cur_db = DirBlock::read_dir_block(block_id);
+        for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
+            const DirEntry &entry = cur_db.entries[j];
+            if (entry.type == DIR_TYPE && entry.inode_id == inode_id && std::string(entry.name) != "." && std::string(entry.name) != "..") {
+                name = entry.name;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 /**
  * @brief 获取绝对路径
  * @param inode_id 目标文件夹的id
@@ -827,22 +4818,17 @@ std::string get_absolute_path(uint32_t inode_id) {
     std::string path = "/";
     Inode inode = Inode::read_inode(inode_id);
     while (inode.i_id != 0) {
-        IndexBlock index_block = IndexBlock::read_index_block(inode.i_indirect);
-        DirBlock dir_block = DirBlock::read_dir_block(index_block.index[0]);
+        DirBlock dir_block = DirBlock::read_dir_block(BlockMap(inode.i_indirect).lookup(0));
         Inode parent_inode;
         bool found = false;
-        for (int i = 0; i < 32; i++) {
-            // 注意写条件 char[28] 和 ""
+        for (uint32_t i = 0; i < geometry.dir_entries(); i++) {
+            // 注意写条件 char[] 和 ""
             if (std::string(dir_block.entries[i].name) == "..") {
                 parent_inode = Inode::read_inode(dir_block.entries[i].inode_id);
-                IndexBlock parent_ib = IndexBlock::read_index_block(parent_inode.i_indirect);
-                DirBlock parent_db = DirBlock::read_dir_block(parent_ib.index[0]);
-                for (int j = 0; j < 32; j++) {
-                    if (parent_db.entries[j].inode_id == inode.i_id) {
-                        path = "/" + std::string(parent_db.entries[j].name) + path;
-                        found = true;
-                        break;
-                    }
+                std::string name;
+                if (get_entry_name(parent_inode, inode.i_id, name)) {
+                    path = "/" + name + path;
+                    found = true;
                 }
                 break;
             }
@@ -858,13 +4844,13 @@ std::string get_absolute_path(uint32_t inode_id) {
 
 /**
  * @brief 确定目录名是否合法
- * 目录名不能包含/，且长度不能超过28，且不能为.和..
+ * 目录名不能包含/，且长度不能超过MAX_NAME_LEN，且不能为.和..
  * @param dir_name 目录名
  * @return True 或者 False
  */
 bool is_valid_dir_name(const std::string &dir_name) {
-    // 目录不能包含 / ，长度不能超过28
-    if (dir_name.find("/") != std::string::npos || dir_name.size() > 28) {
+    // 目录不能包含 / ，长度不能超过MAX_NAME_LEN
+    if (dir_name.find("/") != std::string::npos || dir_name.size() > MAX_NAME_LEN) {
         return false;
     } else {
         return true;
@@ -880,50 +4866,88 @@ bool is_valid_dir_name(const std::string &dir_name) {
  * @return 下一级目录的inode_id
  */
 uint32_t make_dir_help(const std::string &dir_name, Inode &cur_inode, User cur_user, uint32_t mode) {
-    IndexBlock cur_ib = IndexBlock::read_index_block(cur_inode.i_indirect);
-    bool write_flag = false;
+    // 新目录分散到各个块组, 之后它下面的文件留在这个块组中
+    uint32_t group = inode_bitmap.dir_group();
     Inode new_inode = {
-        inode_bitmap.get_free_inode(),
-        sizeof(DirBlock),
-        2,
+        inode_bitmap.get_free_inode(group),
         1,
-        block_bitmap.get_free_block(),
         DIR_TYPE,
+        geometry.block_size,
+        1,
+        block_bitmap.get_free_block(geometry.group_start(group)),
         mode,
         cur_user.uid,
         cur_user.gid,
         static_cast<uint32_t>(time(0)),
         static_cast<uint32_t>(time(0)),
         static_cast<uint32_t>(time(0))};
+    BlockMap new_map(new_inode.i_indirect);
+    new_map.init();
+    uint32_t new_block = new_map.map(0, new_inode);
+    new_map.save();
     new_inode.save_inode();
-    IndexBlock new_ib(new_inode.i_indirect);
-    new_ib.save_index_block();
     DirBlock new_db;
     // 初始化目录项, 当前目录和父目录
     new_db.init_DirBlock(cur_inode.i_id, new_inode.i_id);
-    new_db.save_dir_block(new_ib.index[0]);
-    // 访问索引块的所有目录数据块，写入新目录dirname停止
-    for (uint32_t i = 0; i < 254; i++) {
-        if (cur_ib.index[i] == UINT32_MAX) {
-            break;
+    DirStats stats;
+    stats.blocks = new_inode.i_blocks;
+    new_db.set_stats(stats);
+    new_db.save_dir_block(new_block);
+    quota_table.charge(new_inode, new_inode.i_blocks, 1);
+    add_dir_entry(cur_inode, new_inode.i_id, DIR_TYPE, dir_name);
+    name_index.add(dir_name, new_inode, cur_inode.i_id);
+    stats.dirs = 1;
+    update_dir_stats(cur_inode.i_id, DirStats(), stats);
+    // 更修父目录的修改时间
+    cur_inode.i_mtime = static_cast<uint32_t>(time(0));
+    cur_inode.save_inode();
+    return new_inode.i_id;
+}
+
+/**
+ * @brief 向目录中添加目录项
+ * 已有的目录块都满时，在块映射的下一个逻辑块上开辟新的目录块。
+ * 只修改dir_inode的大小和块数，由调用者保存
+ * @param dir_inode 目录的inode
+ * @param inode_id 目录项指向的inode
+ * @param type 文件类型
+ * @param name 文件名
+ * @return 是否添加成功
+ */
+bool add_dir_entry(Inode &dir_inode, uint32_t inode_id, uint8_t type, const std::string &name) {
+    BlockMap block_map(dir_inode.i_indirect);
+    for (uint32_t n = 0;; n++) {
+        uint32_t block_id = block_map.lookup(n);
+        if (block_id == UINT32_MAX) {
+            DirStats before;
+            before.blocks = dir_inode.i_blocks;
+            block_id = block_map.map(n, dir_inode);
+            block_map.save();
+            if (block_id == UINT32_MAX) {
+                return false;
+            }
+            DirStats after;
+            after.blocks = dir_inode.i_blocks;
+            update_dir_stats(dir_inode.i_id, before, after);
+            quota_table.charge(dir_inode, static_cast<int64_t>(after.blocks) - before.blocks, 0);
+            DirBlock new_db;
+            for (auto &entry : new_db.entries) {
+                entry.set(UINT32_MAX, UNDEFINE_TYPE, "");
+            }
+            new_db.entries[0].set(inode_id, type, name.c_str());
+            new_db.save_dir_block(block_id);
+            dir_inode.i_size += geometry.block_size;
+            return true;
         }
-        DirBlock cur_db = DirBlock::read_dir_block(cur_ib.index[i]);
-        for (int j = 0; j < 32; j++) {
+        DirBlock cur_db = DirBlock::read_dir_block(block_id);
+        for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
             if (cur_db.entries[j].type == UNDEFINE_TYPE) {
-                cur_db.entries[j].set(new_inode.i_id, DIR_TYPE, dir_name.c_str());
-                write_flag = true;
-                break;
+                cur_db.entries[j].set(inode_id, type, name.c_str());
+                cur_db.save_dir_block(block_id);
+                return true;
             }
         }
-        if (write_flag) {
-            cur_db.save_dir_block(cur_ib.index[i]);
-            break;
-        }
     }
-    // 更修父目录的修改时间
-    cur_inode.i_mtime = static_cast<uint32_t>(time(0));
-    cur_inode.save_inode();
-    return new_inode.i_id;
 }
 
 /**
@@ -933,31 +4957,16 @@ uint32_t make_dir_help(const std::string &dir_name, Inode &cur_inode, User cur_u
  * @return 文件的inode_id
  */
 uint32_t get_file_inode_id(const std::string &file_name, Inode &dir_inode) {
-    IndexBlock cur_ib = IndexBlock::read_index_block(dir_inode.i_indirect);
-    bool found = false;
-    while (true) {
-        for (uint32_t i = 0; i < 254; i++) {
-            if (cur_ib.index[i] == UINT32_MAX) {
-                break;
-            }
-            DirBlock cur_db = DirBlock::read_dir_block(cur_ib.index[i]);
-            for (int j = 0; j < 32; j++) {
-                if (cur_db.entries[j].type == UNDEFINE_TYPE) {
-                    continue;
-                }
-                if (cur_db.entries[j].name == file_name && cur_db.entries[j].type == FILE_TYPE) {
-                    found = true;
-                    return cur_db.entries[j].inode_id;
-                }
+    for (uint32_t block_id : BlockMap(dir_inode.i_indirect).blocks()) {
+        DirBlock cur_db = DirBlock::read_dir_block(block_id);
+        for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
+            if (cur_db.entries[j].type == UNDEFINE_TYPE) {
+                continue;
             }
-            if (found) {
-                break;
+            if (cur_db.entries[j].name == file_name && cur_db.entries[j].type == FILE_TYPE) {
+                return cur_db.entries[j].inode_id;
             }
         }
-        if (found || cur_ib.next_index == UINT32_MAX) {
-            break;
-        }
-        cur_ib = IndexBlock::read_index_block(cur_ib.next_index);
     }
     return UINT32_MAX;
 }
@@ -978,25 +4987,7 @@ std::string read_file(std::string file_path, std::string file_name) {
     if (is_file_exit(file_name, dir_inode)) {
         // 获取并读取文件inode
         Inode file_inode = Inode::read_inode(get_file_inode_id(file_name, dir_inode));
-        int file_size = file_inode.i_size;
-        // 读取文件内容并转化为字符串
-        std::string file_content;
-        IndexBlock file_ib = IndexBlock::read_index_block(file_inode.i_indirect);
-        int bytes_read = 0;
-        for (uint32_t i = 0; i < 254 && bytes_read < file_size; i++) {
-            if (file_ib.index[i] == UINT32_MAX) {
-                break;
-            }
-            char buffer[BLOCK_SIZE];
-            std::ifstream file(disk_path, std::ios::binary | std::ios::in);
-            file.seekg(file_ib.index[i] * BLOCK_SIZE);
-            int bytes_to_read = std::min(BLOCK_SIZE, file_size - bytes_read);
-            file.read(buffer, bytes_to_read);
-            file_content.append(buffer, bytes_to_read);
-            bytes_read += bytes_to_read;
-            file.close();
-        }
-
+        std::string file_content = read_file_range(file_inode, 0, file_inode.i_size);
         if (file_content.empty()) {
             return __SUCCESS+"it is empty";
         }
@@ -1007,6 +4998,101 @@ std::string read_file(std::string file_path, std::string file_name) {
     }
 }
 
+/**
+ * @brief 找出覆盖逻辑块[first, last)的区段
+ * 范围落在缓存的区段中时不查区段树，否则查询后把最后一个区段记为新的缓存
+ * @param file_inode 文件的inode
+ * @param first 第一个逻辑块
+ * @param last 最后一个逻辑块之后
+ * @param cursor 打开文件时缓存的区段, 可以为空
+ * @return 区段列表
+ */
+static std::vector<Extent> find_extents(const Inode &file_inode, uint32_t first, uint32_t last, Extent *cursor) {
+    if (cursor != nullptr && cursor->length > 0 && cursor->logical <= first && last <= cursor->logical + cursor->length) {
+        return {*cursor};
+    }
+    std::vector<Extent> extents = BlockMap(file_inode.i_indirect).extents(first, last);
+    if (cursor != nullptr && !extents.empty()) {
+        *cursor = extents.back();
+    }
+    return extents;
+}
+
+/**
+ * @brief 读取文件的一段内容
+ * 只取出覆盖这一段的区段，每个区段一次读出，耗时与文件大小无关; 内联的文件直接从inode之后读出, 压缩的文件只解压覆盖的簇
+ * @param file_inode 文件的inode
+ * @param offset 起始字节偏移
+ * @param length 读取的字节数, 超出文件末尾的部分被截掉
+ * @param cursor 打开文件时缓存的区段, 可以为空
+ * @return 读到的内容
+ */
+std::string read_file_range(const Inode &file_inode, uint64_t offset, uint64_t length, Extent *cursor) {
+    if (offset >= file_inode.i_size) {
+        return "";
+    }
+    uint64_t end = offset + std::min(length, file_inode.i_size - offset);
+    std::string content(static_cast<size_t>(end - offset), '\0');
+    if (file_inode.is_inline()) {
+        journal.read(inode_bitmap.inode_offset(file_inode.i_id) + INODE_SIZE + offset, &content[0], content.size());
+        return content;
+    }
+    if (file_inode.is_compressed()) {
+        // 只解压这一段覆盖的簇
+        uint64_t cluster_size = geometry.offset(COMPRESS_CLUSTER_BLOCKS);
+        for (uint64_t start = offset / cluster_size * cluster_size; start < end; start += cluster_size) {
+            std::string raw = read_cluster(file_inode, static_cast<uint32_t>(start / cluster_size));
+            uint64_t begin = std::max(offset, start);
+            uint64_t stop = std::min(end, start + raw.size());
+            if (begin < stop) {
+                memcpy(&content[begin - offset], raw.data() + (begin - start), static_cast<size_t>(stop - begin));
+            }
+        }
+        return content;
+    }
+    uint32_t first = static_cast<uint32_t>(offset / geometry.block_size);
+    uint32_t last = static_cast<uint32_t>((end + geometry.block_size - 1) / geometry.block_size);
+    for (const Extent &extent : find_extents(file_inode, first, last, cursor)) {
+        uint64_t begin = std::max(offset, geometry.offset(extent.logical));
+        uint64_t stop = std::min(end, geometry.offset(extent.logical) + geometry.offset(extent.length));
+        if (begin >= stop) {
+            continue;
+        }
+        journal.read(geometry.offset(extent.start) + (begin - geometry.offset(extent.logical)), &content[begin - offset], static_cast<size_t>(stop - begin));
+    }
+    return content;
+}
+
+/**
+ * @brief 读取文件的最后几行
+ * 从文件末尾逐块向前读，数够换行符即停止，耗时只与输出的长度有关
+ * @param file_inode 文件的inode
+ * @param lines 行数
+ * @return 最后几行的内容
+ */
+std::string read_file_tail(const Inode &file_inode, uint64_t lines) {
+    std::string tail;
+    if (lines == 0) {
+        return tail;
+    }
+    uint64_t begin = file_inode.i_size;
+    uint64_t newlines = 0;
+    while (begin > 0) {
+        uint64_t step = (begin - 1) / geometry.block_size * geometry.block_size;
+        std::string part = read_file_range(file_inode, step, begin - step);
+        bool at_end = begin == file_inode.i_size;
+        begin = step;
+        for (size_t i = part.size(); i-- > 0;) {
+            // 文件末尾的换行只是结束最后一行
+            if (part[i] == '\n' && !(at_end && i + 1 == part.size()) && ++newlines == lines) {
+                return part.substr(i + 1) + tail;
+            }
+        }
+        tail = part + tail;
+    }
+    return tail;
+}
+
 /**
  * @brief 写入文件内容
  * @param file_path 文件的路径
@@ -1024,45 +5110,443 @@ bool write_file(std::string file_path, std::string file_name, std::string conten
     // 向一个已经存在的文件后增加内容
     if (is_file_exit(file_name, dir_inode)) {
         Inode file_inode = Inode::read_inode(get_file_inode_id(file_name, dir_inode));
-        IndexBlock file_ib = IndexBlock::read_index_block(file_inode.i_indirect);
-        uint32_t block_id = UINT16_MAX;
-        uint32_t file_size = file_inode.i_size;
-        int need_num = (content.size() + file_size) / BLOCK_SIZE + 1;
-        // 找到对应的块并写入
-        for (int i = 0; i < need_num; i++) {
-            if (i < 254) {
-                if (file_ib.index[i] == UINT32_MAX) {
-                    file_ib.index[i] = block_bitmap.get_free_block();
-                    file_inode.i_blocks++;
-                }
-                block_id = file_ib.index[i];
-            } else {
-                if (file_ib.next_index == UINT32_MAX) {
-                    file_ib.next_index = block_bitmap.get_free_block();
-                    file_inode.i_blocks++;
-                }
-                file_ib = IndexBlock::read_index_block(file_ib.next_index);
-                block_id = file_ib.index[i - 254];
-            }
-            std::ofstream file(disk_path, std::ios::binary | std::ios::out | std::ios::in);
-            file.seekp(block_id * BLOCK_SIZE + (i == 0 ? file_size % BLOCK_SIZE : 0));
-            file.write(content.c_str() + i * BLOCK_SIZE, std::min(BLOCK_SIZE, static_cast<int>(content.size() - i * BLOCK_SIZE)));
-            file.close();
-        }
-        file_inode.i_size += content.size();
-        file_inode.i_mtime = dir_inode.i_mtime = static_cast<uint32_t>(time(0));
-        file_inode.save_inode();
+        DirStats before = file_stats(file_inode);
+        uint64_t written = write_file_range(file_inode, file_inode.i_size, content);
+        update_dir_stats(start_id, before, file_stats(file_inode));
+        dir_inode.i_mtime = file_inode.i_mtime;
         dir_inode.save_inode();
-        file_ib.save_index_block();
-        return true;
+        return written == content.size();
     } else {
         std::cout << __ERROR << "目标文件" << file_name << "不存在" << __NORMAL << std::endl;
         return false;
     }
 }
 
+/**
+ * @brief 从文件的某个位置写入
+ * 超出文件末尾的部分一次分配所需的块，然后每个区段一次写入;
+ * 内联的文件写入后仍放得下时直接写入内联数据区, 放不下时先改为按区段映射; 压缩的文件按簇改写
+ * @param file_inode 文件的inode, 写入后更新大小并保存
+ * @param offset 起始字节偏移, 不能超过文件大小
+ * @param content 写入的内容
+ * @param cursor 打开文件时缓存的区段, 可以为空
+ * @return 写入的字节数, 磁盘空间不足或超出所有者的配额时少于内容的长度
+ */
+uint64_t write_file_range(Inode &file_inode, uint64_t offset, const std::string &content, Extent *cursor) {
+    // 读者固定的版本先保存将被改写的旧内容
+    version_table.preserve(file_inode, offset, offset + content.size());
+    if (file_inode.is_inline()) {
+        if (offset + content.size() <= geometry.inline_size()) {
+            journal.write(inode_bitmap.inode_offset(file_inode.i_id) + INODE_SIZE + offset, content.data(), content.size());
+            file_inode.i_size = std::max<uint64_t>(file_inode.i_size, offset + content.size());
+            file_inode.i_mtime = static_cast<uint32_t>(time(0));
+            file_inode.save_inode();
+            return content.size();
+        }
+        // 原有的内容都在写入位置之前或被覆盖, 和新内容一起从头写入区段
+        std::string merged = read_file_range(file_inode, 0, offset) + content;
+        if (!expand_inline(file_inode)) {
+            return 0;
+        }
+        if (cursor != nullptr) {
+            *cursor = Extent{0, 0, 0};
+        }
+        uint64_t written = write_file_range(file_inode, 0, merged, cursor);
+        return written > offset ? written - offset : 0;
+    }
+    if (file_inode.is_compressed()) {
+        return write_clusters(file_inode, offset, content);
+    }
+    BlockMap block_map(file_inode.i_indirect);
+    uint64_t end = offset + content.size();
+    // 一次追加所有需要的块，分配器尽量给出连续的块
+    // 其他打开文件的追加缓冲预留的块不能占用
+    uint64_t have = block_map.size();
+    uint64_t need = (end + geometry.block_size - 1) / geometry.block_size;
+    uint32_t old_blocks = file_inode.i_blocks;
+    uint32_t room = quota_table.room(file_inode.i_uid, file_inode.i_gid);
+    if (need > have + room) {
+        std::cout << __ERROR << "超出磁盘配额" << __NORMAL << std::endl;
+        need = have + room;
+        end = std::min<uint64_t>(end, geometry.offset(need));
+    }
+    if (need > have && block_map.extend(static_cast<uint32_t>(std::min<uint64_t>(need - have, block_bitmap.available())), file_inode) < need - have) {
+        std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+        end = std::min<uint64_t>(end, geometry.offset(block_map.size()));
+    }
+    block_map.save();
+    quota_table.charge(file_inode, static_cast<int64_t>(file_inode.i_blocks) - old_blocks, 0);
+    uint32_t first = static_cast<uint32_t>(offset / geometry.block_size);
+    uint32_t last = static_cast<uint32_t>((end + geometry.block_size - 1) / geometry.block_size);
+    uint64_t written = 0;
+    for (const Extent &extent : find_extents(file_inode, first, last, cursor)) {
+        uint64_t begin = std::max<uint64_t>(offset, geometry.offset(extent.logical));
+        uint64_t stop = std::min<uint64_t>(end, geometry.offset(extent.logical) + geometry.offset(extent.length));
+        if (begin >= stop) {
+            continue;
+        }
+        std::string chunk(content, static_cast<size_t>(begin - offset), static_cast<size_t>(stop - begin));
+        if (stop == end && end >= file_inode.i_size) {
+            // 补零写满最后一块, 不让复用块的旧数据残留在文件尾部
+            chunk.resize(chunk.size() + static_cast<size_t>((geometry.block_size - end % geometry.block_size) % geometry.block_size), '\0');
+        }
+        journal.write_data(geometry.offset(extent.start) + (begin - geometry.offset(extent.logical)), chunk.data(), chunk.size());
+        written += stop - begin;
+    }
+    file_inode.i_size = std::max(file_inode.i_size, offset + written);
+    file_inode.i_mtime = static_cast<uint32_t>(time(0));
+    file_inode.save_inode();
+    return written;
+}
+
+/**
+ * @brief 内联的文件改为按区段映射
+ * 分配区段树的根节点后文件为空, 由调用者重新写入原有的内容; 至少要能再分配一个数据块, 保证原有的内容写得下
+ * @param file_inode 内联的文件的inode, 由调用者保存
+ * @return 是否成功, 磁盘空间不足或超出配额时文件不变
+ */
+bool expand_inline(Inode &file_inode) {
+    if (quota_table.room(file_inode.i_uid, file_inode.i_gid) < 2) {
+        std::cout << __ERROR << "超出磁盘配额" << __NORMAL << std::endl;
+        return false;
+    }
+    if (block_bitmap.available() < 2) {
+        std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+        return false;
+    }
+    uint32_t root = block_bitmap.get_free_block(geometry.group_start(inode_bitmap.group_of(file_inode.i_id)));
+    if (root == UINT32_MAX) {
+        std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+        return false;
+    }
+    file_inode.i_indirect = root;
+    file_inode.i_blocks = 1;
+    file_inode.i_size = 0;
+    BlockMap block_map(root);
+    block_map.init();
+    block_map.save();
+    quota_table.charge(file_inode, 1, 0);
+    return true;
+}
+
+/**
+ * @brief LZ压缩
+ * 格式与LZ4的块格式相同: 每一段是一个标记字节、若干字面量、2字节的偏移和重复串长度; 标记字节的高4位是字面量的个数,
+ * 低4位是重复串长度减LZ_MIN_MATCH, 取15时后面跟着补充长度的字节, 直到不是255为止; 最后一段只有字面量。
+ * 用4字节的哈希表查找最近一次出现的位置, 连续找不到重复串时逐渐加大步长, 不可压缩的数据也很快
+ * @param data 原始数据
+ * @param size 原始数据的字节数
+ * @return 压缩后的数据
+ */
+std::string lz_compress(const char *data, size_t size) {
+    std::string out;
+    out.reserve(size + size / 255 + 16);
+    auto put_length = [&out](size_t length) {
+        for (; length >= 255; length -= 255) {
+            out.push_back(static_cast<char>(255));
+        }
+        out.push_back(static_cast<char>(length));
+    };
+    // 输出一段: 从anchor开始的literals个字面量, 其后是match个字节的重复串
+    auto put_sequence = [&](size_t anchor, size_t literals, size_t match, size_t offset) {
+        size_t extra = match == 0 ? 0 : match - LZ_MIN_MATCH;
+        out.push_back(static_cast<char>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(extra, 15)));
+        if (literals >= 15) {
+            put_length(literals - 15);
+        }
+        out.append(data + anchor, literals);
+        if (match == 0) {
+            return;
+        }
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (extra >= 15) {
+            put_length(extra - 15);
+        }
+    };
+    std::vector<uint32_t> table(1u << LZ_HASH_BITS, UINT32_MAX);
+    size_t anchor = 0, pos = 0;
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t sequence;
+        memcpy(&sequence, data + pos, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = static_cast<uint32_t>(pos);
+        if (candidate == UINT32_MAX || pos - candidate > LZ_MAX_OFFSET || memcmp(data + candidate, data + pos, LZ_MIN_MATCH) != 0) {
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+        size_t match = LZ_MIN_MATCH;
+        while (pos + match < size && data[candidate + match] == data[pos + match]) {
+            match++;
+        }
+        put_sequence(anchor, pos - anchor, match, pos - candidate);
+        pos += match;
+        anchor = pos;
+    }
+    put_sequence(anchor, size - anchor, 0, 0);
+    return out;
+}
+
+/**
+ * @brief LZ解压
+ * 检查每一段的长度和偏移, 损坏的数据不会越界读写
+ * @param data 压缩后的数据
+ * @param size 压缩后的字节数
+ * @param out 解压的输出, 至少raw_size字节
+ * @param raw_size 原始数据的字节数
+ * @return 是否解压出正好raw_size字节
+ */
+bool lz_decompress(const char *data, size_t size, char *out, size_t raw_size) {
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(data);
+    size_t at = 0, done = 0;
+    auto get_length = [&](size_t &length) {
+        uint8_t byte;
+        do {
+            if (at >= size) {
+                return false;
+            }
+            byte = in[at++];
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+    while (at < size) {
+        uint8_t token = in[at++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !get_length(literals)) {
+            return false;
+        }
+        if (literals > size - at || literals > raw_size - done) {
+            return false;
+        }
+        memcpy(out + done, in + at, literals);
+        at += literals;
+        done += literals;
+        if (at == size) {
+            break; // 最后一段只有字面量
+        }
+        if (size - at < 2) {
+            return false;
+        }
+        size_t offset = in[at] | (static_cast<size_t>(in[at + 1]) << 8);
+        at += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(match)) {
+            return false;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > done || match > raw_size - done) {
+            return false;
+        }
+        if (offset >= match) {
+            memcpy(out + done, out + done - offset, match);
+        } else {
+            // 重复串与自身重叠, 逐字节复制
+            for (size_t i = 0; i < match; i++) {
+                out[done + i] = out[done + i - offset];
+            }
+        }
+        done += match;
+    }
+    return done == raw_size;
+}
+
+/**
+ * @brief 读取压缩文件的一簇
+ * 第c簇占用区段树中从c*COMPRESS_CLUSTER_BLOCKS开始的逻辑块; 压缩后能少占至少一个块时保存为4字节的压缩长度和压缩数据,
+ * 其后的逻辑块留空, 否则原样保存。映射的块数不少于原始内容的块数时就是原样保存的
+ * @param file_inode 压缩的文件的inode
+ * @param cluster 簇号
+ * @return 这一簇的原始内容, 不超过文件末尾
+ */
+std::string read_cluster(const Inode &file_inode, uint32_t cluster) {
+    uint64_t start = geometry.offset(cluster * COMPRESS_CLUSTER_BLOCKS);
+    if (start >= file_inode.i_size) {
+        return "";
+    }
+    uint64_t raw_size = std::min<uint64_t>(geometry.offset(COMPRESS_CLUSTER_BLOCKS), file_inode.i_size - start);
+    uint32_t raw_blocks = static_cast<uint32_t>((raw_size + geometry.block_size - 1) / geometry.block_size);
+    // 按逻辑顺序读出这一簇映射的所有块, 簇可能跨几个区段
+    // 不使用打开文件缓存的区段, 其他用户改写压缩的文件时簇可能搬到新的块
+    uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    std::string stored;
+    for (const Extent &extent : find_extents(file_inode, first, first + raw_blocks, nullptr)) {
+        uint32_t from = std::max(extent.logical, first);
+        uint32_t to = std::min(extent.logical + extent.length, first + raw_blocks);
+        if (from >= to) {
+            continue;
+        }
+        size_t at = stored.size();
+        stored.resize(at + static_cast<size_t>(geometry.offset(to - from)));
+        journal.read(geometry.offset(extent.start + (from - extent.logical)), &stored[at], static_cast<size_t>(geometry.offset(to - from)));
+    }
+    if (stored.size() >= geometry.offset(raw_blocks)) {
+        stored.resize(static_cast<size_t>(raw_size));
+        return stored;
+    }
+    std::string raw(static_cast<size_t>(raw_size), '\0');
+    uint32_t packed = 0;
+    if (stored.size() >= sizeof(packed)) {
+        memcpy(&packed, stored.data(), sizeof(packed));
+    }
+    auto begin = std::chrono::steady_clock::now();
+    if (packed > stored.size() - std::min(stored.size(), sizeof(packed)) ||
+        !lz_decompress(stored.data() + sizeof(packed), packed, &raw[0], raw.size())) {
+        std::cout << __ERROR << "文件" << file_inode.i_id << "的第" << cluster << "簇压缩数据损坏" << __NORMAL << std::endl;
+        return std::string(static_cast<size_t>(raw_size), '\0');
+    }
+    compress_stats.unpacked += raw.size();
+    compress_stats.unpack_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+    return raw;
+}
+
+/**
+ * @brief 把一簇保存的内容按顺序写入这一簇映射的块
+ * 相邻的簇可能合并在同一个区段中, 只写属于这一簇的部分
+ * @param block_map 文件的区段树
+ * @param cluster 簇号
+ * @param stored 保存的内容, 是整块
+ */
+static void write_cluster_blocks(BlockMap &block_map, uint32_t cluster, const std::string &stored) {
+    uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    uint32_t count = static_cast<uint32_t>(stored.size() / geometry.block_size);
+    uint32_t at = 0;
+    for (const Extent &extent : block_map.extents(first, first + count)) {
+        uint32_t from = std::max(extent.logical, first);
+        uint32_t to = std::min(extent.logical + extent.length, first + count);
+        if (from >= to) {
+            continue;
+        }
+        journal.write_data(geometry.offset(extent.start + (from - extent.logical)), stored.data() + geometry.offset(at), static_cast<size_t>(geometry.offset(to - from)));
+        at += to - from;
+    }
+}
+
+/**
+ * @brief 压缩并保存一簇
+ * 占用的块数不变时原地改写; 块数变化时这一簇是最后一簇则在末尾增减块, 否则释放这一簇及其后的块, 再把其后的簇
+ * 原样搬到新分配的块中。调用者保存inode和区段树, 并更新文件大小
+ * @param file_inode 压缩的文件的inode
+ * @param block_map 文件的区段树
+ * @param cluster 簇号
+ * @param raw 这一簇的原始内容, 不是最后一簇时正好是一整簇
+ * @return 是否保存成功, 磁盘空间不足或超出配额时这一簇不变
+ */
+bool store_cluster(Inode &file_inode, BlockMap &block_map, uint32_t cluster, const std::string &raw) {
+    auto begin = std::chrono::steady_clock::now();
+    std::string packed = lz_compress(raw.data(), raw.size());
+    compress_stats.packed_in += raw.size();
+    compress_stats.packed_out += packed.size();
+    compress_stats.pack_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+    uint32_t raw_blocks = static_cast<uint32_t>((raw.size() + geometry.block_size - 1) / geometry.block_size);
+    std::string stored;
+    if (sizeof(uint32_t) + packed.size() <= geometry.offset(raw_blocks - 1)) {
+        uint32_t length = static_cast<uint32_t>(packed.size());
+        stored.assign(reinterpret_cast<const char *>(&length), sizeof(length));
+        stored += packed;
+    } else {
+        stored = raw;
+    }
+    // 补零写满最后一块, 不让复用块的旧数据残留
+    uint32_t need = static_cast<uint32_t>((stored.size() + geometry.block_size - 1) / geometry.block_size);
+    stored.resize(static_cast<size_t>(geometry.offset(need)), '\0');
+
+    uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    uint32_t old = 0;
+    for (const Extent &extent : block_map.extents(first, first + COMPRESS_CLUSTER_BLOCKS)) {
+        old += std::min(extent.logical + extent.length, first + COMPRESS_CLUSTER_BLOCKS) - std::max(extent.logical, first);
+    }
+    bool last = block_map.size() <= first + COMPRESS_CLUSTER_BLOCKS;
+    if (need != old) {
+        // 其后的簇要搬动时, 区段树重建后可能多用几个节点
+        uint32_t spare = last ? 0 : 4;
+        if (need > old && need - old + spare > quota_table.room(file_inode.i_uid, file_inode.i_gid)) {
+            std::cout << __ERROR << "超出磁盘配额" << __NORMAL << std::endl;
+            return false;
+        }
+        if (need > old && need - old + spare > block_bitmap.available()) {
+            std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+            return false;
+        }
+    }
+    if (need != old && last) {
+        if (need < old) {
+            block_map.truncate(first + need, file_inode);
+        } else if (block_map.extend(need - old, file_inode, first) < need - old) {
+            block_map.truncate(first + old, file_inode);
+            std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+            return false;
+        }
+    } else if (need != old) {
+        // 读出其后各簇保存的内容, 释放后重新分配
+        std::map<uint32_t, std::string> later;
+        for (const Extent &extent : block_map.extents(first + COMPRESS_CLUSTER_BLOCKS)) {
+            for (uint32_t n = extent.logical < first + COMPRESS_CLUSTER_BLOCKS ? first + COMPRESS_CLUSTER_BLOCKS - extent.logical : 0; n < extent.length; n++) {
+                std::string &blocks = later[(extent.logical + n) / COMPRESS_CLUSTER_BLOCKS];
+                size_t at = blocks.size();
+                blocks.resize(at + geometry.block_size);
+                journal.read(geometry.offset(extent.start + n), &blocks[at], geometry.block_size);
+            }
+        }
+        block_map.truncate(first, file_inode);
+        if (block_map.extend(need, file_inode, first) < need) {
+            std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+            return false;
+        }
+        for (const auto &entry : later) {
+            uint32_t count = static_cast<uint32_t>(entry.second.size() / geometry.block_size);
+            if (block_map.extend(count, file_inode, entry.first * COMPRESS_CLUSTER_BLOCKS) < count) {
+                std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+                return false;
+            }
+            write_cluster_blocks(block_map, entry.first, entry.second);
+        }
+    }
+    write_cluster_blocks(block_map, cluster, stored);
+    return true;
+}
+
+/**
+ * @brief 从压缩文件的某个位置写入
+ * 只解压写入范围覆盖的簇, 拼入新内容后重新压缩保存
+ * @param file_inode 压缩的文件的inode, 写入后更新大小并保存
+ * @param offset 起始字节偏移, 不能超过文件大小
+ * @param content 写入的内容
+ * @return 写入的字节数, 磁盘空间不足或超出所有者的配额时少于内容的长度
+ */
+uint64_t write_clusters(Inode &file_inode, uint64_t offset, const std::string &content) {
+    uint64_t cluster_size = geometry.offset(COMPRESS_CLUSTER_BLOCKS);
+    uint64_t end = offset + content.size();
+    BlockMap block_map(file_inode.i_indirect);
+    uint64_t written = 0;
+    for (uint64_t start = offset / cluster_size * cluster_size; start < end; start += cluster_size) {
+        uint64_t from = std::max(offset, start);
+        uint64_t to = std::min(end, start + cluster_size);
+        std::string raw = read_cluster(file_inode, static_cast<uint32_t>(start / cluster_size));
+        if (raw.size() < to - start) {
+            raw.resize(static_cast<size_t>(to - start), '\0');
+        }
+        raw.replace(static_cast<size_t>(from - start), static_cast<size_t>(to - from), content, static_cast<size_t>(from - offset), static_cast<size_t>(to - from));
+        // 每簇保存后立即计入配额, 下一簇按剩下的配额检查; 区段树也立即保存, 读取下一簇时可能已经搬动
+        uint32_t old_blocks = file_inode.i_blocks;
+        bool stored = store_cluster(file_inode, block_map, static_cast<uint32_t>(start / cluster_size), raw);
+        block_map.save();
+        quota_table.charge(file_inode, static_cast<int64_t>(file_inode.i_blocks) - old_blocks, 0);
+        if (!stored) {
+            break;
+        }
+        written += to - from;
+        file_inode.i_size = std::max(file_inode.i_size, to);
+    }
+    file_inode.i_mtime = static_cast<uint32_t>(time(0));
+    file_inode.save_inode();
+    return written;
+}
+
 /**
  * @brief 清空文件内容
+ * 支持内联数据的磁盘上释放所有块, 文件重新内联保存; 否则保留第一个块
  * @param file_path 文件的路径
  * @param file_name 文件名
  * @return 是否清空成功
@@ -1076,17 +5560,22 @@ bool clear_file(std::string file_path, std::string file_name) {
     Inode dir_inode = Inode::read_inode(start_id);
     if (is_file_exit(file_name, dir_inode)) {
         Inode file_inode = Inode::read_inode(get_file_inode_id(file_name, dir_inode));
-        IndexBlock file_ib = IndexBlock::read_index_block(file_inode.i_indirect);
-        for (uint32_t i = 1; i < 254; i++) { // 保留第一个块
-            if (file_ib.index[i] == UINT32_MAX) {
-                break;
+        DirStats before = file_stats(file_inode);
+        if (!file_inode.is_inline()) {
+            BlockMap block_map(file_inode.i_indirect);
+            block_map.truncate(geometry.inline_size() > 0 ? 0 : 1, file_inode); // 不支持内联数据时保留第一个块
+            block_map.save();
+            if (geometry.inline_size() > 0) {
+                block_bitmap.free_block(file_inode.i_indirect);
+                file_inode.i_blocks--;
+                file_inode.i_indirect = INLINE_DATA;
             }
-            block_bitmap.free_block(file_ib.index[i]);
-            file_inode.i_blocks--;
         }
+        quota_table.charge(file_inode, static_cast<int64_t>(file_inode.i_blocks) - before.blocks, 0);
         file_inode.i_size = 0;
         file_inode.i_mtime = dir_inode.i_mtime = static_cast<uint32_t>(time(0));
         file_inode.save_inode();
+        update_dir_stats(start_id, before, file_stats(file_inode));
         dir_inode.save_inode();
         return true;
     } else {
@@ -1095,6 +5584,70 @@ bool clear_file(std::string file_path, std::string file_name) {
     }
 }
 
+/**
+ * @brief 设置或取消文件的压缩属性
+ * 读出全部内容后释放数据块, 再按新的方式从头写入; 内联的文件只改属性, 改为按区段映射时才按簇压缩
+ * @param file_path 文件的路径
+ * @param file_name 文件名
+ * @param compressed 是否压缩
+ * @param _shell_output 输出信息
+ * @return 是否成功, 磁盘空间不足或超出配额时文件不变
+ */
+bool compress_file(std::string file_path, std::string file_name, bool compressed, std::string &_shell_output) {
+    uint32_t start_id = 0;
+    if (!is_dir_exit(file_path, start_id)) {
+        std::cout << __ERROR << "目标目录" << file_path << "不存在" << __NORMAL << std::endl;
+        _shell_output += __ERROR + "目标目录" + file_path + "不存在" + __NORMAL + "\n";
+        return false;
+    }
+    Inode dir_inode = Inode::read_inode(start_id);
+    if (!is_file_exit(file_name, dir_inode)) {
+        std::cout << __ERROR << "目标文件" << file_name << "不存在" << __NORMAL << std::endl;
+        _shell_output += __ERROR + "目标文件" + file_name + "不存在" + __NORMAL + "\n";
+        return false;
+    }
+    Inode file_inode = Inode::read_inode(get_file_inode_id(file_name, dir_inode));
+    if (file_inode.is_compressed() != compressed && !file_inode.is_inline()) {
+        // 最坏的情况下每簇都原样保存, 占用未压缩的块数
+        uint32_t have = 0;
+        for (const Extent &extent : BlockMap(file_inode.i_indirect).extents()) {
+            have += extent.length;
+        }
+        uint64_t need = (file_inode.i_size + geometry.block_size - 1) / geometry.block_size;
+        if (need > have && need - have > quota_table.room(file_inode.i_uid, file_inode.i_gid)) {
+            std::cout << __ERROR << "超出磁盘配额" << __NORMAL << std::endl;
+            _shell_output += __ERROR + "超出磁盘配额" + __NORMAL + "\n";
+            return false;
+        }
+        if (need > have && need - have > block_bitmap.available()) {
+            std::cout << __ERROR << "磁盘空间不足" << __NORMAL << std::endl;
+            _shell_output += __ERROR + "磁盘空间不足" + __NORMAL + "\n";
+            return false;
+        }
+        DirStats before = file_stats(file_inode);
+        std::string content = read_file_range(file_inode, 0, file_inode.i_size);
+        BlockMap block_map(file_inode.i_indirect);
+        block_map.truncate(0, file_inode);
+        block_map.save();
+        quota_table.charge(file_inode, static_cast<int64_t>(file_inode.i_blocks) - before.blocks, 0);
+        file_inode.i_size = 0;
+        file_inode.i_mode = compressed ? file_inode.i_mode | COMPRESSED_MODE : file_inode.permission();
+        uint64_t written = write_file_range(file_inode, 0, content);
+        update_dir_stats(start_id, before, file_stats(file_inode));
+        if (written < content.size()) {
+            std::cout << __ERROR << "文件" << file_name << "只写回了" << written << "字节" << __NORMAL << std::endl;
+            _shell_output += __ERROR + "文件" + file_name + "只写回了" + std::to_string(written) + "字节" + __NORMAL + "\n";
+            return false;
+        }
+    } else if (file_inode.is_compressed() != compressed) {
+        file_inode.i_mode = compressed ? file_inode.i_mode | COMPRESSED_MODE : file_inode.permission();
+        file_inode.save_inode();
+    }
+    _shell_output += __SUCCESS + "文件" + file_name + (compressed ? "已压缩" : "已取消压缩") + ", 大小" + std::to_string(file_inode.i_size) +
+                     "字节, 占用" + std::to_string(file_inode.i_blocks) + "块" + __NORMAL + "\n";
+    return true;
+}
+
 /**
  * @brief 创建目录
  * 输入一定是需要创建的目录（即当前不存在的目录）
@@ -1129,6 +5682,11 @@ bool make_dir(const std::string dir_name, Inode cur_inode, User cur_user,std::st
             cur_inode = Inode::read_inode(cur_id);
             continue;
         } else {
+            if (!quota_table.can_create(cur_user.uid, cur_user.gid, 2)) { // 区段树的根节点和第一个目录块
+                _shell_output += __ERROR + "超出磁盘配额, 不能创建目录" + p + __NORMAL + "\n";
+                std::cout << __ERROR << "超出磁盘配额, 不能创建目录" << p << __NORMAL << std::endl;
+                return false;
+            }
             cur_id = make_dir_help(p, cur_inode, cur_user, mode);
             cur_inode = Inode::read_inode(cur_id);
         }
@@ -1147,62 +5705,49 @@ bool make_dir(const std::string dir_name, Inode cur_inode, User cur_user,std::st
  */
 bool make_file(const std::string file_name, uint32_t inode_id, User cur_user,  std::string &_shell_output,uint32_t mode) {
     Inode parent_inode = Inode::read_inode(inode_id);
-    if(file_name.size()>28){
+    if(file_name.size()>MAX_NAME_LEN){
         std::cout << __ERROR << "文件名过长" << __NORMAL << std::endl;
         _shell_output += __ERROR + "文件名过长\n" + __NORMAL;
         return false;
     }
+    // 支持内联数据时新文件不占用块, 否则分配区段树的根节点和预先分配的数据块
+    bool inline_data = geometry.inline_size() > 0;
+    if (!quota_table.can_create(cur_user.uid, cur_user.gid, inline_data ? 0 : 2)) {
+        std::cout << __ERROR << "超出磁盘配额" << __NORMAL << std::endl;
+        _shell_output += __ERROR + "超出磁盘配额\n" + __NORMAL;
+        return false;
+    }
     if (!is_file_exit(file_name, parent_inode)) {
-        IndexBlock cur_ib = IndexBlock::read_index_block(parent_inode.i_indirect);
+        // 文件的inode和数据块放在父目录所在的块组
+        uint32_t group = inode_bitmap.group_of(parent_inode.i_id);
         Inode new_inode = {
-            inode_bitmap.get_free_inode(),
-            0,
-            2,
+            inode_bitmap.get_free_inode(group),
             1,
-            block_bitmap.get_free_block(),
             FILE_TYPE,
+            0,
+            inline_data ? 0u : 1u,
+            inline_data ? INLINE_DATA : block_bitmap.get_free_block(geometry.group_start(group)),
             mode,
             cur_user.uid,
             cur_user.gid,
-            static_cast<uint32_t>(time(0)),
-            static_cast<uint32_t>(time(0)),
-            static_cast<uint32_t>(time(0))};
-        IndexBlock new_ib(new_inode.i_indirect);
-        IndexBlock parent_ib = IndexBlock::read_index_block(parent_inode.i_indirect);
-        bool write_flag = false;
-        while (true) {
-            for (uint32_t i = 0; i < 254; i++) {
-                if (parent_ib.index[i] == UINT32_MAX) {
-                    break;
-                }
-                DirBlock parent_db = DirBlock::read_dir_block(parent_ib.index[i]);
-                for (int j = 0; j < 32; j++) {
-                    if (parent_db.entries[j].type == UNDEFINE_TYPE) {
-                        parent_db.entries[j].set(new_inode.i_id, FILE_TYPE, file_name.c_str());
-                        write_flag = true;
-                        break;
-                    }
-                }
-                if (write_flag) {
-                    parent_db.save_dir_block(parent_ib.index[i]);
-                    break;
-                }
-            }
-            if (write_flag) {
-                break;
-            }
-            // 当前索引块已满，开辟新的索引块
-            if (parent_ib.next_index == UINT32_MAX) {
-                parent_ib.next_index = block_bitmap.get_free_block();
-                parent_ib.save_index_block();
-            }
-            parent_ib = IndexBlock::read_index_block(parent_ib.next_index);
-        };
+            static_cast<uint32_t>(time(0)),
+            static_cast<uint32_t>(time(0)),
+            static_cast<uint32_t>(time(0))};
+        if (!inline_data) {
+            // 预先分配第一个数据块
+            BlockMap new_map(new_inode.i_indirect);
+            new_map.init();
+            new_map.map(0, new_inode);
+            new_map.save();
+        }
+        add_dir_entry(parent_inode, new_inode.i_id, FILE_TYPE, file_name);
+        name_index.add(file_name, new_inode, parent_inode.i_id);
+        update_dir_stats(parent_inode.i_id, DirStats(), file_stats(new_inode));
+        quota_table.charge(new_inode, new_inode.i_blocks, 1);
         parent_inode.i_mtime = static_cast<uint32_t>(time(0));
         // save all
         new_inode.save_inode();
         parent_inode.save_inode();
-        new_ib.save_index_block();
         return true;
     } else {
         std::cout << __ERROR << "文件" << file_name << "已存在" << __NORMAL << std::endl;
@@ -1213,43 +5758,34 @@ bool make_file(const std::string file_name, uint32_t inode_id, User cur_user,  s
 
 /**
  * @brief 删除文件
+ * 只删除目录项, 文件的inode链入孤儿链表, 数据块由后台分批释放
  * @param file_name 文件名
  * @param cur_inode 当前目录的inode
  * @param _shell_output 输出信息
  * @return 是否删除成功
  */
 bool del_file(const std::string file_name, Inode &cur_inode, std::string &_shell_output) {
-    IndexBlock cur_ib = IndexBlock::read_index_block(cur_inode.i_indirect);
     bool found = false;
     uint32_t file_inode_id;
     // 删除目录项
-    while (true) {
-        for (uint32_t i = 0; i < 254; i++) {
-            if (cur_ib.index[i] == UINT32_MAX) {
-                break;
-            }
-            DirBlock cur_db = DirBlock::read_dir_block(cur_ib.index[i]);
-            for (int j = 0; j < 32; j++) {
-                if (cur_db.entries[j].type == UNDEFINE_TYPE) {
-                    continue;
-                }
-                if (std::string(cur_db.entries[j].name) == file_name && cur_db.entries[j].type == FILE_TYPE) {
-                    found = true;
-                    file_inode_id = cur_db.entries[j].inode_id;
-                    cur_db.entries[j].type = UNDEFINE_TYPE;
-                    cur_db.entries[j].inode_id = UINT16_MAX;
-                    cur_db.save_dir_block(cur_ib.index[i]);
-                    break;
-                }
+    for (uint32_t block_id : BlockMap(cur_inode.i_indirect).blocks()) {
+        DirBlock cur_db = DirBlock::read_dir_block(block_id);
+        for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
+            if (cur_db.entries[j].type == UNDEFINE_TYPE) {
+                continue;
             }
-            if (found) {
+            if (std::string(cur_db.entries[j].name) == file_name && cur_db.entries[j].type == FILE_TYPE) {
+                found = true;
+                file_inode_id = cur_db.entries[j].inode_id;
+                cur_db.entries[j].type = UNDEFINE_TYPE;
+                cur_db.entries[j].inode_id = UINT32_MAX;
+                cur_db.save_dir_block(block_id);
                 break;
             }
         }
-        if (found || cur_ib.next_index == UINT32_MAX) {
+        if (found) {
             break;
         }
-        cur_ib = IndexBlock::read_index_block(cur_ib.next_index);
     }
     if (!found) {
         std::cout << __ERROR << "文件" << file_name << "不存在" << __NORMAL << std::endl;
@@ -1257,16 +5793,9 @@ bool del_file(const std::string file_name, Inode &cur_inode, std::string &_shell
         return false;
     }
     Inode file_inode = Inode::read_inode(file_inode_id);
-    uint32_t file_ib_id = file_inode.i_indirect;
-    IndexBlock file_ib = IndexBlock::read_index_block(file_ib_id);
-    for (uint32_t i = 0; i < 254; i++) {
-        if (file_ib.index[i] == UINT32_MAX) {
-            break;
-        }
-        block_bitmap.free_block(file_ib.index[i]);
-    }
-    block_bitmap.free_block(file_ib_id);
-    inode_bitmap.free_inode(file_inode_id);
+    update_dir_stats(cur_inode.i_id, file_stats(file_inode), DirStats());
+    name_index.remove(file_name, file_inode_id);
+    orphan_list.push(file_inode);
     return true;
 }
 
@@ -1277,13 +5806,10 @@ bool del_file(const std::string file_name, Inode &cur_inode, std::string &_shell
  */
 bool is_dir_empty(const uint32_t dir_inode_id) {
     Inode dir_inode = Inode::read_inode(dir_inode_id);
-    IndexBlock cur_ib = IndexBlock::read_index_block(dir_inode.i_indirect);
-    for (uint32_t i = 0; i < 254; i++) {
-        if (cur_ib.index[i] == UINT32_MAX) {
-            break;
-        }
-        DirBlock cur_db = DirBlock::read_dir_block(cur_ib.index[i]);
-        for (int j = 2; j < 32; j++) {
+    std::vector<uint32_t> blocks = BlockMap(dir_inode.i_indirect).blocks();
+    for (uint32_t n = 0; n < blocks.size(); n++) {
+        DirBlock cur_db = DirBlock::read_dir_block(blocks[n]);
+        for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
             if (cur_db.entries[j].type == UNDEFINE_TYPE) {
                 continue;
             }
@@ -1297,82 +5823,815 @@ bool is_dir_empty(const uint32_t dir_inode_id) {
 
 /**
  * @brief 删除目录
+ * 只删除父目录中的目录项, 目录链入孤儿链表, 其中的文件和子目录由后台逐块回收
  * @param dir_inode_id 目录inode_id
  * @param _shell_output 输出信息
  * @return 是否删除成功
  */
 bool del_dir(const uint32_t dir_inode_id, std::string &_shell_output) {
-    uint32_t parent_inode_id = 0;
+    if (dir_inode_id == 0) {
+        std::cout << __ERROR << "不能删除根目录" << __NORMAL << std::endl;
+        _shell_output += __ERROR + "不能删除根目录" + __NORMAL + "\n";
+        return false;
+    }
     Inode dir_inode = Inode::read_inode(dir_inode_id);
-    IndexBlock cur_ib = IndexBlock::read_index_block(dir_inode.i_indirect);
-    while (true) {
-        for (uint32_t i = 0; i < 254; i++) {
-            if (cur_ib.index[i] == UINT32_MAX) {
+    // 第一个目录块的第二项是父目录
+    uint32_t parent_inode_id = DirBlock::read_dir_block(BlockMap(dir_inode.i_indirect).lookup(0)).entries[1].inode_id;
+    Inode parent_inode = Inode::read_inode(parent_inode_id);
+    bool found = false;
+    for (uint32_t block_id : BlockMap(parent_inode.i_indirect).blocks()) {
+        DirBlock parent_db = DirBlock::read_dir_block(block_id);
+        for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
+            if (parent_db.entries[j].type == UNDEFINE_TYPE) {
+                continue;
+            }
+            if (parent_db.entries[j].inode_id == dir_inode_id) {
+                name_index.remove(parent_db.entries[j].name, dir_inode_id);
+                parent_db.entries[j].type = UNDEFINE_TYPE;
+                parent_db.entries[j].inode_id = UINT32_MAX;
+                parent_db.entries[j].name[0] = '\0';
+                parent_db.save_dir_block(block_id);
+                found = true;
+                break;
+            }
+        }
+        if (found) {
+            break;
+        }
+    }
+    if (!found) {
+        std::cout << __ERROR << "目录项不存在" << __NORMAL << std::endl;
+        _shell_output += __ERROR + "目录项不存在" + __NORMAL + "\n";
+        return false;
+    }
+    DirStats stats = read_dir_stats(dir_inode_id);
+    stats.dirs++;
+    update_dir_stats(parent_inode_id, stats, DirStats());
+    orphan_list.push(dir_inode);
+    return true;
+}
+
+/**
+ * @brief 移动或重命名文件和目录
+ * 只把目录项从源目录的目录块移到目标目录的目录块, 移动目录时再改写它第一个目录块中的"..";
+ * 文件的数据块和目录的子树都不动, 打开的文件和文件锁按inode编号记录, 不受影响。
+ * 命令的所有修改在同一个事务中, 中途崩溃后要么都生效要么都没有
+ * @param src_dir_id 源目录的inode_id
+ * @param src_name 源目录项的名字
+ * @param dst_dir_id 目标目录的inode_id
+ * @param dst_name 目标目录项的名字
+ * @param cur_user 当前用户
+ * @param _shell_output 输出信息
+ * @return 是否移动成功
+ */
+bool move_entry(uint32_t src_dir_id, const std::string &src_name, uint32_t dst_dir_id, const std::string &dst_name, User cur_user,
+                std::string &_shell_output) {
+    auto fail = [&_shell_output](const std::string &message) {
+        std::cout << __ERROR << message << __NORMAL << std::endl;
+        _shell_output += __ERROR + message + __NORMAL + "\n";
+        return false;
+    };
+    if (src_name.empty() || src_name == "." || src_name == "..") {
+        return fail("不能移动" + (src_name.empty() ? std::string("根目录") : src_name));
+    }
+    if (dst_name.empty() || dst_name == "." || dst_name == ".." || !is_valid_dir_name(dst_name)) {
+        return fail("目标名字" + dst_name + "不合法");
+    }
+    if (!is_able_to_write(src_dir_id, cur_user) || !is_able_to_write(dst_dir_id, cur_user)) {
+        return fail("你没有权限修改源目录或目标目录");
+    }
+    // 找到源目录项, 同时检查目标目录中是否已有同名的目录项
+    auto find_entry = [](uint32_t dir_id, const std::string &name, DirEntry &found) {
+        for (uint32_t block_id : BlockMap(Inode::read_inode(dir_id).i_indirect).blocks()) {
+            DirBlock db = DirBlock::read_dir_block(block_id);
+            for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
+                if (db.entries[j].type != UNDEFINE_TYPE && db.entries[j].name == name) {
+                    found = db.entries[j];
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+    DirEntry entry, existing;
+    if (!find_entry(src_dir_id, src_name, entry)) {
+        return fail(src_name + "不存在");
+    }
+    if (src_dir_id == dst_dir_id && src_name == dst_name) {
+        return true;
+    }
+    if (find_entry(dst_dir_id, dst_name, existing)) {
+        return fail("目标" + dst_name + "已存在");
+    }
+    // 目录不能移动到自己或自己的子目录中
+    if (entry.type == DIR_TYPE) {
+        for (uint32_t dir_id = dst_dir_id;;) {
+            if (dir_id == entry.inode_id) {
+                return fail("不能把目录移动到它自己的子目录中");
+            }
+            uint32_t parent_id = DirBlock::read_dir_block(BlockMap(Inode::read_inode(dir_id).i_indirect).lookup(0)).entries[1].inode_id;
+            if (dir_id == 0 || parent_id == dir_id) {
+                break;
+            }
+            dir_id = parent_id;
+        }
+    }
+    // 先在目标目录中添加, 目录块不足时什么也没有修改
+    Inode dst_inode = Inode::read_inode(dst_dir_id);
+    if (!add_dir_entry(dst_inode, entry.inode_id, entry.type, dst_name)) {
+        return fail("磁盘空间不足");
+    }
+    dst_inode.i_mtime = static_cast<uint32_t>(time(0));
+    dst_inode.save_inode();
+    Inode src_inode = Inode::read_inode(src_dir_id);
+    bool removed = false;
+    for (uint32_t block_id : BlockMap(src_inode.i_indirect).blocks()) {
+        DirBlock db = DirBlock::read_dir_block(block_id);
+        for (uint32_t j = 0; j < geometry.dir_entries(); j++) {
+            if (db.entries[j].type != UNDEFINE_TYPE && db.entries[j].name == src_name) {
+                db.entries[j].set(UINT32_MAX, UNDEFINE_TYPE, "");
+                db.save_dir_block(block_id);
+                removed = true;
                 break;
             }
-            DirBlock cur_db = DirBlock::read_dir_block(cur_ib.index[i]);
-            for (int j = 0; j < 32; j++) {
-                // 跳过当前目录和父目录，递归后删除
-                if (cur_db.entries[j].type == UNDEFINE_TYPE || std::string(cur_db.entries[j].name) == "." || std::string(cur_db.entries[j].name) == "..") {
-                    if (std::string(cur_db.entries[j].name) == "..") {
-                        parent_inode_id = cur_db.entries[j].inode_id;
+        }
+        if (removed) {
+            break;
+        }
+    }
+    src_inode.i_mtime = static_cast<uint32_t>(time(0));
+    src_inode.save_inode();
+    Inode moved = Inode::read_inode(entry.inode_id);
+    DirStats stats;
+    if (entry.type == DIR_TYPE) {
+        uint64_t block_offset = geometry.offset(BlockMap(moved.i_indirect).lookup(0));
+        journal.write(block_offset + sizeof(DirEntry), &dst_dir_id, sizeof(dst_dir_id)); // 第二项是父目录
+        stats = read_dir_stats(entry.inode_id);
+        stats.dirs++;
+    } else {
+        stats = file_stats(moved);
+    }
+    if (src_dir_id != dst_dir_id) {
+        update_dir_stats(src_dir_id, stats, DirStats());
+        update_dir_stats(dst_dir_id, DirStats(), stats);
+    }
+    name_index.remove(src_name, entry.inode_id);
+    name_index.add(dst_name, moved, dst_dir_id);
+    return true;
+}
+
+/**
+ * @brief 文件计入所在目录统计的部分
+ * @param inode 普通文件的inode
+ */
+DirStats file_stats(const Inode &inode) {
+    DirStats stats;
+    stats.bytes = inode.i_size;
+    stats.blocks = inode.i_blocks;
+    stats.files = 1;
+    return stats;
+}
+
+/**
+ * @brief 读取目录子树的统计
+ * @param dir_id 目录的inode编号
+ * @return 统计, 包括目录自身占用的块
+ */
+DirStats read_dir_stats(uint32_t dir_id) {
+    DirStats stats;
+    Inode dir_inode = Inode::read_inode(dir_id);
+    journal.read(geometry.offset(BlockMap(dir_inode.i_indirect).lookup(0)) + DirStats::offset(), &stats, sizeof(DirStats));
+    return stats;
+}
+
+/**
+ * @brief 目录中的一部分发生变化后, 从这个目录开始沿".."逐级更新统计直到根目录
+ * 已删除、等待回收的目录不再计入祖先的统计, 遇到时停止
+ * @param dir_id 发生变化的目录
+ * @param before 变化前这一部分的统计
+ * @param after 变化后这一部分的统计
+ */
+void update_dir_stats(uint32_t dir_id, const DirStats &before, const DirStats &after) {
+    if (before == after) {
+        return;
+    }
+    while (true) {
+        Inode dir_inode = Inode::read_inode(dir_id);
+        if (dir_inode.i_links_count == 0) {
+            return;
+        }
+        uint64_t block_offset = geometry.offset(BlockMap(dir_inode.i_indirect).lookup(0));
+        DirStats stats;
+        journal.read(block_offset + DirStats::offset(), &stats, sizeof(DirStats));
+        stats.replace(before, after);
+        journal.write(block_offset + DirStats::offset(), &stats, sizeof(DirStats));
+        uint32_t parent_id = dir_id;
+        journal.read(block_offset + sizeof(DirEntry), &parent_id, sizeof(parent_id)); // 第二项是父目录
+        if (dir_id == 0 || parent_id == dir_id) {
+            return;
+        }
+        dir_id = parent_id;
+    }
+}
+
+/**
+ * @brief 重新计算所有目录的统计, 用于升级旧磁盘
+ * 每个目录的统计单独一个事务; 统计是重新计算后覆盖的, 中途崩溃后重新执行即可
+ */
+void rebuild_dir_stats() {
+    std::function<DirStats(uint32_t)> rebuild = [&rebuild](uint32_t dir_id) {
+        Inode dir_inode = Inode::read_inode(dir_id);
+        DirStats stats;
+        stats.blocks = dir_inode.i_blocks;
+        std::vector<uint32_t> blocks = BlockMap(dir_inode.i_indirect).blocks();
+        for (uint32_t n = 0; n < blocks.size(); n++) {
+            DirBlock db = DirBlock::read_dir_block(blocks[n]);
+            for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+                if (db.entries[j].type == DIR_TYPE) {
+                    DirStats child = rebuild(db.entries[j].inode_id);
+                    child.dirs++;
+                    stats.replace(DirStats(), child);
+                } else if (db.entries[j].type != UNDEFINE_TYPE) {
+                    stats.replace(DirStats(), file_stats(Inode::read_inode(db.entries[j].inode_id)));
+                }
+            }
+        }
+        journal.begin();
+        journal.write(geometry.offset(blocks[0]) + DirStats::offset(), &stats, sizeof(DirStats));
+        journal.commit();
+        return stats;
+    };
+    rebuild(0);
+}
+
+/**
+ * @brief 占用空间最多的目录
+ * 目录的统计不小于任何子目录的统计, 从根目录开始每次展开当前最大的目录, 先出队的count个就是最大的, 不需要遍历整棵树
+ * @param count 目录数
+ * @return 每行一个目录的块数、字节数和路径
+ */
+std::string largest_dirs(uint32_t count) {
+    std::priority_queue<std::pair<uint64_t, uint32_t>> queue;
+    queue.push({read_dir_stats(0).blocks, 0});
+    std::ostringstream oss;
+    while (!queue.empty() && count > 0) {
+        uint32_t dir_id = queue.top().second;
+        queue.pop();
+        if (dir_id != 0) {
+            DirStats stats = read_dir_stats(dir_id);
+            oss << "  " << std::left << std::setw(10) << stats.blocks << std::setw(14) << stats.bytes << get_absolute_path(dir_id) << std::endl;
+            count--;
+        }
+        Inode dir_inode = Inode::read_inode(dir_id);
+        std::vector<uint32_t> blocks = BlockMap(dir_inode.i_indirect).blocks();
+        for (uint32_t n = 0; n < blocks.size(); n++) {
+            DirBlock db = DirBlock::read_dir_block(blocks[n]);
+            for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+                if (db.entries[j].type == DIR_TYPE) {
+                    queue.push({read_dir_stats(db.entries[j].inode_id).blocks, db.entries[j].inode_id});
+                }
+            }
+        }
+    }
+    return oss.str();
+}
+
+/**
+ * @brief 目录及其直接子目录的空间占用, 直接读取维护好的统计, 不遍历子树
+ * @param dir_id 目录的inode编号
+ * @return 每行一个目录的块数、字节数、文件数、目录数和路径, 最后一行是目录本身
+ */
+std::string disk_usage(uint32_t dir_id) {
+    std::ostringstream oss;
+    oss << std::left << std::setw(10) << "blocks" << std::setw(14) << "bytes" << std::setw(8) << "files" << std::setw(8) << "dirs" << "path" << std::endl;
+    oss << std::setfill('-') << std::setw(50) << "-" << std::setfill(' ') << std::endl;
+    auto print = [&oss](uint32_t id) {
+        DirStats stats = read_dir_stats(id);
+        oss << std::left << std::setw(10) << stats.blocks << std::setw(14) << stats.bytes << std::setw(8) << stats.files << std::setw(8) << stats.dirs
+            << get_absolute_path(id) << std::endl;
+    };
+    std::vector<uint32_t> blocks = BlockMap(Inode::read_inode(dir_id).i_indirect).blocks();
+    for (uint32_t n = 0; n < blocks.size(); n++) {
+        DirBlock db = DirBlock::read_dir_block(blocks[n]);
+        for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+            if (db.entries[j].type == DIR_TYPE) {
+                print(db.entries[j].inode_id);
+            }
+        }
+    }
+    print(dir_id);
+    return oss.str();
+}
+
+/**
+ * @brief 找出目录树中用户不能修改的目录
+ * 递归删除目录需要能读取并修改其中的每个目录, 各个子目录并行检查
+ * @param dir_inode_id 目录树的根
+ * @param cur_user 当前用户
+ * @return 不能修改的目录, 按先序排列
+ */
+std::vector<uint32_t> unwritable_dirs(uint32_t dir_inode_id, User cur_user) {
+    TreeWalk<std::vector<uint32_t>> walk(
+        [&cur_user](uint32_t dir_id, std::vector<uint32_t> &children) {
+            std::vector<uint32_t> denied;
+            if (!is_able_to_read(dir_id, cur_user) || !is_able_to_write(dir_id, cur_user)) {
+                denied.push_back(dir_id);
+                return denied;
+            }
+            Inode dir_inode = Inode::read_inode(dir_id);
+            std::vector<uint32_t> blocks = BlockMap(dir_inode.i_indirect).blocks();
+            for (uint32_t n = 0; n < blocks.size(); n++) {
+                DirBlock db = DirBlock::read_dir_block(blocks[n]);
+                for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+                    if (db.entries[j].type == DIR_TYPE) {
+                        children.push_back(db.entries[j].inode_id);
+                    }
+                }
+            }
+            return denied;
+        },
+        [](std::vector<uint32_t> &into, std::vector<uint32_t> &from) { into.insert(into.end(), from.begin(), from.end()); });
+    return walk.run(dir_inode_id);
+}
+
+/**
+ * @brief 修改文件或目录的权限
+ * 只有所有者和root可以修改; 递归修改时并行遍历子目录收集要修改的inode, 再在当前线程统一写入
+ * @param inode_id 文件或目录的inode_id
+ * @param mode 新的权限
+ * @param recursive 是否递归修改目录中的文件和子目录
+ * @param cur_user 当前用户
+ * @param skipped 没有权限而跳过的个数
+ * @return 修改的个数
+ */
+uint32_t change_mode(uint32_t inode_id, uint32_t mode, bool recursive, User cur_user, uint32_t &skipped) {
+    struct Targets {
+        std::vector<uint32_t> ids; // 可以修改的inode
+        uint32_t skipped = 0;      // 没有权限修改的个数
+    };
+    auto add = [&cur_user](Targets &targets, const Inode &inode) {
+        if (cur_user.uid == 0 || inode.i_uid == cur_user.uid) {
+            targets.ids.push_back(inode.i_id);
+        } else {
+            targets.skipped++;
+        }
+    };
+    Targets targets;
+    Inode inode = Inode::read_inode(inode_id);
+    if (!recursive || inode.i_type != DIR_TYPE) {
+        add(targets, inode);
+    } else {
+        TreeWalk<Targets> walk(
+            [&](uint32_t dir_id, std::vector<uint32_t> &children) {
+                Targets found;
+                Inode dir_inode = Inode::read_inode(dir_id);
+                add(found, dir_inode);
+                // 没有读权限的目录不能列出其中的文件
+                if (!is_able_to_read(dir_id, cur_user)) {
+                    return found;
+                }
+                std::vector<uint32_t> blocks = BlockMap(dir_inode.i_indirect).blocks();
+                for (uint32_t n = 0; n < blocks.size(); n++) {
+                    DirBlock db = DirBlock::read_dir_block(blocks[n]);
+                    for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+                        if (db.entries[j].type == DIR_TYPE) {
+                            children.push_back(db.entries[j].inode_id);
+                        } else if (db.entries[j].type != UNDEFINE_TYPE) {
+                            add(found, Inode::read_inode(db.entries[j].inode_id));
+                        }
                     }
-                    continue;
                 }
-                if (cur_db.entries[j].type == DIR_TYPE) {
-                    if (!del_dir(cur_db.entries[j].inode_id, _shell_output)) {
-                        return false;
+                return found;
+            },
+            [](Targets &into, Targets &from) {
+                into.ids.insert(into.ids.end(), from.ids.begin(), from.ids.end());
+                into.skipped += from.skipped;
+            });
+        targets = walk.run(inode_id);
+    }
+    for (uint32_t id : targets.ids) {
+        Inode target = Inode::read_inode(id);
+        target.i_mode = mode | (target.i_mode & COMPRESSED_MODE); // 压缩属性不变
+        target.save_inode();
+    }
+    skipped = targets.skipped;
+    return static_cast<uint32_t>(targets.ids.size());
+}
+
+/**
+ * @brief 通配符匹配, *匹配任意个字符, ?匹配一个字符
+ * @param pattern 通配符
+ * @param name 名字
+ * @return 是否匹配
+ */
+bool match_glob(const std::string &pattern, const std::string &name) {
+    size_t p = 0, n = 0;
+    size_t star = std::string::npos, resume = 0; // 最近的*和它之后从名字的哪里重新匹配
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+/**
+ * @brief 目录项是否满足查找条件
+ * @param name 目录项的名字
+ * @param entry_type 目录项的类型
+ * @param inode 目录项的inode, needs_inode()为假时可以为空
+ */
+bool FindQuery::matches(const std::string &name, uint8_t entry_type, const Inode *inode) const {
+    if ((type != -1 && entry_type != type) || (!pattern.empty() && !match_glob(pattern, name))) {
+        return false;
+    }
+    if (!needs_inode()) {
+        return true;
+    }
+    return inode->i_size >= min_size && inode->i_size <= max_size && inode->i_mtime >= min_mtime && inode->i_mtime <= max_mtime;
+}
+
+/**
+ * @brief 并行遍历整棵目录树建立索引
+ */
+void NameIndex::build() {
+    using Found = std::vector<std::pair<std::string, Entry>>;
+    TreeWalk<Found> walk(
+        [](uint32_t dir_id, std::vector<uint32_t> &children) {
+            Found found;
+            std::vector<uint32_t> blocks = BlockMap(Inode::read_inode(dir_id).i_indirect).blocks();
+            for (uint32_t n = 0; n < blocks.size(); n++) {
+                DirBlock db = DirBlock::read_dir_block(blocks[n]);
+                for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+                    if (db.entries[j].type == UNDEFINE_TYPE) {
+                        continue;
                     }
-                } else if (cur_db.entries[j].type == FILE_TYPE) {
-                    if (!del_file(cur_db.entries[j].name, dir_inode, _shell_output)) {
-                        return false;
+                    if (db.entries[j].type == DIR_TYPE) {
+                        children.push_back(db.entries[j].inode_id);
                     }
+                    found.push_back({db.entries[j].name, Entry{db.entries[j].inode_id, dir_id, Inode::read_inode(db.entries[j].inode_id).i_ctime}});
                 }
             }
-            block_bitmap.free_block(cur_ib.index[i]);
-        }
-        if (cur_ib.next_index == UINT32_MAX) {
-            // 释放最后一个索引块
-            block_bitmap.free_block(cur_ib.block_id);
-            break;
+            return found;
+        },
+        [](Found &into, Found &from) { into.insert(into.end(), from.begin(), from.end()); });
+    names.clear();
+    for (auto &item : walk.run(0)) {
+        names[item.first].push_back(item.second);
+    }
+    built = true;
+}
+
+/**
+ * @brief 丢弃索引, 用于格式化, 下次查找时重新建立
+ */
+void NameIndex::clear() {
+    names.clear();
+    built = false;
+}
+
+/**
+ * @brief 创建文件或目录后加入索引, 索引还没建立时不需要维护
+ * @param name 名字
+ * @param inode 新的inode
+ * @param parent_id 所在目录
+ */
+void NameIndex::add(const std::string &name, const Inode &inode, uint32_t parent_id) {
+    if (built) {
+        names[name].push_back(Entry{inode.i_id, parent_id, inode.i_ctime});
+    }
+}
+
+/**
+ * @brief 删除文件或目录后移出索引
+ * @param name 名字
+ * @param inode_id 删除的inode
+ */
+void NameIndex::remove(const std::string &name, uint32_t inode_id) {
+    auto it = names.find(name);
+    if (it == names.end()) {
+        return;
+    }
+    std::vector<Entry> &entries = it->second;
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [inode_id](const Entry &entry) { return entry.inode_id == inode_id; }), entries.end());
+    if (entries.empty()) {
+        names.erase(it);
+    }
+}
+
+/**
+ * @brief 查找名字匹配通配符的索引项
+ * 通配符第一个*或?之前的部分是固定前缀, 只查找以它开头的一段名字
+ * @param pattern 通配符
+ * @return 名字和索引项
+ */
+std::vector<std::pair<std::string, NameIndex::Entry>> NameIndex::lookup(const std::string &pattern) const {
+    std::vector<std::pair<std::string, Entry>> result;
+    std::string prefix = pattern.substr(0, pattern.find_first_of("*?"));
+    for (auto it = names.lower_bound(prefix); it != names.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        if (match_glob(pattern, it->first)) {
+            for (const Entry &entry : it->second) {
+                result.push_back({it->first, entry});
+            }
         }
-        // 释放当前索引块，更新下一个索引块
-        block_bitmap.free_block(cur_ib.block_id);
-        cur_ib = IndexBlock::read_index_block(cur_ib.next_index);
     }
-    inode_bitmap.free_inode(dir_inode_id);
-    Inode parent_inode = Inode::read_inode(parent_inode_id);
-    IndexBlock parent_ib = IndexBlock::read_index_block(parent_inode.i_indirect);
-    bool found = false;
-    while (true) {
-        for (uint32_t i = 0; i < 254; i++) {
-            if (parent_ib.index[i] == UINT32_MAX) {
-                break;
+    return result;
+}
+
+/**
+ * @brief 在目录树中查找文件和目录
+ * 给出名字时从索引中取出候选项, 再沿所在目录向上确认它仍在目录树中、位于起始目录之下且经过的目录都可读, 每个目录只确认一次;
+ * 否则并行遍历起始目录下的目录树, 与dir -s一样跳过不可读的目录
+ * @param dir_id 起始目录, 结果不包括它自己
+ * @param query 查找条件
+ * @param cur_user 当前用户
+ * @param use_index 有名字时是否使用索引
+ * @return 按路径排序的结果, 目录以/结尾
+ */
+std::vector<std::string> find_files(uint32_t dir_id, const FindQuery &query, User cur_user, bool use_index) {
+    std::vector<std::string> result;
+    if (use_index && !query.pattern.empty()) {
+        if (!name_index.built) {
+            name_index.build();
+        }
+        // 候选项所在的目录按目录记下结果: 是否在起始目录之下且一路可读, 以及路径
+        std::map<uint32_t, std::pair<bool, std::string>> dirs;
+        std::function<const std::pair<bool, std::string> &(uint32_t)> resolve = [&](uint32_t id) -> const std::pair<bool, std::string> & {
+            auto it = dirs.find(id);
+            if (it != dirs.end()) {
+                return it->second;
             }
-            DirBlock parent_db = DirBlock::read_dir_block(parent_ib.index[i]);
-            for (int j = 0; j < 32; j++) {
-                if (parent_db.entries[j].type == UNDEFINE_TYPE) {
-                    continue;
+            std::pair<bool, std::string> state = {false, ""};
+            Inode dir_inode = Inode::read_inode(id);
+            if (id == dir_id) {
+                state = {is_able_to_read(id, cur_user), get_absolute_path(id)};
+            } else if (id != 0 && dir_inode.i_links_count > 0) {
+                uint32_t parent_id = DirBlock::read_dir_block(BlockMap(dir_inode.i_indirect).lookup(0)).entries[1].inode_id; // 第二项是父目录
+                std::pair<bool, std::string> parent = resolve(parent_id);
+                std::string name;
+                if (parent.first && is_able_to_read(id, cur_user) && get_entry_name(Inode::read_inode(parent_id), id, name)) {
+                    state = {true, parent.second + name + "/"};
                 }
-                if (parent_db.entries[j].inode_id == dir_inode_id) {
-                    parent_db.entries[j].type = UNDEFINE_TYPE;
-                    parent_db.entries[j].inode_id = UINT16_MAX;
-                    parent_db.entries[j].name[0] = '\0';
-                    parent_db.save_dir_block(parent_ib.index[i]);
-                    found = true;
-                    break;
+            }
+            return dirs[id] = state;
+        };
+        for (const auto &item : name_index.lookup(query.pattern)) {
+            const NameIndex::Entry &entry = item.second;
+            Inode inode = Inode::read_inode(entry.inode_id);
+            if (inode.i_links_count == 0 || inode.i_ctime != entry.ctime || !query.matches(item.first, static_cast<uint8_t>(inode.i_type), &inode)) {
+                continue;
+            }
+            const std::pair<bool, std::string> &parent = resolve(entry.parent_id);
+            if (parent.first) {
+                result.push_back(parent.second + item.first + (inode.i_type == DIR_TYPE ? "/" : ""));
+            }
+        }
+    } else {
+        TreeWalk<std::vector<std::string>> walk(
+            [&query, &cur_user](uint32_t id, std::vector<uint32_t> &children) {
+                std::vector<std::string> found;
+                if (!is_able_to_read(id, cur_user)) {
+                    return found;
+                }
+                Inode dir_inode = Inode::read_inode(id);
+                std::string path = get_absolute_path(id);
+                std::vector<uint32_t> blocks = BlockMap(dir_inode.i_indirect).blocks();
+                for (uint32_t n = 0; n < blocks.size(); n++) {
+                    DirBlock db = DirBlock::read_dir_block(blocks[n]);
+                    for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+                        const DirEntry &entry = db.entries[j];
+                        if (entry.type == UNDEFINE_TYPE) {
+                            continue;
+                        }
+                        if (entry.type == DIR_TYPE) {
+                            children.push_back(entry.inode_id);
+                        }
+                        Inode inode;
+                        if (query.needs_inode()) {
+                            inode = Inode::read_inode(entry.inode_id);
+                        }
+                        if (query.matches(entry.name, entry.type, &inode)) {
+                            found.push_back(path + entry.name + (entry.type == DIR_TYPE ? "/" : ""));
+                        }
+                    }
                 }
+                return found;
+            },
+            [](std::vector<std::string> &into, std::vector<std::string> &from) { into.insert(into.end(), from.begin(), from.end()); });
+        result = walk.run(dir_id);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+/**
+ * @brief 在一段内存中查找子串
+ * 支持AVX2时每次取32个起点, 同时比较子串的首字节和尾字节, 两者都相同的起点才比较中间部分;
+ * 不足32个的起点以及不支持AVX2时逐个查找首字节
+ * @param begin 查找范围的开头
+ * @param end 查找范围的结尾
+ * @param needle 子串, 不能为空
+ * @return 第一次出现的位置, 没有时返回end
+ */
+const char *find_substring(const char *begin, const char *end, const std::string &needle) {
+    size_t m = needle.size();
+    if (static_cast<size_t>(end - begin) < m) {
+        return end;
+    }
+    const char *last_start = end - m; // 最后一个可能的起点
+    const char *p = begin;
+#if defined(__AVX2__)
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    for (; p + 31 <= last_start; p += 32) {
+        __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + m - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last))));
+        while (mask != 0) {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+#else
+            unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+            if (m <= 2 || memcmp(p + bit + 1, needle.data() + 1, m - 2) == 0) {
+                return p + bit;
             }
-            if (found) {
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (p <= last_start) {
+        p = static_cast<const char *>(memchr(p, needle[0], static_cast<size_t>(last_start - p) + 1));
+        if (p == nullptr) {
+            return end;
+        }
+        if (memcmp(p + 1, needle.data() + 1, m - 1) == 0) {
+            return p;
+        }
+        p++;
+    }
+    return end;
+}
+
+/**
+ * @brief 在一个文件中查找子串
+ * 每次按区段读取GREP_CHUNK_BLOCKS个块接在上一段的末尾之后查找; 上一段末尾保留子串长度减一个字节和显示用的上下文,
+ * 跨越块边界的匹配也能找到。同一行只记一次, 离这一段末尾太近的匹配留到下一段, 保证显示的内容完整
+ * @param file_inode 文件的inode
+ * @param pattern 子串, 不能为空
+ * @return 匹配的行
+ */
+GrepResult grep_file(const Inode &file_inode, const std::string &pattern) {
+    GrepResult result;
+    std::string buffer;      // 上一段保留的末尾和新读到的一段
+    size_t resume = 0;       // 下一次从buffer中的哪里开始查找
+    uint64_t base_line = 1;  // buffer开头所在的行号
+    uint64_t last_line = 0;  // 最近一次匹配所在的行号
+    Extent cursor = {0, 0, 0};
+    for (uint64_t offset = 0; offset < file_inode.i_size;) {
+        std::string chunk = read_file_range(file_inode, offset, geometry.offset(GREP_CHUNK_BLOCKS), &cursor);
+        if (chunk.empty()) {
+            break;
+        }
+        offset += chunk.size();
+        buffer += chunk;
+        const char *begin = buffer.data();
+        const char *end = begin + buffer.size();
+        // 起点在stop之后的匹配后面的内容还没读到, 留到下一段
+        const char *stop = offset >= file_inode.i_size ? end : end - std::min<size_t>(buffer.size(), GREP_LINE_WIDTH);
+        const char *counted = begin; // 已经数过换行符的位置
+        uint64_t line = base_line;   // counted所在的行号
+        const char *p = begin + resume;
+        while (true) {
+            const char *found = find_substring(p, end, pattern);
+            if (found == end) {
+                p = std::max(p, end - std::min(buffer.size(), pattern.size() - 1));
                 break;
             }
+            if (found >= stop) {
+                p = found;
+                break;
+            }
+            line += std::count(counted, found, '\n');
+            counted = found;
+            const char *newline = static_cast<const char *>(memchr(found, '\n', static_cast<size_t>(end - found)));
+            if (line != last_line) {
+                last_line = line;
+                result.count++;
+                if (result.lines.size() < GREP_MAX_LINES) {
+                    // 显示匹配前最多GREP_CONTEXT个字符, 不跨过行首
+                    const char *show = std::max(begin, found - std::min<ptrdiff_t>(found - begin, GREP_CONTEXT));
+                    for (const char *c = found; c > show; --c) {
+                        if (c[-1] == '\n') {
+                            show = c;
+                            break;
+                        }
+                    }
+                    std::string text(show, std::min<size_t>(static_cast<size_t>((newline ? newline : end) - show), GREP_LINE_WIDTH));
+                    std::replace_if(text.begin(), text.end(), [](char c) { return static_cast<unsigned char>(c) < ' '; }, ' ');
+                    result.lines.push_back(std::to_string(line) + ":" + text);
+                }
+            }
+            p = newline ? newline + 1 : end;
         }
-        if (found || parent_ib.next_index == UINT32_MAX) {
-            break;
+        // 保留继续查找和显示上下文需要的末尾
+        const char *keep = std::max(begin, p - std::min<ptrdiff_t>(p - begin, GREP_CONTEXT));
+        base_line = keep >= counted ? line + std::count(counted, keep, '\n') : line - std::count(keep, counted, '\n');
+        resume = static_cast<size_t>(p - keep);
+        buffer.erase(0, static_cast<size_t>(keep - begin));
+    }
+    return result;
+}
+
+/**
+ * @brief 在文件或目录树的所有文件中查找子串
+ * 并行遍历目录树列出可读的文件, 再由线程池中的多个线程各自查找一部分文件, 结果按路径顺序输出
+ * @param inode_id 文件或目录的inode_id
+ * @param path 文件或目录的路径
+ * @param pattern 子串, 不能为空
+ * @param cur_user 当前用户
+ * @param names_only 只列出文件名和匹配的行数
+ * @return 输出信息
+ */
+std::string grep_files(uint32_t inode_id, const std::string &path, const std::string &pattern, User cur_user, bool names_only) {
+    using Files = std::vector<std::pair<std::string, uint32_t>>;
+    Files files;
+    if (Inode::read_inode(inode_id).i_type != DIR_TYPE) {
+        files.push_back({path, inode_id});
+    } else {
+        TreeWalk<Files> walk(
+            [&cur_user](uint32_t dir_id, std::vector<uint32_t> &children) {
+                Files found;
+                if (!is_able_to_read(dir_id, cur_user)) {
+                    return found;
+                }
+                std::string dir_path = get_absolute_path(dir_id);
+                std::vector<uint32_t> blocks = BlockMap(Inode::read_inode(dir_id).i_indirect).blocks();
+                for (uint32_t n = 0; n < blocks.size(); n++) {
+                    DirBlock db = DirBlock::read_dir_block(blocks[n]);
+                    for (uint32_t j = n == 0 ? 2 : 0; j < geometry.dir_entries(); j++) { // 跳过第一个目录块中的当前目录和父目录
+                        if (db.entries[j].type == DIR_TYPE) {
+                            children.push_back(db.entries[j].inode_id);
+                        } else if (db.entries[j].type == FILE_TYPE) {
+                            found.push_back({dir_path + db.entries[j].name, db.entries[j].inode_id});
+                        }
+                    }
+                }
+                return found;
+            },
+            [](Files &into, Files &from) { into.insert(into.end(), from.begin(), from.end()); });
+        files = walk.run(inode_id);
+        std::sort(files.begin(), files.end());
+    }
+    std::vector<GrepResult> results(files.size());
+    {
+        WorkPool pool;
+        for (size_t k = 0; k < files.size(); k++) {
+            auto task = [&files, &results, &pattern, &cur_user, k] {
+                if (is_able_to_read(files[k].second, cur_user)) {
+                    results[k] = grep_file(Inode::read_inode(files[k].second), pattern);
+                }
+            };
+            if (!pool.spawn(task)) {
+                task();
+            }
         }
-        parent_ib = IndexBlock::read_index_block(parent_ib.next_index);
+        pool.wait();
     }
-    return true;
+    uint64_t total = 0;
+    size_t matched = 0;
+    std::string lines;
+    for (size_t k = 0; k < files.size(); k++) {
+        if (results[k].count == 0) {
+            continue;
+        }
+        total += results[k].count;
+        matched++;
+        if (names_only) {
+            lines += files[k].first + ": " + std::to_string(results[k].count) + "行\n";
+            continue;
+        }
+        for (const std::string &line : results[k].lines) {
+            lines += files[k].first + ":" + line + "\n";
+        }
+        if (results[k].count > results[k].lines.size()) {
+            lines += files[k].first + ": 另有" + std::to_string(results[k].count - results[k].lines.size()) + "行\n";
+        }
+    }
+    return "在" + std::to_string(files.size()) + "个文件中查找, " + std::to_string(matched) + "个文件共" + std::to_string(total) + "行匹配\n" + lines;
 }
 
 /**
@@ -1519,7 +6778,7 @@ bool adduser(const std::string &user, const std::string &password, uint32_t uid,
  */
 bool is_able_to_write(const uint32_t inode_id, const User cur_user) {
     Inode inode = Inode::read_inode(inode_id);
-    uint32_t mode = inode.i_mode;
+    uint32_t mode = inode.permission();
     if (inode.i_uid == cur_user.uid) {
         return (mode / 100 & 2) != 0;// 检查用户写权限
     } else if (inode.i_gid == cur_user.gid) {
@@ -1537,7 +6796,7 @@ bool is_able_to_write(const uint32_t inode_id, const User cur_user) {
  */
 bool is_able_to_read(const uint32_t inode_id, const User cur_user) {
     Inode inode = Inode::read_inode(inode_id);
-    uint32_t mode = inode.i_mode;
+    uint32_t mode = inode.permission();
     if (inode.i_uid == cur_user.uid) {
         return (mode / 100 & 4) != 0;// 检查用户读权限
     } else if (inode.i_gid == cur_user.gid) {
@@ -1556,7 +6815,7 @@ bool is_able_to_read(const uint32_t inode_id, const User cur_user) {
  */
 bool is_able_to_execute(const uint32_t inode_id, const User cur_user) {
     Inode inode = Inode::read_inode(inode_id);
-    uint32_t mode = inode.i_mode;
+    uint32_t mode = inode.permission();
     if (inode.i_uid == cur_user.uid) {
         return (mode/100 & 1) != 0; // 检查用户执行权限
     } else if (inode.i_gid == cur_user.gid) {
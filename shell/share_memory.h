@@ -11,8 +11,6 @@
 /**** 声明  *****/
 
 struct UserShareMemory;
-struct OpenedFileTable;
-struct OpenedFile;
 struct SharedMemory;
 
 /**** 定义  *****/
@@ -36,88 +34,12 @@ struct UserShareMemory {
     bool is_login_fail;
 };
 
-/**
- * 打开文件的信息
- */
-struct OpenedFile {
-    int inode_id;  // 文件的inode id
-    bool is_write; // 是否写
-};
-
-/**
- * 打开文件表
- * 用于控制文件的读写
- */
-struct OpenedFileTable {
-    OpenedFile opened_file[10]; // 最多10个打开文件
-    OpenedFileTable() {
-        for (int i = 0; i < 10; ++i) {
-            opened_file[i].inode_id = -1;
-            opened_file[i].is_write = false;
-        }
-    }
-
-    /**
-     * @brief 获取一个空闲的文件
-     * @return 空闲文件的下标
-     */
-    int get_free_file() {
-        for (int i = 0; i < 10; ++i) {
-            if (opened_file[i].inode_id == -1) {
-                return i;
-            }
-        }
-        return -1;
-    }
-
-    /**
-     * @brief 添加文件到打开文件表
-     * @param inode_id 文件的inode id
-     */
-    void add_file(int inode_id, bool is_write) {
-        int free_file = get_free_file();
-        if (free_file != -1) {
-            opened_file[free_file].inode_id = inode_id;
-            opened_file[free_file].is_write = is_write;
-        }
-    }
-
-    /**
-     * @brief 关闭文件
-     */
-    void close_file(int inode_id) {
-        for (int i = 0; i < 10; ++i) {
-            if (opened_file[i].inode_id == inode_id) {
-                opened_file[i].inode_id = -1;
-                opened_file[i].is_write = false;
-                break;
-            }
-        }
-    }
-
-    /**
-     * @brief 判断文件是否正在写
-     * @param inode_id 文件的inode id
-     * @return 是否正在写
-     */
-    bool is_writing(int inode_id) {
-        for (int i = 0; i < 10; ++i) {
-            if (opened_file[i].inode_id == inode_id) {
-                return opened_file[i].is_write;
-            }
-        }
-        return false;
-    }
-};
-
 /**
  * 共享内存结构体, 用于进程间通信
  * UserShareMemory: 每个用户的信息
- * OpenedFileTable: 打开文件表
  */
 struct SharedMemory {
     UserShareMemory user_list[10];   // 最多10个用户
-    OpenedFileTable open_file_table; // 最多10个打开文件
 
     /**
      * @brief 获取一个空闲的用户
@@ -114,71 +114,6 @@ int main() {
             continue;
         }
 
-        /***** 判断是否互斥   ********/
-        std::string input, cmd, tmp_arg;
-        std::vector<std::string> args;
-        std::istringstream iss(command);
-        iss >> cmd;
-        while (iss >> tmp_arg) {
-            args.push_back(tmp_arg);
-        }
-        // 解析参数
-        std::map<std::string, std::string> options;
-        std::string arg;
-        for (size_t i = 0; i < args.size(); ++i) {
-            if (args[i].front() == '-') {
-                // 检查是否有参数
-                if (i + 1 < args.size() && args[i + 1].front() != '-') {
-                    options[args[i]] = args[i + 1];
-                    ++i; // 跳过参数
-                } else {
-                    options[args[i]] = "true";
-                }
-            } else {
-                // 将最后一个非选项参数赋值给 arg
-                arg = args[i];
-            }
-        }
-        if (arg.empty() && !args.empty()) {
-            arg = args.back();
-        }
-        // 确保arg是文件名
-        if (arg.find("-") == std::string::npos) {
-            // 将args分为文件名和路径
-            size_t pos = arg.find_last_of('/');
-            std::string file_path, file_name;
-            if (pos != std::string::npos) {
-                file_path = arg.substr(0, pos + 1);
-                file_name = arg.substr(pos + 1);
-            } else {
-                file_path = "";
-                file_name = arg;
-            }
-            if (arg.front() != '/') {
-                file_path = get_absolute_path(shm->user_list[cur_label].cur_dir_inode_id) + file_path;
-            }
-            // 得到文件inode号，判断是否发生互斥
-            uint32_t start_id = 0;
-            if (is_dir_exit(file_path, start_id)) { // 目录存在
-                Inode __dir_inode = Inode::read_inode(start_id);
-                uint32_t file_id = get_file_inode_id(file_name, __dir_inode);
-                if (cmd == "cat" || cmd == "copy" || cmd == "del" || cmd == "newfile") {
-                    if (shm->open_file_table.is_writing(file_id)) {
-                        std::cout << __ERROR << "文件" << file_name << "正在被写入" << __NORMAL << std::endl;
-
-                        // 输出shm->result的最后一行
-                        std::string result = shm->user_list[cur_label].result;
-                        size_t last_newline = result.find_last_of('\n');
-                        if (last_newline != std::string::npos) {
-                            std::cout << result.substr(last_newline + 1);
-                        } else {
-                            std::cout << result;
-                        }
-                        continue;
-                    }
-                }
-            }
-        }
         strncpy(shm->user_list[cur_label].command, command.c_str(), sizeof(shm->user_list[cur_label].command) - 1);
         shm->user_list[cur_label].cur_user = cur_label;
         shm->user_list[cur_label].ready = true;
@@ -218,13 +153,28 @@ void print_help(SharedMemory *shm, int cur_user) {
     std::cout << __SUCCESS << std::left << std::setw(12) << "newfile: " << __NORMAL << "创建新文件" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "cat: " << __NORMAL << "显示文件内容或向文件追加内容" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "copy: " << __NORMAL << "复制文件" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "open: " << __NORMAL << "打开文件或列出已打开的文件" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "read: " << __NORMAL << "从打开的文件读取" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "write: " << __NORMAL << "向打开的文件写入" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "lseek: " << __NORMAL << "移动打开的文件的读写位置" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "close: " << __NORMAL << "关闭打开的文件" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "fsync: " << __NORMAL << "把打开的文件的缓冲写入磁盘" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "del: " << __NORMAL << "删除文件" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "move: " << __NORMAL << "移动或重命名文件和目录" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "check: " << __NORMAL << "检查文件或目录" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "dir|ls: " << __NORMAL << "显示目录内容" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "find: " << __NORMAL << "查找文件和目录" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "grep: " << __NORMAL << "在文件中查找字符串" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "du: " << __NORMAL << "显示目录占用的空间" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "chmod: " << __NORMAL << "修改文件或目录的权限" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "compress: " << __NORMAL << "设置文件的压缩属性" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "clear|cls: " << __NORMAL << "清空屏幕" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "adduser: " << __NORMAL << "添加用户" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "quota: " << __NORMAL << "显示或设置磁盘配额" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "snapshot: " << __NORMAL << "管理文件系统快照" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "shutdown: " << __NORMAL << "退出登录并关闭系统" << std::endl;
     std::cout << __SUCCESS << std::left << std::setw(12) << "init: " << __NORMAL << "格式化磁盘" << std::endl;
+    std::cout << __SUCCESS << std::left << std::setw(12) << "resize: " << __NORMAL << "在线扩容磁盘" << std::endl;
     std::cout << "使用" << __SUCCESS << "<command> -h " << __NORMAL << "查看命令的具体使用方法" << std::endl;
     std::cout << "注意：命令不区分大小写" << std::endl;
     // 输出shm->result的最后一行